@@ -0,0 +1,82 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+#ifndef BGEN_PROBES_H_INCLUDED
+#define BGEN_PROBES_H_INCLUDED
+
+/*
+ *  Static tracepoints (USDT) for perf and bpftrace, enabled with
+ *  configure --enable-sdt. Without it, the macros expand to nothing.
+ *  Include this after config.h.
+ *
+ *  All probes belong to the provider "gmerlin_encoders". The first
+ *  argument is the name of the codec or multiplexer, the second one
+ *  identifies the stream: the stream index for multiplexers (-1 if
+ *  the write isn't for a single stream) and the address of the codec
+ *  context for codecs.
+ *
+ *  frame_in   (name, id, pts, duration)
+ *    A frame was passed to a codec. The timescale is the one of the
+ *    stream (the samplerate for audio).
+ *
+ *  packet_out (name, id, pts, duration, bytes)
+ *    A codec produced a packet.
+ *
+ *  page_out   (name, id, pts, bytes, packets)
+ *    A multiplexer produced output: An Ogg page (pts is the
+ *    granulepos) or a packet written with av_write_frame().
+ *
+ *  io_start   (name, id, bytes)
+ *  io_done    (name, id, bytes)
+ *    Around each write to the output. For streaming, io_start is
+ *    before waiting for the server.
+ */
+
+#ifdef HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define BGEN_PROBE_FRAME_IN(name, id, pts, duration)                    \
+  DTRACE_PROBE4(gmerlin_encoders, frame_in, name, id, pts, duration)
+
+#define BGEN_PROBE_PACKET_OUT(name, id, pts, duration, bytes)           \
+  DTRACE_PROBE5(gmerlin_encoders, packet_out, name, id, pts, duration, bytes)
+
+#define BGEN_PROBE_PAGE_OUT(name, id, pts, bytes, packets)              \
+  DTRACE_PROBE5(gmerlin_encoders, page_out, name, id, pts, bytes, packets)
+
+#define BGEN_PROBE_IO_START(name, id, bytes)                            \
+  DTRACE_PROBE3(gmerlin_encoders, io_start, name, id, bytes)
+
+#define BGEN_PROBE_IO_DONE(name, id, bytes)                             \
+  DTRACE_PROBE3(gmerlin_encoders, io_done, name, id, bytes)
+
+#else
+
+#define BGEN_PROBE_FRAME_IN(name, id, pts, duration)
+#define BGEN_PROBE_PACKET_OUT(name, id, pts, duration, bytes)
+#define BGEN_PROBE_PAGE_OUT(name, id, pts, bytes, packets)
+#define BGEN_PROBE_IO_START(name, id, bytes)
+#define BGEN_PROBE_IO_DONE(name, id, bytes)
+
+#endif
+
+#endif // BGEN_PROBES_H_INCLUDED
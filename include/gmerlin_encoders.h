@@ -19,6 +19,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  * *****************************************************************/
 
+#ifndef GMERLIN_ENCODERS_H_INCLUDED
+#define GMERLIN_ENCODERS_H_INCLUDED
+
 #include <stdio.h>
 #include <gmerlin/plugin.h>
 #include <gmerlin/utils.h>
@@ -35,3 +38,147 @@ bgen_id3v1_t * bgen_id3v1_create(const gavl_dictionary_t*);
 int bgen_id3v1_write(gavf_io_t * output, const bgen_id3v1_t *);
 
 void bgen_id3v1_destroy(bgen_id3v1_t *);
+
+/* Performance counters */
+
+typedef struct
+  {
+  int64_t frames;          /* Frames (video) or samples (audio) in */
+  int64_t packets;         /* Packets or pages out                 */
+  int64_t bytes;           /* Bytes out                            */
+  int64_t write_calls;     /* Calls to the output                  */
+
+  gavl_time_t codec_wall;  /* Time spent inside the codec calls    */
+  gavl_time_t codec_cpu;   /* CPU time of the calling thread       */
+  gavl_time_t mux_time;    /* Time spent in the multiplexer        */
+  gavl_time_t io_time;     /* Time spent writing to the output     */
+
+  int64_t duration;        /* Encoded duration in timescale tics   */
+  int timescale;
+
+  gavl_time_t start;       /* Wall clock time of the first call    */
+  gavl_time_t end;         /* Wall clock time of the last call     */
+
+  unsigned int seq;        /* Odd while the counters are changed   */
+  } bgen_stats_t;
+
+typedef struct
+  {
+  gavl_time_t wall;
+  gavl_time_t cpu;
+  } bgen_stats_clock_t;
+
+void bgen_stats_init(bgen_stats_t * s, int timescale);
+
+/*
+ *  The counters are read by bgen_stats_query() from other threads.
+ *  Bracket all changes of the members with these, so readers never see
+ *  half updated counters. There must be only one writing thread, the
+ *  functions below take care of this themselves.
+ */
+
+void bgen_stats_lock(bgen_stats_t * s);
+void bgen_stats_unlock(bgen_stats_t * s);
+
+/* Monotonic wall clock time */
+gavl_time_t bgen_stats_time(void);
+
+/* Bracket the codec calls with these */
+void bgen_stats_codec_start(bgen_stats_t * s, bgen_stats_clock_t * c);
+void bgen_stats_codec_end(bgen_stats_t * s, const bgen_stats_clock_t * c);
+
+/* Add the time since start to *t */
+void bgen_stats_add_time(bgen_stats_t * s, gavl_time_t start, gavl_time_t * t);
+
+double bgen_stats_realtime_factor(const bgen_stats_t * s);
+
+/* Log the nonzero counters (GAVL_LOG_INFO) */
+void bgen_stats_log(const bgen_stats_t * s, const char * domain,
+                    const char * label);
+
+/*
+ *  Counters in use are registered, so the host can query them while
+ *  encoding. Register again to change the label, unregister before
+ *  the counters are freed. The host finds bgen_stats_query() with
+ *  dlsym() in the plugin module.
+ */
+
+void bgen_stats_register(const bgen_stats_t * s, const char * domain,
+                         const char * label);
+void bgen_stats_unregister(const bgen_stats_t * s);
+
+/* Keys of the dictionaries. Times are in GAVL_TIME_SCALE units */
+
+#define BGEN_STATS_DOMAIN      "domain"
+#define BGEN_STATS_LABEL       "label"
+#define BGEN_STATS_FRAMES      "frames"
+#define BGEN_STATS_PACKETS     "packets"
+#define BGEN_STATS_BYTES       "bytes"
+#define BGEN_STATS_WRITE_CALLS "write_calls"
+#define BGEN_STATS_CODEC_WALL  "codec_wall"
+#define BGEN_STATS_CODEC_CPU   "codec_cpu"
+#define BGEN_STATS_MUX_TIME    "mux_time"
+#define BGEN_STATS_IO_TIME     "io_time"
+#define BGEN_STATS_REALTIME    "realtime_factor"
+
+void bgen_stats_to_dictionary(const bgen_stats_t * s, gavl_dictionary_t * dict);
+
+/* Append one dictionary per registered counter set to ret,
+   returns the number of appended dictionaries */
+int bgen_stats_query(gavl_array_t * ret);
+
+/*
+ *  Latency tracing: Set the environment variable BGEN_TRACE=1 to
+ *  record, how long it takes from a frame entering an encoder until
+ *  the packets (encode stage) and the bytes (output stage) containing
+ *  it come out. BGEN_TRACE_INTERVAL=<seconds> dumps the histograms
+ *  periodically, otherwise they are dumped when the trace is destroyed.
+ *
+ *  bgen_trace_create() returns NULL if tracing is disabled, so each
+ *  trace point costs only a NULL check.
+ */
+
+#define BGEN_TRACE_ENCODE    0
+#define BGEN_TRACE_OUTPUT    1
+#define BGEN_TRACE_NUM_STAGES 2
+
+typedef struct bgen_trace_s bgen_trace_t;
+
+bgen_trace_t * bgen_trace_create(const char * domain, const char * label);
+void bgen_trace_destroy(bgen_trace_t * t);
+
+/* Log p50/p99/max of each stage */
+void bgen_trace_dump(bgen_trace_t * t);
+
+/* Codec side: A frame came in and a packet came out. The packet is
+   matched with the frames by timestamps, so the codec delay is taken
+   into account. */
+void bgen_trace_frame(bgen_trace_t * t, int64_t pts, int64_t duration);
+void bgen_trace_packet(bgen_trace_t * t, int64_t pts, int64_t duration);
+
+/* Output side: Remember the input time of the packet, which was just
+   passed from the codec (or now for packets, which didn't come from a
+   traced codec), and record the output stage when the bytes containing
+   the next num packets are written. */
+void bgen_trace_queue(bgen_trace_t * t);
+void bgen_trace_write(bgen_trace_t * t, int num);
+
+/*
+ *  Thread budget of the process (one thread per CPU core).
+ *  Encoders, which will reserve an automatic thread count, register
+ *  when they are created and unregister after reserving, so the threads
+ *  are split fairly among them. Explicit counts are always honored but
+ *  still count against the budget.
+ */
+
+int bgen_threads_get_num_cpus(void);
+
+void bgen_threads_register(void);
+void bgen_threads_unregister(void);
+
+/* 0 means automatic. Returns the number of threads to use (at least 1),
+   which must be passed to bgen_threads_release() later */
+int bgen_threads_reserve(int wanted);
+void bgen_threads_release(int num);
+
+#endif // GMERLIN_ENCODERS_H_INCLUDED
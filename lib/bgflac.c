@@ -29,6 +29,8 @@
 
 #include <config.h>
 #include <bgflac.h>
+#include <gmerlin_encoders.h>
+#include <bgen_probes.h>
 
 #include <gmerlin/log.h>
 #define LOG_DOMAIN "flacenc"
@@ -68,6 +70,15 @@ struct bg_flac_s
   gavl_compression_info_t ci;
 
   FLAC__StreamMetadata_StreamInfo si;
+
+  /* Packets are written from within FLAC__stream_encoder_process(),
+     so the clock is paused in the write callback */
+  bgen_stats_t perf;
+  bgen_stats_clock_t clock;
+  int encoding;
+
+  bgen_trace_t * trace;
+  int64_t in_pts;
   };
 
 
@@ -268,10 +279,27 @@ write_callback(const FLAC__StreamEncoder *encoder,
     gp.pts = flac->pts;
     flac->pts += samples;
 
+    bgen_stats_lock(&flac->perf);
+    flac->perf.packets++;
+    flac->perf.bytes += bytes;
+    flac->perf.duration += samples;
+    bgen_stats_unlock(&flac->perf);
+
+    if(flac->trace)
+      bgen_trace_packet(flac->trace, gp.pts, gp.duration);
+
+    BGEN_PROBE_PACKET_OUT("flac", flac, gp.pts, gp.duration, bytes);
+    
+    if(flac->encoding)
+      bgen_stats_codec_end(&flac->perf, &flac->clock);
+    
     if(gavl_packet_sink_put_packet(flac->psink_out, &gp) != GAVL_SINK_OK)
       return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
-    else
-      return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+
+    if(flac->encoding)
+      bgen_stats_codec_start(&flac->perf, &flac->clock);
+    
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
     }
   return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
   }
@@ -384,11 +412,29 @@ encode_audio_func(void * priv, gavl_audio_frame_t * frame)
     do_shift(flac->buffer, flac->format->num_channels,
              frame->valid_samples, flac->divisor);
 
+  bgen_stats_lock(&flac->perf);
+  flac->perf.frames += frame->valid_samples;
+  bgen_stats_unlock(&flac->perf);
+
+  if(flac->trace)
+    bgen_trace_frame(flac->trace, flac->in_pts, frame->valid_samples);
+
+  BGEN_PROBE_FRAME_IN("flac", flac, flac->in_pts, frame->valid_samples);
+  flac->in_pts += frame->valid_samples;
+  
+  flac->encoding = 1;
+  bgen_stats_codec_start(&flac->perf, &flac->clock);
+  
   if(!FLAC__stream_encoder_process(flac->enc,
                                    (const FLAC__int32 **) flac->buffer,
                                    frame->valid_samples))
+    {
+    flac->encoding = 0;
     return 0;
-
+    }
+  
+  bgen_stats_codec_end(&flac->perf, &flac->clock);
+  flac->encoding = 0;
   return 1;
   }
 
@@ -464,6 +510,8 @@ bg_flac_start_uncompressed(bg_flac_t * flac,
   //    FLAC__stream_encoder_get_blocksize(flac->enc);
   
   gavl_compression_info_copy(ci, &flac->ci);
+  flac->perf.timescale = flac->format->samplerate;
+  flac->trace = bgen_trace_create(LOG_DOMAIN, "Encoder");
   return gavl_audio_sink_create(NULL, encode_audio_func, flac, flac->format);
   }
 
@@ -475,6 +523,11 @@ void bg_flac_free(bg_flac_t * flac)
   FLAC__stream_encoder_finish(flac->enc);
   FLAC__stream_encoder_delete(flac->enc);
 
+  bgen_stats_log(&flac->perf, LOG_DOMAIN, "Encoder");
+  bgen_stats_unregister(&flac->perf);
+  if(flac->trace)
+    bgen_trace_destroy(flac->trace);
+
   if(flac->buffer[0])
     {
     for(i = 0; i < flac->format->num_channels; i++)
@@ -533,6 +586,8 @@ bg_flac_t * bg_flac_create()
   flac->enc = FLAC__stream_encoder_new();
   flac->ci.id = GAVL_CODEC_ID_FLAC;
   gavl_buffer_alloc(&flac->ci.codec_header, BG_FLAC_HEADER_SIZE);
+  bgen_stats_init(&flac->perf, 0);
+  bgen_stats_register(&flac->perf, LOG_DOMAIN, "Encoder");
   return flac;
   }
 
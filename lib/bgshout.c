@@ -35,6 +35,7 @@
 
 
 #include <bgshout.h>
+#include <bgen_probes.h>
 
 struct bg_shout_s
   {
@@ -211,6 +212,8 @@ static void flush_metadata(bg_shout_t * s)
 
 int bg_shout_write(bg_shout_t * s, const uint8_t * data, int len)
   {
+  /* shout_sync() waits until the server wants more data */
+  BGEN_PROBE_IO_START("shout", -1, len);
   shout_sync(s->s);
   
   if(shout_send(s->s, data, len) != SHOUTERR_SUCCESS)
@@ -219,6 +222,7 @@ int bg_shout_write(bg_shout_t * s, const uint8_t * data, int len)
            shout_get_error(s->s));
     return 0;
     }
+  BGEN_PROBE_IO_DONE("shout", -1, len);
   s->bytes_sent += len;
   
   //   if(s->met && (s->bytes_sent > 32000))
@@ -0,0 +1,323 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Performance counters of the encoders. Each codec and multiplexer
+ *  keeps a bgen_stats_t and logs it when it's closed, so one can see
+ *  whether a job is bound by encoding, multiplexing or I/O. While they
+ *  are in use, the counters are registered, so the host can query them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <gmerlin_encoders.h>
+
+#include <gmerlin/log.h>
+
+static gavl_time_t get_clock(clockid_t id)
+  {
+  struct timespec ts;
+  if(clock_gettime(id, &ts))
+    return 0;
+  return (gavl_time_t)ts.tv_sec * GAVL_TIME_SCALE + ts.tv_nsec / 1000;
+  }
+
+/*
+ *  Sequence lock: The writer makes the sequence number odd while it
+ *  changes the counters. Readers copy the counters and retry if the
+ *  sequence number was odd or changed in the meantime.
+ */
+
+void bgen_stats_lock(bgen_stats_t * s)
+  {
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+
+void bgen_stats_unlock(bgen_stats_t * s)
+  {
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+  }
+
+static void get_snapshot(const bgen_stats_t * s, bgen_stats_t * ret)
+  {
+  unsigned int seq;
+  
+  while(1)
+    {
+    seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if(!(seq & 1))
+      {
+      memcpy(ret, s, sizeof(*ret));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if(__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+        break;
+      }
+    sched_yield();
+    }
+  }
+
+void bgen_stats_init(bgen_stats_t * s, int timescale)
+  {
+  unsigned int seq;
+  
+  /* Counters can be reset while they are registered. The sequence
+     number is made odd here, so it's even afterwards */
+  bgen_stats_lock(s);
+  seq = s->seq | 1;
+  memset(s, 0, sizeof(*s));
+  s->seq = seq;
+  s->timescale = timescale;
+  s->start = GAVL_TIME_UNDEFINED;
+  bgen_stats_unlock(s);
+  }
+
+gavl_time_t bgen_stats_time(void)
+  {
+  return get_clock(CLOCK_MONOTONIC);
+  }
+
+void bgen_stats_codec_start(bgen_stats_t * s, bgen_stats_clock_t * c)
+  {
+  c->wall = get_clock(CLOCK_MONOTONIC);
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  c->cpu  = get_clock(CLOCK_THREAD_CPUTIME_ID);
+#else
+  c->cpu  = 0;
+#endif
+  if(s->start == GAVL_TIME_UNDEFINED)
+    {
+    bgen_stats_lock(s);
+    s->start = c->wall;
+    bgen_stats_unlock(s);
+    }
+  }
+
+void bgen_stats_codec_end(bgen_stats_t * s, const bgen_stats_clock_t * c)
+  {
+  gavl_time_t end = get_clock(CLOCK_MONOTONIC);
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  gavl_time_t cpu = get_clock(CLOCK_THREAD_CPUTIME_ID) - c->cpu;
+#else
+  gavl_time_t cpu = 0;
+#endif
+
+  bgen_stats_lock(s);
+  s->end = end;
+  s->codec_wall += end - c->wall;
+  s->codec_cpu += cpu;
+  bgen_stats_unlock(s);
+  }
+
+void bgen_stats_add_time(bgen_stats_t * s, gavl_time_t start, gavl_time_t * t)
+  {
+  gavl_time_t end = get_clock(CLOCK_MONOTONIC);
+  
+  bgen_stats_lock(s);
+  s->end = end;
+  *t += end - start;
+
+  if(s->start == GAVL_TIME_UNDEFINED)
+    s->start = start;
+  bgen_stats_unlock(s);
+  }
+
+double bgen_stats_realtime_factor(const bgen_stats_t * s)
+  {
+  if((s->start == GAVL_TIME_UNDEFINED) || (s->end <= s->start) ||
+     !s->timescale)
+    return 0.0;
+
+  return ((double)s->duration / (double)s->timescale) /
+    gavl_time_to_seconds(s->end - s->start);
+  }
+
+/* Registry */
+
+typedef struct registry_entry_s
+  {
+  const bgen_stats_t * s;
+  char * domain;
+  char * label;
+  struct registry_entry_s * next;
+  } registry_entry_t;
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static registry_entry_t * registry = NULL;
+
+void bgen_stats_register(const bgen_stats_t * s, const char * domain,
+                         const char * label)
+  {
+  registry_entry_t * e;
+
+  pthread_mutex_lock(&registry_mutex);
+
+  for(e = registry; e; e = e->next)
+    {
+    if(e->s == s)
+      break;
+    }
+
+  if(!e)
+    {
+    e = calloc(1, sizeof(*e));
+    e->s = s;
+    e->next = registry;
+    registry = e;
+    }
+
+  e->domain = gavl_strrep(e->domain, domain);
+  e->label  = gavl_strrep(e->label, label);
+  
+  pthread_mutex_unlock(&registry_mutex);
+  }
+
+void bgen_stats_unregister(const bgen_stats_t * s)
+  {
+  registry_entry_t ** e;
+  registry_entry_t * tmp;
+
+  pthread_mutex_lock(&registry_mutex);
+
+  for(e = &registry; *e; e = &(*e)->next)
+    {
+    if((*e)->s == s)
+      {
+      tmp = *e;
+      *e = tmp->next;
+      if(tmp->domain)
+        free(tmp->domain);
+      if(tmp->label)
+        free(tmp->label);
+      free(tmp);
+      break;
+      }
+    }
+  
+  pthread_mutex_unlock(&registry_mutex);
+  }
+
+void bgen_stats_to_dictionary(const bgen_stats_t * stats, gavl_dictionary_t * dict)
+  {
+  bgen_stats_t snapshot;
+  const bgen_stats_t * s = &snapshot;
+
+  get_snapshot(stats, &snapshot);
+  
+  gavl_dictionary_set_long(dict, BGEN_STATS_FRAMES,      s->frames);
+  gavl_dictionary_set_long(dict, BGEN_STATS_PACKETS,     s->packets);
+  gavl_dictionary_set_long(dict, BGEN_STATS_BYTES,       s->bytes);
+  gavl_dictionary_set_long(dict, BGEN_STATS_WRITE_CALLS, s->write_calls);
+  gavl_dictionary_set_long(dict, BGEN_STATS_CODEC_WALL,  s->codec_wall);
+  gavl_dictionary_set_long(dict, BGEN_STATS_CODEC_CPU,   s->codec_cpu);
+  gavl_dictionary_set_long(dict, BGEN_STATS_MUX_TIME,    s->mux_time);
+  gavl_dictionary_set_long(dict, BGEN_STATS_IO_TIME,     s->io_time);
+  gavl_dictionary_set_float(dict, BGEN_STATS_REALTIME,   bgen_stats_realtime_factor(s));
+  }
+
+int bgen_stats_query(gavl_array_t * ret)
+  {
+  int num = 0;
+  gavl_value_t val;
+  gavl_dictionary_t * dict;
+  registry_entry_t * e;
+  
+  pthread_mutex_lock(&registry_mutex);
+
+  for(e = registry; e; e = e->next)
+    {
+    gavl_value_init(&val);
+    dict = gavl_value_set_dictionary(&val);
+
+    gavl_dictionary_set_string(dict, BGEN_STATS_DOMAIN, e->domain);
+    gavl_dictionary_set_string(dict, BGEN_STATS_LABEL,  e->label);
+    bgen_stats_to_dictionary(e->s, dict);
+    
+    gavl_array_splice_val_nocopy(ret, -1, 0, &val);
+    num++;
+    }
+  
+  pthread_mutex_unlock(&registry_mutex);
+  return num;
+  }
+
+void bgen_stats_log(const bgen_stats_t * s, const char * domain,
+                    const char * label)
+  {
+  char * str;
+  char * tmp;
+  double rt;
+  
+  if(s->start == GAVL_TIME_UNDEFINED)
+    return;
+
+  str = bg_sprintf("%s:", label);
+
+#define APPEND(...)                        \
+  tmp = bg_sprintf(__VA_ARGS__);           \
+  str = gavl_strcat(str, tmp);             \
+  free(tmp)
+  
+  if(s->frames)
+    {
+    APPEND(" %"PRId64" in,", s->frames);
+    }
+  if(s->packets)
+    {
+    APPEND(" %"PRId64" out (%"PRId64" bytes),", s->packets, s->bytes);
+    }
+  if(s->write_calls)
+    {
+    APPEND(" %"PRId64" write calls,", s->write_calls);
+    }
+  if(s->codec_wall)
+    {
+    APPEND(" codec %.3f s (cpu %.3f s),",
+           gavl_time_to_seconds(s->codec_wall),
+           gavl_time_to_seconds(s->codec_cpu));
+    }
+  if(s->mux_time)
+    {
+    APPEND(" mux %.3f s,", gavl_time_to_seconds(s->mux_time));
+    }
+  if(s->io_time)
+    {
+    APPEND(" io %.3f s,", gavl_time_to_seconds(s->io_time));
+    }
+  
+  rt = bgen_stats_realtime_factor(s);
+  if(rt > 0.0)
+    {
+    APPEND(" %.2fx realtime,", rt);
+    }
+#undef APPEND
+
+  /* Remove the trailing comma */
+  if(str[strlen(str)-1] == ',')
+    str[strlen(str)-1] = '\0';
+  
+  gavl_log(GAVL_LOG_INFO, domain, "%s", str);
+  free(str);
+  }
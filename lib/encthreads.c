@@ -0,0 +1,98 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Thread budget: One thread per CPU core, shared by all encoders of
+ *  the process. This file is built as its own shared library
+ *  (see Makefile.am), so all plugins loaded into a process use the
+ *  same counters. Encoders, which will ask for an automatic thread count,
+ *  register themselves when they are created. Each of them gets an equal
+ *  share of the threads left when it's opened, so the first encoder
+ *  doesn't starve the others.
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include <gmerlin_encoders.h>
+
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int budget_used    = 0;
+static int budget_pending = 0; // Registered, but nothing reserved yet
+
+int bgen_threads_get_num_cpus(void)
+  {
+  static int num_cpus = 0;
+
+  if(!num_cpus)
+    {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    num_cpus = (n > 0) ? n : 1;
+    }
+  return num_cpus;
+  }
+
+void bgen_threads_register(void)
+  {
+  pthread_mutex_lock(&budget_mutex);
+  budget_pending++;
+  pthread_mutex_unlock(&budget_mutex);
+  }
+
+void bgen_threads_unregister(void)
+  {
+  pthread_mutex_lock(&budget_mutex);
+  if(budget_pending > 0)
+    budget_pending--;
+  pthread_mutex_unlock(&budget_mutex);
+  }
+
+int bgen_threads_reserve(int wanted)
+  {
+  int ret;
+  pthread_mutex_lock(&budget_mutex);
+
+  if(!wanted) // Auto
+    {
+    ret = bgen_threads_get_num_cpus() - budget_used;
+
+    /* Leave something for the registered encoders, which
+       didn't reserve yet (the caller is one of them) */
+    if(budget_pending > 1)
+      ret /= budget_pending;
+    
+    if(ret < 1)
+      ret = 1;
+    }
+  else
+    ret = wanted;
+
+  budget_used += ret;
+  pthread_mutex_unlock(&budget_mutex);
+  return ret;
+  }
+
+void bgen_threads_release(int num)
+  {
+  pthread_mutex_lock(&budget_mutex);
+  budget_used -= num;
+  pthread_mutex_unlock(&budget_mutex);
+  }
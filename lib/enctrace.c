@@ -0,0 +1,303 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Per packet latency tracing.
+ *
+ *  The codecs stamp incoming frames with the monotonic clock and look up
+ *  the earliest frame overlapping each outgoing packet. The input time of
+ *  that packet is handed to the multiplexer of the same thread, which
+ *  queues it until the page or write containing the packet is done.
+ *
+ *  Latencies go into histograms with power of 2 buckets (in microseconds),
+ *  so the percentiles are accurate to a factor of 2.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <gmerlin_encoders.h>
+
+#include <gmerlin/log.h>
+
+#define NUM_BUCKETS 40
+#define MAX_FRAMES  1024
+
+static const char * stage_names[BGEN_TRACE_NUM_STAGES] =
+  {
+    "encode",
+    "output",
+  };
+
+typedef struct
+  {
+  int64_t pts;
+  int64_t end;
+  gavl_time_t t;
+  int used;
+  } frame_t;
+
+typedef struct
+  {
+  int64_t count;
+  int64_t buckets[NUM_BUCKETS];
+  gavl_time_t max;
+  } histogram_t;
+
+struct bgen_trace_s
+  {
+  const char * domain;
+  char * label;
+
+  /* Frames inside the codec (ring buffer) */
+  frame_t frames[MAX_FRAMES];
+  int frames_start;
+  int num_frames;
+  int64_t frames_dropped;
+  
+  /* Packets inside the multiplexer */
+  gavl_time_t * queue;
+  int queue_start;
+  int queue_len;
+  int queue_alloc;
+  
+  histogram_t h[BGEN_TRACE_NUM_STAGES];
+
+  gavl_time_t interval;
+  gavl_time_t last_dump;
+  };
+
+/* Input time of the packet, which the codec of this thread
+   passes to the multiplexer right now */
+static __thread gavl_time_t current = GAVL_TIME_UNDEFINED;
+
+bgen_trace_t * bgen_trace_create(const char * domain, const char * label)
+  {
+  bgen_trace_t * ret;
+  const char * var;
+  
+  if(!(var = getenv("BGEN_TRACE")) || !atoi(var))
+    return NULL;
+
+  ret = calloc(1, sizeof(*ret));
+  ret->domain = domain;
+  ret->label = gavl_strdup(label);
+
+  if((var = getenv("BGEN_TRACE_INTERVAL")))
+    ret->interval = (gavl_time_t)atoi(var) * GAVL_TIME_SCALE;
+  
+  ret->last_dump = bgen_stats_time();
+  return ret;
+  }
+
+void bgen_trace_destroy(bgen_trace_t * t)
+  {
+  bgen_trace_dump(t);
+  
+  if(t->queue)
+    free(t->queue);
+  free(t->label);
+  free(t);
+  }
+
+static void histogram_add(histogram_t * h, gavl_time_t latency)
+  {
+  int i = 0;
+
+  if(latency < 0)
+    latency = 0;
+  
+  while((latency > 1) && (i < NUM_BUCKETS - 1))
+    {
+    latency >>= 1;
+    i++;
+    }
+  h->buckets[i]++;
+  h->count++;
+  }
+
+static void record(bgen_trace_t * t, int stage, gavl_time_t start,
+                   gavl_time_t now)
+  {
+  histogram_t * h = &t->h[stage];
+  
+  histogram_add(h, now - start);
+  if(now - start > h->max)
+    h->max = now - start;
+  
+  if(t->interval && (now - t->last_dump > t->interval))
+    {
+    bgen_trace_dump(t);
+    t->last_dump = now;
+    }
+  }
+
+/* Upper limit of the bucket containing the percentile */
+
+static gavl_time_t percentile(const histogram_t * h, int percent)
+  {
+  int i;
+  int64_t sum = 0;
+  int64_t limit = (h->count * percent + 99) / 100;
+  gavl_time_t ret;
+  
+  for(i = 0; i < NUM_BUCKETS; i++)
+    {
+    sum += h->buckets[i];
+    if(sum >= limit)
+      break;
+    }
+  ret = (gavl_time_t)1 << (i + 1);
+  return (ret > h->max) ? h->max : ret;
+  }
+
+void bgen_trace_dump(bgen_trace_t * t)
+  {
+  int i;
+  histogram_t * h;
+  
+  for(i = 0; i < BGEN_TRACE_NUM_STAGES; i++)
+    {
+    h = &t->h[i];
+    
+    if(!h->count)
+      continue;
+    
+    gavl_log(GAVL_LOG_INFO, t->domain,
+             "%s %s latency: p50 %.1f ms, p99 %.1f ms, max %.1f ms (%"PRId64" packets)",
+             t->label, stage_names[i],
+             (double)percentile(h, 50) / 1000.0,
+             (double)percentile(h, 99) / 1000.0,
+             (double)h->max / 1000.0, h->count);
+    }
+  if(t->frames_dropped)
+    gavl_log(GAVL_LOG_INFO, t->domain,
+             "%s: %"PRId64" frames were dropped from the trace",
+             t->label, t->frames_dropped);
+  }
+
+#define FRAME(t, i) (&(t)->frames[((t)->frames_start + (i)) % MAX_FRAMES])
+
+void bgen_trace_frame(bgen_trace_t * t, int64_t pts, int64_t duration)
+  {
+  frame_t * f;
+
+  if(t->num_frames == MAX_FRAMES)
+    {
+    /* Codec doesn't output packets for these? */
+    t->frames_start = (t->frames_start + 1) % MAX_FRAMES;
+    t->num_frames--;
+    t->frames_dropped++;
+    }
+
+  f = FRAME(t, t->num_frames);
+  
+  f->pts  = pts;
+  f->end  = pts + duration;
+  f->t    = bgen_stats_time();
+  f->used = 0;
+  t->num_frames++;
+  }
+
+void bgen_trace_packet(bgen_trace_t * t, int64_t pts, int64_t duration)
+  {
+  int i;
+  frame_t * f;
+  gavl_time_t start = GAVL_TIME_UNDEFINED;
+  int64_t end = pts + ((duration > 0) ? duration : 1);
+
+  /* Frames can come out reordered, so we search all of them */
+  for(i = 0; i < t->num_frames; i++)
+    {
+    f = FRAME(t, i);
+    
+    if((f->pts < end) && (f->end > pts))
+      {
+      if(start == GAVL_TIME_UNDEFINED)
+        start = f->t;
+      f->used = 1;
+      }
+    }
+
+  /* Forget frames, which are completely encoded */
+  while(t->num_frames)
+    {
+    f = FRAME(t, 0);
+    if(!f->used || (f->end > end))
+      break;
+    t->frames_start = (t->frames_start + 1) % MAX_FRAMES;
+    t->num_frames--;
+    }
+
+  current = start;
+  
+  if(start != GAVL_TIME_UNDEFINED)
+    record(t, BGEN_TRACE_ENCODE, start, bgen_stats_time());
+  }
+
+void bgen_trace_queue(bgen_trace_t * t)
+  {
+  if(t->queue_len == t->queue_alloc)
+    {
+    int i;
+    gavl_time_t * queue;
+    int alloc = t->queue_alloc ? t->queue_alloc * 2 : 64;
+    
+    queue = malloc(alloc * sizeof(*queue));
+
+    for(i = 0; i < t->queue_len; i++)
+      queue[i] = t->queue[(t->queue_start + i) % t->queue_alloc];
+
+    if(t->queue)
+      free(t->queue);
+    t->queue = queue;
+    t->queue_alloc = alloc;
+    t->queue_start = 0;
+    }
+
+  /* Compressed input or a second packet from a bitstream filter */
+  if(current == GAVL_TIME_UNDEFINED)
+    current = bgen_stats_time();
+  
+  t->queue[(t->queue_start + t->queue_len) % t->queue_alloc] = current;
+  t->queue_len++;
+  
+  /* Each packet is queued only once */
+  current = GAVL_TIME_UNDEFINED;
+  }
+
+void bgen_trace_write(bgen_trace_t * t, int num)
+  {
+  gavl_time_t start = GAVL_TIME_UNDEFINED;
+  gavl_time_t now = bgen_stats_time();
+  
+  /* Latency of the oldest packet written */
+  while(num-- && t->queue_len)
+    {
+    if(start == GAVL_TIME_UNDEFINED)
+      start = t->queue[t->queue_start];
+    t->queue_start = (t->queue_start + 1) % t->queue_alloc;
+    t->queue_len--;
+    }
+  
+  if(start != GAVL_TIME_UNDEFINED)
+    record(t, BGEN_TRACE_OUTPUT, start, now);
+  }
@@ -57,6 +57,9 @@ typedef struct
   gavl_packet_sink_t * psink;
   
   bg_faac_t * codec;
+
+  bgen_stats_t perf;
+  bgen_trace_t * trace;
   } faac_t;
 
 static void * create_faac()
@@ -64,6 +67,8 @@ static void * create_faac()
   faac_t * ret;
   ret = calloc(1, sizeof(*ret));
   ret->codec = bg_faac_create();
+  bgen_stats_init(&ret->perf, 0);
+  bgen_stats_register(&ret->perf, LOG_DOMAIN, "Output");
   return ret;
   }
 
@@ -74,7 +79,7 @@ static void destroy_faac(void * priv)
   if(faac->codec)
     bg_faac_destroy(faac->codec);
 
-  
+  bgen_stats_unregister(&faac->perf);
   free(faac);
   }
 
@@ -218,8 +223,24 @@ static int open_faac(void * data, const char * filename,
 static gavl_sink_status_t write_packet(void * data, gavl_packet_t * p)
   {
   faac_t * faac = data;
+  gavl_time_t t = bgen_stats_time();
+  
   if(gavf_io_write_data(faac->output, p->buf.buf, p->buf.len) < p->buf.len)
     return GAVL_SINK_ERROR;
+  bgen_stats_add_time(&faac->perf, t, &faac->perf.io_time);
+
+  bgen_stats_lock(&faac->perf);
+  faac->perf.packets++;
+  faac->perf.write_calls++;
+  faac->perf.bytes += p->buf.len;
+  faac->perf.duration += p->duration;
+  bgen_stats_unlock(&faac->perf);
+
+  if(faac->trace)
+    {
+    bgen_trace_queue(faac->trace);
+    bgen_trace_write(faac->trace, 1);
+    }
   return GAVL_SINK_OK;
   }
 
@@ -243,6 +264,8 @@ static int start_faac(void * data)
   if(!faac->sink)
     return 0;
 
+  faac->perf.timescale = faac->format.samplerate;
+  faac->trace = bgen_trace_create(LOG_DOMAIN, "Output");
   faac->psink = gavl_packet_sink_create(NULL, write_packet, faac);
   bg_faac_set_packet_sink(faac->codec, faac->psink);
   return 1;
@@ -276,6 +299,12 @@ static int close_faac(void * data, int do_delete)
       bgen_id3v1_destroy(faac->id3v1);
       faac->id3v1 = NULL;    
       }
+    bgen_stats_log(&faac->perf, LOG_DOMAIN, "Output");
+    if(faac->trace)
+      {
+      bgen_trace_destroy(faac->trace);
+      faac->trace = NULL;
+      }
     if(faac->output)
       gavf_io_destroy(faac->output);
     faac->output = NULL;
@@ -29,6 +29,7 @@
 #include <config.h>
 
 #include <gmerlin_encoders.h>
+#include <bgen_probes.h>
 
 #include <gmerlin/plugin.h>
 #include <gmerlin/pluginfuncs.h>
@@ -70,7 +71,11 @@ struct bg_faac_s
   unsigned long bitRate;
   unsigned long quantqual;
   int shortctl;
-   
+
+  bgen_stats_t perf;
+
+  bgen_trace_t * trace;
+  int64_t trace_pts; // Next sample in the packet timescale
   };
 
 
@@ -78,7 +83,8 @@ bg_faac_t * bg_faac_create(void)
   {
   bg_faac_t * ret = calloc(1, sizeof(*ret));
 
-  
+  bgen_stats_init(&ret->perf, 0);
+  bgen_stats_register(&ret->perf, LOG_DOMAIN, "Encoder");
 
   return ret;
   }
@@ -238,6 +244,7 @@ static int flush_audio(bg_faac_t * ctx)
   int i, imax;
   int bytes_encoded;
   int num_samples;
+  bgen_stats_clock_t clock;
   
   gavl_packet_reset(&ctx->p);
   
@@ -256,10 +263,12 @@ static int flush_audio(bg_faac_t * ctx)
 
   //fprintf(stderr, "Encode %d\n", num_samples);
   
+  bgen_stats_codec_start(&ctx->perf, &clock);
   bytes_encoded = faacEncEncode(ctx->enc,
                                 (int32_t*)ctx->frame->samples.f,
                                 num_samples,
                                 ctx->p.buf.buf, ctx->p.buf.alloc);
+  bgen_stats_codec_end(&ctx->perf, &clock);
 
   ctx->p.buf.len = bytes_encoded;
 
@@ -282,6 +291,18 @@ static int flush_audio(bg_faac_t * ctx)
       ctx->p.duration = ctx->in_pts - ctx->p.pts;
     
     ctx->out_pts += ctx->p.duration;
+
+    bgen_stats_lock(&ctx->perf);
+    ctx->perf.packets++;
+    ctx->perf.bytes += bytes_encoded;
+    ctx->perf.duration += ctx->p.duration;
+    bgen_stats_unlock(&ctx->perf);
+
+    if(ctx->trace)
+      bgen_trace_packet(ctx->trace, ctx->p.pts, ctx->p.duration);
+
+    BGEN_PROBE_PACKET_OUT("faac", ctx, ctx->p.pts, ctx->p.duration,
+                          bytes_encoded);
     
 //    fprintf(stderr, "Got AAC packet\n");
 //    gavl_packet_dump(&ctx->p);
@@ -304,7 +325,20 @@ write_audio_func_faac(void * data, gavl_audio_frame_t * frame)
     {
     ctx->in_pts = frame->timestamp;
     ctx->out_pts = ctx->in_pts - FAAC_DELAY;
+    ctx->trace_pts = ctx->out_pts;
+    }
+
+  bgen_stats_lock(&ctx->perf);
+  ctx->perf.frames += frame->valid_samples;
+  bgen_stats_unlock(&ctx->perf);
+
+  if(ctx->trace)
+    {
+    bgen_trace_frame(ctx->trace, ctx->trace_pts, frame->valid_samples);
+    ctx->trace_pts += frame->valid_samples;
     }
+
+  BGEN_PROBE_FRAME_IN("faac", ctx, frame->timestamp, frame->valid_samples);
   
   while(samples_done < frame->valid_samples)
     {
@@ -426,6 +460,7 @@ gavl_audio_sink_t * bg_faac_open(bg_faac_t * ctx,
     
   gavl_audio_format_copy(&ctx->fmt, fmt);
   ctx->frame = gavl_audio_frame_create(&ctx->fmt);
+  ctx->perf.timescale = ctx->fmt.samplerate;
   
   ctx->asink =
     gavl_audio_sink_create(NULL, write_audio_func_faac, ctx, &ctx->fmt);
@@ -452,6 +487,7 @@ gavl_audio_sink_t * bg_faac_open(bg_faac_t * ctx,
   
   ctx->in_pts = GAVL_TIME_UNDEFINED;
   ctx->out_pts = GAVL_TIME_UNDEFINED;
+  ctx->trace = bgen_trace_create(LOG_DOMAIN, "Encoder");
   return ctx->asink;
   }
 
@@ -474,7 +510,11 @@ void bg_faac_destroy(bg_faac_t * ctx)
       if(result <= 0)
         break;
       }
+    bgen_stats_log(&ctx->perf, LOG_DOMAIN, "Encoder");
     }
+
+  if(ctx->trace)
+    bgen_trace_destroy(ctx->trace);
   
   if(ctx->enc)
     {
@@ -492,6 +532,7 @@ void bg_faac_destroy(bg_faac_t * ctx)
     gavl_audio_sink_destroy(ctx->asink);
     ctx->asink = NULL;
     }
-    
+
+  bgen_stats_unregister(&ctx->perf);
   free(ctx);
   }
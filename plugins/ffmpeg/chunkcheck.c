@@ -0,0 +1,347 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Check the chunked audio encoding: Encode a test signal serially and
+ *  in parallel chunks, decode both and compare the samples.
+ *
+ *  Usage: chunkcheck [-contexts num] [-chunk frames] [-frames num]
+ *                    [-tolerance max_error] [mp2|ac3]
+ *
+ *  Exits with failure if the packet counts differ or the maximum sample
+ *  error (full scale is 1.0) exceeds the tolerance.
+ *
+ *  Not installed, build it with "make chunkcheck".
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "ffmpeg_common.h"
+
+#define SAMPLERATE  48000
+#define NUM_CHANNELS 2
+
+typedef struct
+  {
+  AVPacket ** packets;
+  int num_packets;
+  int packets_alloc;
+  } packet_list_t;
+
+static gavl_sink_status_t put_packet(void * priv, gavl_packet_t * p)
+  {
+  packet_list_t * l = priv;
+  AVPacket * pkt;
+
+  if(l->num_packets == l->packets_alloc)
+    {
+    l->packets_alloc += 256;
+    l->packets = realloc(l->packets, l->packets_alloc * sizeof(*l->packets));
+    }
+
+  if(!(pkt = av_packet_alloc()) || (av_new_packet(pkt, p->buf.len) < 0))
+    return GAVL_SINK_ERROR;
+  memcpy(pkt->data, p->buf.buf, p->buf.len);
+  pkt->pts = p->pts;
+
+  l->packets[l->num_packets++] = pkt;
+  return GAVL_SINK_OK;
+  }
+
+static void free_packets(packet_list_t * l)
+  {
+  int i;
+  for(i = 0; i < l->num_packets; i++)
+    av_packet_free(&l->packets[i]);
+  if(l->packets)
+    free(l->packets);
+  }
+
+/* Test signal: Two tones and a sweep, so every band has something to do */
+
+static double get_signal(int64_t i, int ch)
+  {
+  double t = (double)i / SAMPLERATE;
+  return 0.3 * sin(2.0 * M_PI * (ch ? 440.0 : 1000.0) * t) +
+    0.2 * sin(2.0 * M_PI * (100.0 + 2000.0 * t) * t) +
+    0.1 * sin(2.0 * M_PI * 9000.0 * t);
+  }
+
+static void set_sample(const gavl_audio_format_t * fmt, gavl_audio_frame_t * f,
+                       int i, int ch, double v)
+  {
+  int idx;
+
+  if(fmt->interleave_mode == GAVL_INTERLEAVE_NONE)
+    {
+    if(fmt->sample_format == GAVL_SAMPLE_FLOAT)
+      f->channels.f[ch][i] = v;
+    else
+      f->channels.s_16[ch][i] = (int16_t)(v * 32767.0);
+    }
+  else
+    {
+    idx = i * fmt->num_channels + ch;
+    if(fmt->sample_format == GAVL_SAMPLE_FLOAT)
+      f->samples.f[idx] = v;
+    else
+      f->samples.s_16[idx] = (int16_t)(v * 32767.0);
+    }
+  }
+
+static int encode(enum AVCodecID id, int contexts, int chunk,
+                  int num_frames, packet_list_t * l)
+  {
+  int i, j, ch;
+  int64_t pos = 0;
+  gavl_value_t val;
+  gavl_audio_format_t fmt;
+  gavl_audio_sink_t * sink;
+  gavl_audio_frame_t * frame;
+  gavl_audio_frame_t * own_frame = NULL;
+  gavl_packet_sink_t * psink;
+  gavl_compression_info_t ci;
+  bg_ffmpeg_codec_context_t * ctx;
+
+  if(!(ctx = bg_ffmpeg_codec_create(AVMEDIA_TYPE_AUDIO, NULL, id, NULL)))
+    return 0;
+
+  gavl_value_init(&val);
+  gavl_value_set_int(&val, contexts);
+  bg_ffmpeg_codec_set_parameter(ctx, "parallel_contexts", &val);
+  gavl_value_set_int(&val, chunk);
+  bg_ffmpeg_codec_set_parameter(ctx, "chunk_frames", &val);
+
+  psink = gavl_packet_sink_create(NULL, put_packet, l);
+  bg_ffmpeg_codec_set_packet_sink(ctx, psink);
+
+  memset(&fmt, 0, sizeof(fmt));
+  memset(&ci, 0, sizeof(ci));
+  fmt.samplerate = SAMPLERATE;
+  fmt.num_channels = NUM_CHANNELS;
+  fmt.sample_format = GAVL_SAMPLE_FLOAT;
+  fmt.interleave_mode = GAVL_INTERLEAVE_NONE;
+  gavl_set_channel_setup(&fmt);
+
+  if(!(sink = bg_ffmpeg_codec_open_audio(ctx, &ci, &fmt, NULL)))
+    return 0;
+  gavl_compression_info_free(&ci);
+
+  for(i = 0; i < num_frames; i++)
+    {
+    if(!(frame = gavl_audio_sink_get_frame(sink)))
+      {
+      if(!own_frame)
+        own_frame = gavl_audio_frame_create(&fmt);
+      frame = own_frame;
+      }
+
+    for(j = 0; j < fmt.samples_per_frame; j++)
+      {
+      for(ch = 0; ch < fmt.num_channels; ch++)
+        set_sample(&fmt, frame, j, ch, get_signal(pos + j, ch));
+      }
+    frame->valid_samples = fmt.samples_per_frame;
+    frame->timestamp = pos;
+    pos += fmt.samples_per_frame;
+
+    if(gavl_audio_sink_put_frame(sink, frame) != GAVL_SINK_OK)
+      return 0;
+    }
+
+  bg_ffmpeg_codec_flush(ctx);
+  bg_ffmpeg_codec_destroy(ctx);
+  gavl_packet_sink_destroy(psink);
+  if(own_frame)
+    gavl_audio_frame_destroy(own_frame);
+  return 1;
+  }
+
+static float get_decoded(const AVFrame * f, int i, int ch)
+  {
+  switch(f->format)
+    {
+    case AV_SAMPLE_FMT_FLTP:
+      return ((const float*)f->extended_data[ch])[i];
+    case AV_SAMPLE_FMT_FLT:
+      return ((const float*)f->extended_data[0])[i * NUM_CHANNELS + ch];
+    case AV_SAMPLE_FMT_S16P:
+      return ((const int16_t*)f->extended_data[ch])[i] / 32768.0;
+    case AV_SAMPLE_FMT_S16:
+      return ((const int16_t*)f->extended_data[0])[i * NUM_CHANNELS + ch] / 32768.0;
+    default:
+      return 0.0;
+    }
+  }
+
+/* Decode to interleaved float, returns the number of samples */
+
+static int64_t decode(enum AVCodecID id, packet_list_t * l, float ** ret)
+  {
+  int i, j, ch;
+  int64_t num = 0;
+  int64_t alloc = 0;
+  const AVCodec * codec;
+  AVCodecContext * avctx;
+  AVFrame * f;
+
+  *ret = NULL;
+
+  if(!(codec = avcodec_find_decoder(id)) ||
+     !(avctx = avcodec_alloc_context3(codec)))
+    return -1;
+
+  avctx->sample_rate = SAMPLERATE;
+  avctx->channels = NUM_CHANNELS;
+
+  if(avcodec_open2(avctx, codec, NULL) < 0)
+    return -1;
+
+  f = av_frame_alloc();
+
+  for(i = 0; i <= l->num_packets; i++)
+    {
+    if(avcodec_send_packet(avctx, (i < l->num_packets) ? l->packets[i] : NULL) < 0)
+      break;
+
+    while(!avcodec_receive_frame(avctx, f))
+      {
+      if(num + f->nb_samples > alloc)
+        {
+        alloc = num + f->nb_samples + 65536;
+        *ret = realloc(*ret, alloc * NUM_CHANNELS * sizeof(**ret));
+        }
+      for(j = 0; j < f->nb_samples; j++)
+        {
+        for(ch = 0; ch < NUM_CHANNELS; ch++)
+          (*ret)[(num + j) * NUM_CHANNELS + ch] = get_decoded(f, j, ch);
+        }
+      num += f->nb_samples;
+      av_frame_unref(f);
+      }
+    }
+
+  av_frame_free(&f);
+  avcodec_free_context(&avctx);
+  return num;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+  int contexts = 4;
+  int chunk = 16;
+  int num_frames = 500;
+  double tolerance = 0.01;
+  double err, max_err = 0.0;
+  int64_t max_pos = 0;
+  int64_t num_serial, num_chunked, num, j;
+  float * serial;
+  float * chunked;
+  enum AVCodecID id = AV_CODEC_ID_MP2;
+  const char * name = "mp2";
+  packet_list_t serial_packets;
+  packet_list_t chunked_packets;
+
+  memset(&serial_packets, 0, sizeof(serial_packets));
+  memset(&chunked_packets, 0, sizeof(chunked_packets));
+
+  for(i = 1; i < argc; i++)
+    {
+    if(!strcmp(argv[i], "-contexts") && (i < argc - 1))
+      contexts = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-chunk") && (i < argc - 1))
+      chunk = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-frames") && (i < argc - 1))
+      num_frames = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-tolerance") && (i < argc - 1))
+      tolerance = strtod(argv[++i], NULL);
+    else if(!strcmp(argv[i], "ac3"))
+      {
+      id = AV_CODEC_ID_AC3;
+      name = argv[i];
+      }
+    else if(!strcmp(argv[i], "mp2"))
+      {
+      id = AV_CODEC_ID_MP2;
+      name = argv[i];
+      }
+    else
+      {
+      fprintf(stderr, "Unknown argument %s\n", argv[i]);
+      return EXIT_FAILURE;
+      }
+    }
+
+  if(!encode(id, 1, 0, num_frames, &serial_packets) ||
+     !encode(id, contexts, chunk, num_frames, &chunked_packets))
+    {
+    fprintf(stderr, "Encoding failed\n");
+    return EXIT_FAILURE;
+    }
+
+  printf("%s: %d frames, %d contexts, chunks of %d frames\n",
+         name, num_frames, contexts, chunk);
+  printf("Packets: %d serial, %d chunked\n",
+         serial_packets.num_packets, chunked_packets.num_packets);
+
+  if(serial_packets.num_packets != chunked_packets.num_packets)
+    {
+    fprintf(stderr, "Packet counts differ\n");
+    return EXIT_FAILURE;
+    }
+
+  num_serial  = decode(id, &serial_packets, &serial);
+  num_chunked = decode(id, &chunked_packets, &chunked);
+
+  if((num_serial <= 0) || (num_serial != num_chunked))
+    {
+    fprintf(stderr, "Decoding failed (%"PRId64" / %"PRId64" samples)\n",
+            num_serial, num_chunked);
+    return EXIT_FAILURE;
+    }
+
+  num = num_serial * NUM_CHANNELS;
+  for(j = 0; j < num; j++)
+    {
+    err = fabs(serial[j] - chunked[j]);
+    if(err > max_err)
+      {
+      max_err = err;
+      max_pos = j / NUM_CHANNELS;
+      }
+    }
+
+  printf("Maximum sample error: %f at sample %"PRId64" (tolerance %f)\n",
+         max_err, max_pos, tolerance);
+
+  free(serial);
+  free(chunked);
+  free_packets(&serial_packets);
+  free_packets(&chunked_packets);
+
+  return (max_err <= tolerance) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
@@ -0,0 +1,186 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Per clip overhead of the video encoders: Encode a number of short
+ *  clips either with a new codec context for each clip or by reusing
+ *  one context.
+ *
+ *  Usage: clipbench [-reuse] [-clips num] [-frames num] [-size wxh] [encoder]
+ *
+ *  Not installed, build it with "make clipbench".
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gavl/gavl.h>
+#include <gavl/timer.h>
+
+#include "ffmpeg_common.h"
+
+static int64_t num_packets = 0;
+static int64_t num_bytes = 0;
+
+static gavl_sink_status_t put_packet(void * priv, gavl_packet_t * p)
+  {
+  num_packets++;
+  num_bytes += p->buf.len;
+  return GAVL_SINK_OK;
+  }
+
+static int encode_clip(bg_ffmpeg_codec_context_t * ctx,
+                       const gavl_video_format_t * format,
+                       int num_frames)
+  {
+  int i;
+  gavl_video_format_t fmt;
+  gavl_video_sink_t * sink;
+  gavl_video_frame_t * frame;
+  gavl_compression_info_t ci;
+
+  gavl_video_format_copy(&fmt, format);
+  memset(&ci, 0, sizeof(ci));
+
+  if(!(sink = bg_ffmpeg_codec_open_video(ctx, &ci, &fmt, NULL)))
+    return 0;
+
+  gavl_compression_info_free(&ci);
+
+  for(i = 0; i < num_frames; i++)
+    {
+    if(!(frame = gavl_video_sink_get_frame(sink)))
+      return 0;
+
+    /* Some motion, so the encoder has to work */
+    gavl_video_frame_clear(frame, &fmt);
+    memset(frame->planes[0] + (i % fmt.image_height) * frame->strides[0],
+           0xff, fmt.image_width);
+
+    frame->timestamp = (int64_t)i * fmt.frame_duration;
+    frame->duration  = fmt.frame_duration;
+
+    if(gavl_video_sink_put_frame(sink, frame) != GAVL_SINK_OK)
+      return 0;
+    }
+  bg_ffmpeg_codec_flush(ctx);
+  return 1;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+  int reuse = 0;
+  int num_clips = 100;
+  int num_frames = 10;
+  const char * name = "mpeg4";
+  const AVCodec * codec;
+  gavl_video_format_t fmt;
+  gavl_packet_sink_t * psink;
+  gavl_timer_t * timer;
+  gavl_time_t t;
+  bg_ffmpeg_codec_context_t * ctx = NULL;
+
+  memset(&fmt, 0, sizeof(fmt));
+  fmt.image_width  = 320;
+  fmt.image_height = 240;
+
+  for(i = 1; i < argc; i++)
+    {
+    if(!strcmp(argv[i], "-reuse"))
+      reuse = 1;
+    else if(!strcmp(argv[i], "-clips") && (i < argc - 1))
+      num_clips = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-frames") && (i < argc - 1))
+      num_frames = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-size") && (i < argc - 1))
+      {
+      if(sscanf(argv[++i], "%dx%d", &fmt.image_width, &fmt.image_height) < 2)
+        {
+        fprintf(stderr, "Invalid size %s\n", argv[i]);
+        return EXIT_FAILURE;
+        }
+      }
+    else
+      name = argv[i];
+    }
+
+  if(!(codec = avcodec_find_encoder_by_name(name)))
+    {
+    fprintf(stderr, "Encoder %s not found\n", name);
+    return EXIT_FAILURE;
+    }
+
+  fmt.frame_width    = fmt.image_width;
+  fmt.frame_height   = fmt.image_height;
+  fmt.pixel_width    = 1;
+  fmt.pixel_height   = 1;
+  fmt.pixelformat    = GAVL_YUV_420_P;
+  fmt.framerate_mode = GAVL_FRAMERATE_CONSTANT;
+  fmt.timescale      = 25;
+  fmt.frame_duration = 1;
+
+  psink = gavl_packet_sink_create(NULL, put_packet, NULL);
+  timer = gavl_timer_create();
+  gavl_timer_start(timer);
+
+  for(i = 0; i < num_clips; i++)
+    {
+    if(!ctx &&
+       !(ctx = bg_ffmpeg_codec_create(AVMEDIA_TYPE_VIDEO, NULL, codec->id, NULL)))
+      {
+      fprintf(stderr, "Creating codec failed\n");
+      return EXIT_FAILURE;
+      }
+    bg_ffmpeg_codec_set_packet_sink(ctx, psink);
+
+    if(!encode_clip(ctx, &fmt, num_frames))
+      {
+      fprintf(stderr, "Encoding clip %d failed\n", i);
+      return EXIT_FAILURE;
+      }
+
+    if(!reuse)
+      {
+      bg_ffmpeg_codec_destroy(ctx);
+      ctx = NULL;
+      }
+    }
+
+  t = gavl_timer_get(timer);
+
+  if(ctx)
+    bg_ffmpeg_codec_destroy(ctx);
+
+  printf("%s, %s: %d clips of %d frames (%dx%d), %"PRId64" packets, %"PRId64" bytes\n",
+         name, reuse ? "reused context" : "new context per clip",
+         num_clips, num_frames, fmt.image_width, fmt.image_height,
+         num_packets, num_bytes);
+  printf("%.3f ms per clip\n",
+         (double)t / (double)GAVL_TIME_SCALE * 1000.0 / (double)num_clips);
+
+  gavl_timer_destroy(timer);
+  gavl_packet_sink_destroy(psink);
+  return EXIT_SUCCESS;
+  }
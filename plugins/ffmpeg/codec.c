@@ -19,7 +19,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  * *****************************************************************/
 
+#include <pthread.h>
+
 #include "ffmpeg_common.h"
+#include <bgen_probes.h>
 
 #include <gmerlin/utils.h>
 #include <gmerlin/cfg_registry.h>
@@ -38,18 +41,35 @@
 #define FLAG_ERROR       (1<<1)
 #define FLAG_FLUSHED     (1<<2)
 
+#define LATENCY_AUTO   0 // Low latency for live playlists
+#define LATENCY_NORMAL 1
+#define LATENCY_LOW    2
+
 
 static void 
 get_pixelformat_converter(bg_ffmpeg_codec_context_t * ctx, enum AVPixelFormat fmt,
                           int do_convert);
 
+static int init_parallel(bg_ffmpeg_codec_context_t * ctx,
+                         const ffmpeg_codec_info_t * info);
+
+static int reinit(bg_ffmpeg_codec_context_t * ctx);
+
 static int find_encoder(bg_ffmpeg_codec_context_t * ctx)
   {
+  const ffmpeg_codec_info_t * info;
+  
   if(ctx->id == AV_CODEC_ID_NONE)
     return 0;
 
   if(ctx->codec)
     return 1;
+
+  /* There can be several encoders for one codec (e.g. AV1), prefer
+     the one our parameters are made for */
+  if((info = bg_ffmpeg_get_codec_info(ctx->id, ctx->type)) &&
+     (ctx->codec = avcodec_find_encoder_by_name(info->name)))
+    return 1;
   
   if(!(ctx->codec = avcodec_find_encoder(ctx->id)))
     {
@@ -62,6 +82,56 @@ static int find_encoder(bg_ffmpeg_codec_context_t * ctx)
   return 1;
   }
 
+/*
+ *  Thread counts are taken from the process wide budget
+ *  (see bgen_threads_reserve()). Each context is registered from
+ *  creation until it decided about its threads.
+ */
+
+#ifndef AV_CODEC_CAP_OTHER_THREADS // libavcodec < 58.132
+#define AV_CODEC_CAP_OTHER_THREADS AV_CODEC_CAP_AUTO_THREADS
+#endif
+
+static void unregister_threads(bg_ffmpeg_codec_context_t * ctx)
+  {
+  if(ctx->threads_registered)
+    {
+    bgen_threads_unregister();
+    ctx->threads_registered = 0;
+    }
+  }
+
+static void init_threads(bg_ffmpeg_codec_context_t * ctx)
+  {
+  int caps = ctx->codec->capabilities &
+    (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS);
+
+  /* libx264 and friends do their own threading, but they
+     respect thread_count and thread_type */
+  if(!caps && !(ctx->codec->capabilities & AV_CODEC_CAP_OTHER_THREADS))
+    {
+    ctx->avctx->thread_count = 1;
+    return;
+    }
+
+  ctx->num_threads = bgen_threads_reserve(ctx->avctx->thread_count);
+  ctx->avctx->thread_count = ctx->num_threads;
+
+  /* Frame threading adds one frame of latency per thread.
+     libx264 switches to sliced threads for FF_THREAD_SLICE */
+  if(ctx->live && (!caps || (caps & AV_CODEC_CAP_SLICE_THREADS)))
+    ctx->avctx->thread_type = FF_THREAD_SLICE;
+  else if(caps == AV_CODEC_CAP_SLICE_THREADS)
+    ctx->avctx->thread_type = FF_THREAD_SLICE;
+  else
+    ctx->avctx->thread_type = FF_THREAD_FRAME;
+
+  gavl_log(GAVL_LOG_DEBUG, LOG_DOMAIN, "Using %d %s threads for %s",
+           ctx->num_threads,
+           (ctx->avctx->thread_type == FF_THREAD_SLICE) ? "slice" : "frame",
+           ctx->codec->name);
+  }
+
 /*
  *  Create a codec context.
  *  If avctx is NULL, it will be created and destroyed.
@@ -102,6 +172,11 @@ bg_ffmpeg_codec_context_t * bg_ffmpeg_codec_create(int type,
   
   ret->avctx->codec_type = type;
   ret->frame = av_frame_alloc();
+  bgen_stats_init(&ret->perf, 0);
+  bgen_stats_register(&ret->perf, LOG_DOMAIN, ret->codec->name);
+
+  bgen_threads_register();
+  ret->threads_registered = 1;
   
   return ret;
 
@@ -128,6 +203,29 @@ static void apply_func(void * priv, const char * name, const gavl_value_t * val)
     return;
 
   ctx = priv;
+
+  if(!strcmp(name, "parallel_contexts"))
+    {
+    ctx->num_contexts = val->v.i;
+    return;
+    }
+  else if(!strcmp(name, "chunk_frames"))
+    {
+    ctx->chunk_frames = val->v.i;
+    return;
+    }
+  else if(!strcmp(name, "latency"))
+    {
+    if(!strcmp(val->v.str, "normal"))
+      ctx->latency = LATENCY_NORMAL;
+    else if(!strcmp(val->v.str, "low"))
+      ctx->latency = LATENCY_LOW;
+    else
+      ctx->latency = LATENCY_AUTO;
+    return;
+    }
+  
+  gavl_dictionary_set(&ctx->params, name, val);
   
   bg_ffmpeg_set_codec_parameter(ctx->avctx,
                                 &ctx->options,
@@ -166,7 +264,8 @@ void bg_ffmpeg_codec_set_parameter(bg_ffmpeg_codec_context_t * ctx,
     }
   else if(bg_encoder_set_framerate_parameter(&ctx->fr, name, v))
     return;
-  
+  else /* Standalone codecs get the parameters directly */
+    apply_func(ctx, name, v);
   }
 
 static int set_compression_info(bg_ffmpeg_codec_context_t * ctx,
@@ -184,6 +283,38 @@ static int set_compression_info(bg_ffmpeg_codec_context_t * ctx,
 
     if(ctx->avctx->extradata_size)
       gavl_buffer_append_data(&ci->codec_header, ctx->avctx->extradata, ctx->avctx->extradata_size);
+
+    if(ctx->type == AVMEDIA_TYPE_AUDIO)
+      {
+      switch(ctx->avctx->codec_id)
+        {
+        case AV_CODEC_ID_MP2:
+        case AV_CODEC_ID_AC3:
+          ci->bitrate = ctx->avctx->bit_rate;
+          break;
+        default:
+          break;
+        }
+      ci->pre_skip = ctx->avctx->delay;
+      }
+    else
+      {
+      const ffmpeg_codec_info_t * info =
+        bg_ffmpeg_get_codec_info(ctx->id, AVMEDIA_TYPE_VIDEO);
+      
+      if(!(info->flags & FLAG_INTRA_ONLY))
+        {
+        if((ctx->avctx->gop_size > 1) ||
+           (ctx->avctx->gop_size < 0))
+          {
+          ci->flags |= GAVL_COMPRESSION_HAS_P_FRAMES;
+          }
+        if((info->flags & FLAG_B_FRAMES) &&
+           ((ctx->avctx->max_b_frames > 0) || ctx->avctx->has_b_frames))
+          ci->flags |= GAVL_COMPRESSION_HAS_B_FRAMES |
+            GAVL_COMPRESSION_HAS_P_FRAMES;
+        }
+      }
     }
   if(m)
     gavl_dictionary_set_string(m, GAVL_META_SOFTWARE, LIBAVCODEC_IDENT);
@@ -193,55 +324,195 @@ static int set_compression_info(bg_ffmpeg_codec_context_t * ctx,
 
 
 /*
- *  Audio
+ *  Frame pool
  */
 
-static int flush_audio(bg_ffmpeg_codec_context_t * ctx)
+static bg_ffmpeg_frame_t * create_audio_pool_frame(bg_ffmpeg_codec_context_t * ctx)
   {
-  AVPacket pkt;
-  AVFrame * f;
-  int result;
+  int i;
+  bg_ffmpeg_frame_t * ret = calloc(1, sizeof(*ret));
 
-  av_init_packet(&pkt);
-  gavl_packet_reset(&ctx->gp);
+  ret->f = av_frame_alloc();
+  ret->f->format         = ctx->avctx->sample_fmt;
+  ret->f->nb_samples     = ctx->afmt.samples_per_frame;
+  ret->f->channel_layout = ctx->avctx->channel_layout;
+  ret->f->channels       = ctx->avctx->channels;
+  ret->f->sample_rate    = ctx->avctx->sample_rate;
+
+  if(av_frame_get_buffer(ret->f, 0) < 0)
+    {
+    av_frame_free(&ret->f);
+    free(ret);
+    return NULL;
+    }
+
+  /* Let the gavl frame point to the AVFrame buffers */
+  ret->af = gavl_audio_frame_create(NULL);
   
-  pkt.data = ctx->gp.buf.buf;
-  pkt.size = ctx->gp.buf.alloc;
+  if(ctx->afmt.interleave_mode == GAVL_INTERLEAVE_ALL)
+    {
+    ret->af->samples.u_8 = ret->f->extended_data[0];
+    ret->af->channel_stride = ret->f->linesize[0] / ctx->afmt.num_channels;
+    }
+  else
+    {
+    for(i = 0; i < ctx->afmt.num_channels; i++)
+      ret->af->channels.u_8[i] = ret->f->extended_data[i];
+    ret->af->channel_stride = ret->f->linesize[0];
+    }
+  return ret;
+  }
+
+#define VIDEO_ALIGN 64 // Enough for AVX-512
+
+static bg_ffmpeg_frame_t * create_video_pool_frame(bg_ffmpeg_codec_context_t * ctx)
+  {
+  int i;
+  bg_ffmpeg_frame_t * ret = calloc(1, sizeof(*ret));
+
+  /* Allocate the whole frame, gavl might write beyond the image size */
+  ret->f = av_frame_alloc();
+  ret->f->format = ctx->avctx->pix_fmt;
+  ret->f->width  = ctx->vfmt.frame_width;
+  ret->f->height = ctx->vfmt.frame_height;
+
+  if(av_frame_get_buffer(ret->f, VIDEO_ALIGN) < 0)
+    {
+    av_frame_free(&ret->f);
+    free(ret);
+    return NULL;
+    }
   
-  if(ctx->aframe->valid_samples)
+  ret->f->width  = ctx->vfmt.image_width;
+  ret->f->height = ctx->vfmt.image_height;
+
+  /* Let the gavl frame point to the AVFrame buffers */
+  ret->vf = gavl_video_frame_create(NULL);
+
+  for(i = 0; i < 4; i++)
     {
-    ctx->frame->nb_samples = ctx->aframe->valid_samples;
-    ctx->frame->pts = ctx->in_pts;
-    ctx->in_pts += ctx->aframe->valid_samples;
-    f = ctx->frame;
+    ret->vf->planes[i]  = ret->f->data[i];
+    ret->vf->strides[i] = ret->f->linesize[i];
+    }
+  return ret;
+  }
+
+static void destroy_pool_frame(bg_ffmpeg_frame_t * f)
+  {
+  if(f->af)
+    {
+    gavl_audio_frame_null(f->af);
+    gavl_audio_frame_destroy(f->af);
+    }
+  if(f->vf)
+    {
+    gavl_video_frame_null(f->vf);
+    gavl_video_frame_destroy(f->vf);
+    }
+  av_frame_free(&f->f);
+  free(f);
+  }
+
+/* Get a frame, which is not referenced by the encoder */
+
+static bg_ffmpeg_frame_t * get_pool_frame(bg_ffmpeg_codec_context_t * ctx)
+  {
+  int i;
+  bg_ffmpeg_frame_t * ret;
+  
+  for(i = 0; i < ctx->pool_size; i++)
+    {
+    if((ctx->pool[i] != ctx->pool_get) &&
+       (ctx->pool[i] != ctx->pool_cur) &&
+       av_frame_is_writable(ctx->pool[i]->f))
+      return ctx->pool[i];
     }
+
+  if(ctx->type == AVMEDIA_TYPE_VIDEO)
+    ret = create_video_pool_frame(ctx);
   else
+    ret = create_audio_pool_frame(ctx);
+  
+  if(!ret)
     {
-    if(ctx->codec->capabilities & AV_CODEC_CAP_DELAY)
-      f = NULL;
-    else
-      return 0;
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Could not allocate frame");
+    return NULL;
     }
   
+  ctx->pool = realloc(ctx->pool, (ctx->pool_size+1) * sizeof(*ctx->pool));
+  ctx->pool[ctx->pool_size] = ret;
+  ctx->pool_size++;
+  return ret;
+  }
+
+/*
+ *  Audio
+ */
+
+/* Pass an encoded packet to the sink. Packets come out in order
+   (also from the parallel contexts), so the timing is simply counted */
+
+static int put_audio_packet(void * data, AVPacket * pkt,
+                            const bg_ffmpeg_frame_info_t * info)
+  {
+  bg_ffmpeg_codec_context_t * ctx = data;
+
+  gavl_packet_reset(&ctx->gp);
+    
+  ctx->gp.pts      = ctx->out_pts;
+  ctx->gp.duration = ctx->afmt.samples_per_frame;
+
+  /* Last frame can be smaller */
+    
+  if(ctx->gp.pts + ctx->gp.duration > ctx->in_pts)
+    ctx->gp.duration = ctx->in_pts - ctx->gp.pts;
+    
+  ctx->out_pts += ctx->gp.duration;
+    
+  ctx->gp.flags |= GAVL_PACKET_KEYFRAME;
+    
+  ctx->gp.buf.len = pkt->size;
+  ctx->gp.buf.buf = pkt->data;
+
+  bgen_stats_lock(&ctx->perf);
+  ctx->perf.packets++;
+  ctx->perf.bytes += pkt->size;
+  ctx->perf.duration += ctx->gp.duration;
+  bgen_stats_unlock(&ctx->perf);
+
+  if(ctx->trace)
+    bgen_trace_packet(ctx->trace, ctx->gp.pts, ctx->gp.duration);
+
+  BGEN_PROBE_PACKET_OUT(ctx->codec->name, ctx, ctx->gp.pts, ctx->gp.duration,
+                        ctx->gp.buf.len);
+    
+  // fprintf(stderr, "Put audio packet\n");
+  // gavl_packet_dump(&ctx->gp);
+    
+  if(gavl_packet_sink_put_packet(ctx->psink, &ctx->gp) != GAVL_SINK_OK)
+    ctx->flags |= FLAG_ERROR;
+
+  ctx->gp.buf.buf = NULL;
+  return !(ctx->flags & FLAG_ERROR);
+  }
+
+/* Send a frame (NULL for flushing) and pass the packets to the sink */
+
+static int encode_audio(bg_ffmpeg_codec_context_t * ctx, AVFrame * f)
+  {
+  AVPacket pkt;
+  int result;
+  bgen_stats_clock_t clock;
+
+  bgen_stats_codec_start(&ctx->perf, &clock);
+  
   if(avcodec_send_frame(ctx->avctx, f) < 0)
     {
     gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
            "avcodec_send_frame failed");
     ctx->flags |= FLAG_ERROR;
-    return -1;
-    }
-
-#if 0
-  if(avcodec_encode_audio2(ctx->avctx, &pkt, f, &got_packet) < 0)
-    {
-    ctx->flags |= FLAG_ERROR;
     return 0;
     }
-#endif
-  
-  /* Mute frame */
-  gavl_audio_frame_mute(ctx->aframe, &ctx->afmt);
-  ctx->aframe->valid_samples = 0;
 
   while(1)
     {
@@ -256,40 +527,117 @@ static int flush_audio(bg_ffmpeg_codec_context_t * ctx)
       /* Fail */
       return 0;
       }
-    
-    ctx->gp.pts      = ctx->out_pts;
-    ctx->gp.duration = ctx->afmt.samples_per_frame;
 
-    // fprintf(stderr, "Samples written: %ld\n", ctx->samples_written);
-    
-    /* Last frame can be smaller */
-    
-    if(ctx->gp.pts + ctx->gp.duration > ctx->in_pts)
-      ctx->gp.duration = ctx->in_pts - ctx->gp.pts;
-    
-    ctx->out_pts += ctx->gp.duration;
-    
-    ctx->gp.flags |= GAVL_PACKET_KEYFRAME;
-    
-    ctx->gp.buf.len = pkt.size;
-    ctx->gp.buf.buf = pkt.data;
-    
-    // fprintf(stderr, "Put audio packet\n");
-    // gavl_packet_dump(&ctx->gp);
-    
-    if(gavl_packet_sink_put_packet(ctx->psink, &ctx->gp) != GAVL_SINK_OK)
-      ctx->flags |= FLAG_ERROR;
-    
+    bgen_stats_codec_end(&ctx->perf, &clock);
+    put_audio_packet(ctx, &pkt, NULL);
     av_packet_unref(&pkt);
+    bgen_stats_codec_start(&ctx->perf, &clock);
+    }
+  bgen_stats_codec_end(&ctx->perf, &clock);
+  return 1;
+  }
+
+static int send_audio(bg_ffmpeg_codec_context_t * ctx, AVFrame * f, int num_samples)
+  {
+  int result;
+  bgen_stats_clock_t clock;
+  bg_ffmpeg_frame_info_t info;
+  
+  f->nb_samples = num_samples;
+  f->pts = ctx->in_pts;
+  ctx->in_pts += num_samples;
+  bgen_stats_lock(&ctx->perf);
+  ctx->perf.frames += num_samples;
+  bgen_stats_unlock(&ctx->perf);
+
+  if(!ctx->par)
+    return encode_audio(ctx, f);
+
+  /* Packets are assigned by position, put_audio_packet()
+     counts the timestamps itself */
+  info.pts      = f->pts;
+  info.duration = num_samples;
+  info.timecode = GAVL_TIMECODE_UNDEFINED;
+
+  /* Time we are blocked by the workers */
+  bgen_stats_codec_start(&ctx->perf, &clock);
+  result = bg_ffmpeg_parallel_put_frame(ctx->par, f, &info);
+  bgen_stats_codec_end(&ctx->perf, &clock);
+  
+  if(!result)
+    {
+    ctx->flags |= FLAG_ERROR;
+    return 0;
     }
   return 1;
   }
 
+static void flush_audio(bg_ffmpeg_codec_context_t * ctx)
+  {
+  bg_ffmpeg_frame_t * pf;
+  
+  /* Send the remaining samples, libavcodec pads the last frame if necessary */
+  if(ctx->pool_cur && ctx->pool_cur->af->valid_samples)
+    {
+    pf = ctx->pool_cur;
+    ctx->pool_cur = NULL;
+    if(!send_audio(ctx, pf->f, pf->af->valid_samples))
+      return;
+    }
+
+  if(ctx->par)
+    {
+    if(!bg_ffmpeg_parallel_flush(ctx->par))
+      ctx->flags |= FLAG_ERROR;
+    }
+  else
+    encode_audio(ctx, NULL);
+  }
+
+/* Point the (non-refcounted) AVFrame to the samples of a gavl frame */
+
+static void wire_audio_frame(bg_ffmpeg_codec_context_t * ctx, AVFrame * f,
+                             gavl_audio_frame_t * frame)
+  {
+  int i;
+  
+  if(ctx->afmt.interleave_mode == GAVL_INTERLEAVE_ALL)
+    {
+    f->linesize[0] = frame->channel_stride * ctx->afmt.num_channels;
+    f->extended_data[0] = frame->samples.u_8;
+    }
+  else
+    {
+    for(i = 0; i < ctx->afmt.num_channels; i++)
+      f->extended_data[i] = frame->channels.u_8[i];
+    f->linesize[0] = frame->channel_stride;
+    }
+  if(f->extended_data != f->data)
+    {
+    for(i = 0; i < AV_NUM_DATA_POINTERS; i++)
+      f->data[i] = f->extended_data[i];
+    }
+  }
+
+/* Frames, which can be passed to the encoder without re-blocking */
+
+static int is_complete(bg_ffmpeg_codec_context_t * ctx, int num_samples)
+  {
+  if(num_samples == ctx->afmt.samples_per_frame)
+    return 1;
+  if((num_samples > 0) &&
+     (ctx->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+    return 1;
+  return 0;
+  }
+
 static gavl_sink_status_t
 write_audio_func(void * data, gavl_audio_frame_t * frame)
   {
   int samples_written = 0;
   int samples_copied;
+  int result = 1;
+  bg_ffmpeg_frame_t * pf;
   bg_ffmpeg_codec_context_t * ctx = data;
 
   if(ctx->in_pts == GAVL_TIME_UNDEFINED)
@@ -298,30 +646,88 @@ write_audio_func(void * data, gavl_audio_frame_t * frame)
     ctx->out_pts = ctx->in_pts - ctx->avctx->delay;
     }
 
+  /* Timestamp of the first sample in the packets */
+  if(ctx->trace)
+    bgen_trace_frame(ctx->trace,
+                     ctx->in_pts - ctx->avctx->delay +
+                     (ctx->pool_cur ? ctx->pool_cur->af->valid_samples : 0),
+                     frame->valid_samples);
+
+  BGEN_PROBE_FRAME_IN(ctx->codec->name, ctx, frame->timestamp,
+                      frame->valid_samples);
+  
+  /* Pass complete frames directly */
+  if(!ctx->pool_cur && is_complete(ctx, frame->valid_samples))
+    {
+    if(ctx->pool_get && (ctx->pool_get->af == frame))
+      {
+      /* Our own frame: The encoder can keep a reference */
+      result = send_audio(ctx, ctx->pool_get->f, frame->valid_samples);
+      }
+    else
+      {
+      wire_audio_frame(ctx, ctx->frame, frame);
+      result = send_audio(ctx, ctx->frame, frame->valid_samples);
+      }
+    ctx->pool_get = NULL;
+    
+    if(!result || (ctx->flags & FLAG_ERROR))
+      return GAVL_SINK_ERROR;
+    return GAVL_SINK_OK;
+    }
+
+  /* Re-block */
   while(samples_written < frame->valid_samples)
     {
+    if(!ctx->pool_cur)
+      {
+      if(!(ctx->pool_cur = get_pool_frame(ctx)))
+        return GAVL_SINK_ERROR;
+      ctx->pool_cur->af->valid_samples = 0;
+      }
+    
     samples_copied =
       gavl_audio_frame_copy(&ctx->afmt,
-                            ctx->aframe, // dst frame
+                            ctx->pool_cur->af, // dst frame
                             frame,     // src frame
-                            ctx->aframe->valid_samples, // dst_pos
+                            ctx->pool_cur->af->valid_samples, // dst_pos
                             samples_written,          // src_pos,
-                            ctx->afmt.samples_per_frame - ctx->aframe->valid_samples, // dst_size,
+                            ctx->afmt.samples_per_frame - ctx->pool_cur->af->valid_samples, // dst_size,
                             frame->valid_samples - samples_written);
     
-    ctx->aframe->valid_samples += samples_copied;
-    if(ctx->aframe->valid_samples == ctx->afmt.samples_per_frame)
+    ctx->pool_cur->af->valid_samples += samples_copied;
+    if(ctx->pool_cur->af->valid_samples == ctx->afmt.samples_per_frame)
       {
-      flush_audio(ctx);
+      pf = ctx->pool_cur;
+      ctx->pool_cur = NULL;
       
-      if(ctx->flags & FLAG_ERROR)
+      if(!send_audio(ctx, pf->f, pf->af->valid_samples) ||
+         (ctx->flags & FLAG_ERROR))
+        {
+        ctx->pool_get = NULL;
         return GAVL_SINK_ERROR;
+        }
       }
     samples_written += samples_copied;
     }
+  
+  ctx->pool_get = NULL;
   return GAVL_SINK_OK;
   }
 
+/* Hand out a frame from the pool, so the caller can write
+   directly into the buffers passed to the encoder */
+
+static gavl_audio_frame_t * get_audio_func(void * data)
+  {
+  bg_ffmpeg_codec_context_t * ctx = data;
+
+  if(!(ctx->pool_get = get_pool_frame(ctx)))
+    return NULL;
+  
+  ctx->pool_get->af->valid_samples = 0;
+  return ctx->pool_get->af;
+  }
 
 void bg_ffmpeg_set_audio_format_avctx(AVCodecContext * avctx,
                                       const gavl_audio_format_t * fmt)
@@ -343,37 +749,141 @@ void bg_ffmpeg_set_audio_format_params(AVCodecParameters * avctx,
   avctx->channels    = fmt->num_channels;
   }
 
-gavl_audio_sink_t * bg_ffmpeg_codec_open_audio(bg_ffmpeg_codec_context_t * ctx,
-                                               gavl_compression_info_t * ci,
-                                               gavl_audio_format_t * fmt,
-                                               gavl_dictionary_t * m)
-  {
-  AVOutputFormat * ofmt;
-  //  if(!find_encoder(ctx))
-  //    return NULL;
-  
-  /* Set format for codec */
+/* Native PCM and G.711: One packet per frame, no re-blocking */
 
-  if(!ctx->codec)
-    return NULL;
+static gavl_sink_status_t
+write_audio_native(void * data, gavl_audio_frame_t * frame)
+  {
+  int num;
+  bgen_stats_clock_t clock;
+  bg_ffmpeg_codec_context_t * ctx = data;
 
-  bg_ffmpeg_set_audio_format_avctx(ctx->avctx, fmt);
+  if(ctx->in_pts == GAVL_TIME_UNDEFINED)
+    ctx->in_pts = frame->timestamp;
 
+  if(!frame->valid_samples)
+    return GAVL_SINK_OK;
   
-  ctx->avctx->channel_layout =
-    bg_ffmpeg_get_channel_layout(fmt);
+  num = frame->valid_samples * ctx->afmt.num_channels;
+  
+  gavl_packet_reset(&ctx->gp);
+  
+  bgen_stats_codec_start(&ctx->perf, &clock);
+  if(ctx->pcm_encode)
+    {
+    gavl_buffer_alloc(&ctx->pcm_buf, num * ctx->pcm_bytes);
+    ctx->pcm_encode(frame->samples.u_8, ctx->pcm_buf.buf, num);
+    ctx->gp.buf.buf = ctx->pcm_buf.buf;
+    }
+  else
+    ctx->gp.buf.buf = frame->samples.u_8;
+  
+  ctx->gp.buf.len  = num * ctx->pcm_bytes;
+  ctx->gp.pts      = ctx->in_pts;
+  ctx->gp.duration = frame->valid_samples;
+  ctx->gp.flags   |= GAVL_PACKET_KEYFRAME;
+  bgen_stats_codec_end(&ctx->perf, &clock);
+
+  ctx->in_pts += frame->valid_samples;
+
+  bgen_stats_lock(&ctx->perf);
+  ctx->perf.frames += frame->valid_samples;
+  ctx->perf.packets++;
+  ctx->perf.bytes += ctx->gp.buf.len;
+  ctx->perf.duration += frame->valid_samples;
+  bgen_stats_unlock(&ctx->perf);
+
+  if(ctx->trace)
+    {
+    bgen_trace_frame(ctx->trace, ctx->gp.pts, ctx->gp.duration);
+    bgen_trace_packet(ctx->trace, ctx->gp.pts, ctx->gp.duration);
+    }
 
+  BGEN_PROBE_FRAME_IN(ctx->codec->name, ctx, ctx->gp.pts, ctx->gp.duration);
+  BGEN_PROBE_PACKET_OUT(ctx->codec->name, ctx, ctx->gp.pts, ctx->gp.duration,
+                        ctx->gp.buf.len);
   
-  /* Sample format */
-  ctx->avctx->sample_fmt = ctx->codec->sample_fmts[0];
-  fmt->sample_format =
-    bg_sample_format_ffmpeg_2_gavl(ctx->avctx->sample_fmt, &fmt->interleave_mode);
+  if(gavl_packet_sink_put_packet(ctx->psink, &ctx->gp) != GAVL_SINK_OK)
+    ctx->flags |= FLAG_ERROR;
+  
+  ctx->gp.buf.buf = NULL;
 
-  /* Set codec specific stuff */
-  switch(ctx->avctx->codec_id)
-    {
-    case AV_CODEC_ID_PCM_S16BE:
-    case AV_CODEC_ID_PCM_S16LE:
+  if(ctx->flags & FLAG_ERROR)
+    return GAVL_SINK_ERROR;
+  return GAVL_SINK_OK;
+  }
+
+static gavl_audio_sink_t * open_audio_native(bg_ffmpeg_codec_context_t * ctx,
+                                             gavl_compression_info_t * ci,
+                                             gavl_audio_format_t * fmt,
+                                             gavl_dictionary_t * m)
+  {
+  if(!fmt->samples_per_frame)
+    fmt->samples_per_frame = 1024;
+  
+  gavl_audio_format_copy(&ctx->afmt, fmt);
+  
+  ctx->asink = gavl_audio_sink_create(NULL, write_audio_native, ctx, fmt);
+  ctx->perf.timescale = fmt->samplerate;
+  
+  set_compression_info(ctx, ci, m);
+
+  ctx->in_pts = GAVL_TIME_UNDEFINED;
+  ctx->trace = bgen_trace_create(LOG_DOMAIN, ctx->codec->name);
+  ctx->flags |= FLAG_INITIALIZED;
+  return ctx->asink;
+  }
+
+gavl_audio_sink_t * bg_ffmpeg_codec_open_audio(bg_ffmpeg_codec_context_t * ctx,
+                                               gavl_compression_info_t * ci,
+                                               gavl_audio_format_t * fmt,
+                                               gavl_dictionary_t * m)
+  {
+  AVOutputFormat * ofmt;
+  //  if(!find_encoder(ctx))
+  //    return NULL;
+  
+  if(!ctx->codec)
+    return NULL;
+
+  /* Next clip */
+  if(ctx->flags & FLAG_INITIALIZED)
+    {
+    if(gavl_audio_formats_equal(&ctx->open_afmt, fmt) &&
+       bg_ffmpeg_codec_reset(ctx))
+      {
+      gavl_audio_format_copy(fmt, &ctx->afmt);
+      set_compression_info(ctx, ci, m);
+      return ctx->asink;
+      }
+    if(!reinit(ctx))
+      return NULL;
+    }
+  
+  gavl_audio_format_copy(&ctx->open_afmt, fmt);
+
+  if((ctx->pcm_bytes = bg_ffmpeg_pcm_init(ctx->id, fmt, &ctx->pcm_encode)))
+    return open_audio_native(ctx, ci, fmt, m);
+  
+  /* Set format for codec */
+
+  bg_ffmpeg_set_audio_format_avctx(ctx->avctx, fmt);
+
+  
+  ctx->avctx->channel_layout =
+    bg_ffmpeg_get_channel_layout(fmt);
+
+  
+  /* Sample format */
+  ctx->avctx->sample_fmt = bg_ffmpeg_choose_sampleformat(ctx->codec->sample_fmts, fmt);
+  if(ctx->avctx->sample_fmt == AV_SAMPLE_FMT_NONE)
+    return NULL;
+
+  /* Set codec specific stuff */
+  switch(ctx->avctx->codec_id)
+    {
+    case AV_CODEC_ID_PCM_S16BE:
+    case AV_CODEC_ID_PCM_S16LE:
       ctx->avctx->bit_rate =
         ctx->afmt.samplerate * ctx->afmt.num_channels * 16;
       break;
@@ -399,6 +909,16 @@ gavl_audio_sink_t * bg_ffmpeg_codec_open_audio(bg_ffmpeg_codec_context_t * ctx,
       (ofmt->flags & AVFMT_GLOBALHEADER)))
     ctx->avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
   
+  /* avcodec_open2() will eat our options */
+  av_dict_copy(&ctx->open_options, ctx->options, 0);
+
+  if(!init_parallel(ctx, NULL))
+    return NULL;
+
+  if(!ctx->num_threads)
+    init_threads(ctx);
+  unregister_threads(ctx);
+  
   /* Open encoder */
   if(avcodec_open2(ctx->avctx, ctx->codec, &ctx->options) < 0)
     {
@@ -411,57 +931,31 @@ gavl_audio_sink_t * bg_ffmpeg_codec_open_audio(bg_ffmpeg_codec_context_t * ctx,
   else
     fmt->samples_per_frame = ctx->avctx->frame_size;
   
-  ctx->aframe = gavl_audio_frame_create(fmt);
-
-  /* Set up AVFrame */
-  if(fmt->interleave_mode == GAVL_INTERLEAVE_ALL)
-    {
-    ctx->frame->extended_data = ctx->frame->data;
-    ctx->frame->linesize[0] = ctx->aframe->channel_stride * fmt->num_channels;
-    ctx->frame->extended_data[0] = ctx->aframe->samples.u_8;
-    }
-  else
-    {
-    int i;
-    if(fmt->num_channels > AV_NUM_DATA_POINTERS)
-      ctx->frame->extended_data = av_mallocz(fmt->num_channels *
-                                             sizeof(*ctx->frame->extended_data));
-    else
-      ctx->frame->extended_data = ctx->frame->data;
-    
-    for(i = 0; i < fmt->num_channels; i++)
-      ctx->frame->extended_data[i] = ctx->aframe->channels.u_8[i];
-    ctx->frame->linesize[0] = ctx->aframe->channel_stride;
-    }
+  /* Copy format for later use */
+  gavl_audio_format_copy(&ctx->afmt, fmt);
+  ctx->perf.timescale = fmt->samplerate;
   
-  /* Mute frame */
-  gavl_audio_frame_mute(ctx->aframe, fmt);
-  ctx->aframe->valid_samples = 0;
+  /* Set up AVFrame for passing caller frames directly */
+  if((fmt->interleave_mode != GAVL_INTERLEAVE_ALL) &&
+     (fmt->num_channels > AV_NUM_DATA_POINTERS))
+    ctx->frame->extended_data = av_mallocz(fmt->num_channels *
+                                           sizeof(*ctx->frame->extended_data));
+  else
+    ctx->frame->extended_data = ctx->frame->data;
   
-  ctx->asink = gavl_audio_sink_create(NULL, write_audio_func, ctx, fmt);
+  ctx->frame->format         = ctx->avctx->sample_fmt;
+  ctx->frame->channel_layout = ctx->avctx->channel_layout;
+  ctx->frame->channels       = ctx->avctx->channels;
+  ctx->frame->sample_rate    = ctx->avctx->sample_rate;
   
-  /* Copy format for later use */
-  gavl_audio_format_copy(&ctx->afmt, fmt);
+  ctx->asink = gavl_audio_sink_create(get_audio_func, write_audio_func, ctx, fmt);
 
   set_compression_info(ctx, ci, m);
-
-  if(ci)
-    {
-    switch(ctx->avctx->codec_id)
-      {
-      case AV_CODEC_ID_MP2:
-      case AV_CODEC_ID_AC3:
-        ci->bitrate = ctx->avctx->bit_rate;
-        break;
-      default:
-        break;
-      }
-    ci->pre_skip = ctx->avctx->delay;
-    }
   
   ctx->in_pts = GAVL_TIME_UNDEFINED;
   ctx->out_pts = GAVL_TIME_UNDEFINED;
   
+  ctx->trace = bgen_trace_create(LOG_DOMAIN, ctx->codec->name);
   ctx->flags |= FLAG_INITIALIZED;
   return ctx->asink;
   }
@@ -481,11 +975,113 @@ int bg_ffmpeg_codec_set_video_pass(bg_ffmpeg_codec_context_t * ctx,
   return 1;
   }
 
+/* Pass an encoded packet to the sink. The timing comes from info
+   if available, from the pts cache otherwise */
+
+static int put_video_packet(void * data, AVPacket * pkt,
+                            const bg_ffmpeg_frame_info_t * info)
+  {
+  bg_ffmpeg_frame_info_t cached;
+  bg_ffmpeg_codec_context_t * ctx = data;
+  
+  gavl_packet_reset(&ctx->gp);
+
+  ctx->gp.pts = pkt->pts;
+
+  if(pkt->flags & AV_PKT_FLAG_KEY)
+    ctx->gp.flags |= GAVL_PACKET_KEYFRAME;
+    
+  ctx->gp.buf.len = pkt->size;
+  ctx->gp.buf.buf = pkt->data;
+
+  bgen_stats_lock(&ctx->perf);
+  ctx->perf.packets++;
+  ctx->perf.bytes += pkt->size;
+  bgen_stats_unlock(&ctx->perf);
+    
+  if(ctx->vfmt.framerate_mode == GAVL_FRAMERATE_CONSTANT)
+    ctx->gp.pts *= ctx->vfmt.frame_duration;
+    
+  /* Detect VP8 alternate reference frames */
+  if((ctx->id == AV_CODEC_ID_VP8) &&
+     !(ctx->gp.buf.buf[0] & 0x10))
+    ctx->gp.flags |= GAVL_PACKET_NOOUTPUT; 
+  else
+    {
+    /* Decide frame type */
+    if(ctx->gp.pts < ctx->out_pts)
+      ctx->gp.flags |= GAVL_PACKET_TYPE_B;
+    else
+      {
+      if(ctx->gp.flags & GAVL_PACKET_KEYFRAME)
+        ctx->gp.flags |= GAVL_PACKET_TYPE_I;
+      else
+        ctx->gp.flags |= GAVL_PACKET_TYPE_P;
+      ctx->out_pts = ctx->gp.pts;
+      }
+
+    if(!info && bg_ffmpeg_pts_cache_pop(ctx->pc, pkt->pts, &cached))
+      info = &cached;
+    
+    if(info)
+      {
+      ctx->gp.duration = info->duration;
+      ctx->gp.timecode = info->timecode;
+      bgen_stats_lock(&ctx->perf);
+      ctx->perf.duration += info->duration;
+      bgen_stats_unlock(&ctx->perf);
+      }
+    else
+      {
+      ctx->flags |= FLAG_ERROR;
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+             "Got no packet in cache for pts %"PRId64, ctx->gp.pts);
+      //     fprintf(stderr, "Got no packet in cache for pts %"PRId64"\n", ctx->gp.pts);
+      }
+    //      else
+    //        fprintf(stderr, "pop packet: %"PRId64"\n", ctx->gp.pts);
+    }
+
+  if(ctx->trace)
+    bgen_trace_packet(ctx->trace, ctx->gp.pts, ctx->gp.duration);
+
+  BGEN_PROBE_PACKET_OUT(ctx->codec->name, ctx, ctx->gp.pts, ctx->gp.duration,
+                        ctx->gp.buf.len);
+  
+  /* Write frame */
+
+  //    fprintf(stderr, "Put video packet\n");
+  //    gavl_packet_dump(&ctx->gp);
+    
+  if(gavl_packet_sink_put_packet(ctx->psink, &ctx->gp) != GAVL_SINK_OK)
+    {
+    ctx->flags |= FLAG_ERROR;
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+             "Writing packet failed");
+    }
+  ctx->gp.buf.buf = NULL;
+
+  return !(ctx->flags & FLAG_ERROR);
+  }
+
 static int flush_video(bg_ffmpeg_codec_context_t * ctx,
                        AVFrame * frame)
   {
   int result;
   AVPacket pkt;
+  bgen_stats_clock_t clock;
+
+  if(ctx->par)
+    {
+    if(!bg_ffmpeg_parallel_flush(ctx->par))
+      {
+      ctx->flags |= FLAG_ERROR;
+      return 0;
+      }
+    return 1;
+    }
+
+  bgen_stats_codec_start(&ctx->perf, &clock);
   
   if(avcodec_send_frame(ctx->avctx, frame) < 0)
     {
@@ -509,68 +1105,22 @@ static int flush_video(bg_ffmpeg_codec_context_t * ctx,
       return 0;
       }
     
-    /* Got packet */
-
-    gavl_packet_reset(&ctx->gp);
-
-    ctx->gp.pts = pkt.pts;
-
-    if(pkt.flags & AV_PKT_FLAG_KEY)
-      ctx->gp.flags |= GAVL_PACKET_KEYFRAME;
-    
-    ctx->gp.buf.len = pkt.size;
-    ctx->gp.buf.buf = pkt.data;
-    
-    if(ctx->vfmt.framerate_mode == GAVL_FRAMERATE_CONSTANT)
-      ctx->gp.pts *= ctx->vfmt.frame_duration;
-    
-    /* Detect VP8 alternate reference frames */
-    if((ctx->id == AV_CODEC_ID_VP8) &&
-       !(ctx->gp.buf.buf[0] & 0x10))
-      ctx->gp.flags |= GAVL_PACKET_NOOUTPUT; 
-    else
-      {
-      /* Decide frame type */
-      if(ctx->gp.pts < ctx->out_pts)
-        ctx->gp.flags |= GAVL_PACKET_TYPE_B;
-      else
-        {
-        if(ctx->gp.flags & GAVL_PACKET_KEYFRAME)
-          ctx->gp.flags |= GAVL_PACKET_TYPE_I;
-        else
-          ctx->gp.flags |= GAVL_PACKET_TYPE_P;
-        ctx->out_pts = ctx->gp.pts;
-        }
-
-      if(!bg_encoder_pts_cache_pop_packet(ctx->pc, &ctx->gp, -1, ctx->gp.pts))
-        {
-        ctx->flags |= FLAG_ERROR;
-        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
-               "Got no packet in cache for pts %"PRId64, ctx->gp.pts);
-        //     fprintf(stderr, "Got no packet in cache for pts %"PRId64"\n", ctx->gp.pts);
-        }
-      //      else
-        //        fprintf(stderr, "pop packet: %"PRId64"\n", ctx->gp.pts);
-      }
-    /* Write frame */
+    /* Got packet: Frames still inside the encoder are the delay */
+    if(ctx->frames_in - ctx->packets_out - 1 > ctx->max_delay)
+      ctx->max_delay = ctx->frames_in - ctx->packets_out - 1;
+    ctx->packets_out++;
 
-    //    fprintf(stderr, "Put video packet\n");
-    //    gavl_packet_dump(&ctx->gp);
+    bgen_stats_codec_end(&ctx->perf, &clock);
+    put_video_packet(ctx, &pkt, NULL);
     
-    if(gavl_packet_sink_put_packet(ctx->psink, &ctx->gp) != GAVL_SINK_OK)
-      {
-      ctx->flags |= FLAG_ERROR;
-      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
-             "Writing packet failed");
-      }
     /* Write stats */
     if((ctx->pass == 1) && ctx->avctx->stats_out && ctx->stats_file)
       fprintf(ctx->stats_file, "%s", ctx->avctx->stats_out);
-
-    ctx->gp.buf.buf = NULL;
     
     av_packet_unref(&pkt);
+    bgen_stats_codec_start(&ctx->perf, &clock);
     }
+  bgen_stats_codec_end(&ctx->perf, &clock);
   
   return 1;
   }
@@ -578,34 +1128,76 @@ static int flush_video(bg_ffmpeg_codec_context_t * ctx,
 static gavl_sink_status_t
 write_video_func(void * data, gavl_video_frame_t * frame)
   {
+  AVFrame * f;
+  bg_ffmpeg_frame_t * pf;
+  bg_ffmpeg_frame_info_t info;
+  bgen_stats_clock_t clock;
   bg_ffmpeg_codec_context_t * ctx = data;
 
-  if(!bg_encoder_pts_cache_push_frame(ctx->pc, frame))
+  if(ctx->trace)
+    bgen_trace_frame(ctx->trace, frame->timestamp, frame->duration);
+
+  BGEN_PROBE_FRAME_IN(ctx->codec->name, ctx, frame->timestamp, frame->duration);
+  
+  pf = ctx->pool_get;
+  ctx->pool_get = NULL;
+  
+  if(pf && (pf->vf != frame))
+    pf = NULL;
+  
+  /* Don't convert the caller's frame in place and
+     don't let other threads read from it */
+  if(!pf && (ctx->convert_frame || ctx->par))
     {
-    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "PTS cache full");
-    return GAVL_SINK_ERROR;
+    if(!(pf = get_pool_frame(ctx)))
+      return GAVL_SINK_ERROR;
+    gavl_video_frame_copy(&ctx->vfmt, pf->vf, frame);
     }
   
-  //  fprintf(stderr, "push frame: %"PRId64"\n", frame->timestamp);
+  if(pf)
+    {
+    /* Our own frame: The encoder can keep a reference */
+    if(ctx->convert_frame)
+      ctx->convert_frame(ctx, pf->vf);
+    f = pf->f;
+    }
+  else
+    {
+    f = ctx->frame;
+    f->data[0]     = frame->planes[0];
+    f->data[1]     = frame->planes[1];
+    f->data[2]     = frame->planes[2];
+    f->linesize[0] = frame->strides[0];
+    f->linesize[1] = frame->strides[1];
+    f->linesize[2] = frame->strides[2];
+    }
   
-  if(ctx->convert_frame)
-    ctx->convert_frame(ctx, frame);
-
-  ctx->frame->pts = frame->timestamp;
+  f->pts = frame->timestamp;
   if(ctx->vfmt.framerate_mode == GAVL_FRAMERATE_CONSTANT)
-    ctx->frame->pts /= ctx->vfmt.frame_duration;
-  
-  ctx->frame->data[0]     = frame->planes[0];
-  ctx->frame->data[1]     = frame->planes[1];
-  ctx->frame->data[2]     = frame->planes[2];
-  ctx->frame->linesize[0] = frame->strides[0];
-  ctx->frame->linesize[1] = frame->strides[1];
-  ctx->frame->linesize[2] = frame->strides[2];
- 
-//  ctx->frame->width  = ctx->vfmt.image_width;
-//  ctx->frame->height = ctx->vfmt.image_height;
- 
-  flush_video(ctx, ctx->frame);
+    f->pts /= ctx->vfmt.frame_duration;
+
+  info.pts      = f->pts;
+  info.duration = frame->duration;
+  info.timecode = frame->timecode;
+
+  bgen_stats_lock(&ctx->perf);
+  ctx->perf.frames++;
+  bgen_stats_unlock(&ctx->perf);
+  
+  if(ctx->par)
+    {
+    /* Time we are blocked by the workers */
+    bgen_stats_codec_start(&ctx->perf, &clock);
+    if(!bg_ffmpeg_parallel_put_frame(ctx->par, f, &info))
+      ctx->flags |= FLAG_ERROR;
+    bgen_stats_codec_end(&ctx->perf, &clock);
+    }
+  else
+    {
+    bg_ffmpeg_pts_cache_push(ctx->pc, &info);
+    ctx->frames_in++;
+    flush_video(ctx, f);
+    }
 
   if(ctx->flags & FLAG_ERROR)
     return GAVL_SINK_ERROR;
@@ -613,10 +1205,173 @@ write_video_func(void * data, gavl_video_frame_t * frame)
   return GAVL_SINK_OK;
   }
 
+/* Hand out a frame from the pool, so the caller can render
+   directly into aligned buffers the encoder can keep references to */
+
 static gavl_video_frame_t * get_video_func(void * data)
   {
   bg_ffmpeg_codec_context_t * ctx = data;
-  return ctx->vframe;
+
+  if(!(ctx->pool_get = get_pool_frame(ctx)))
+    return NULL;
+  
+  return ctx->pool_get->vf;
+  }
+
+/*
+ *  Additional codec contexts for parallel encoding or for replacing
+ *  our own one. They get the same parameters as our own context and
+ *  are opened right away. Chunk contexts are created by the worker
+ *  threads while we are encoding.
+ */
+
+typedef struct
+  {
+  AVCodecContext * avctx;
+  AVDictionary * options;
+  } clone_t;
+
+static void clone_apply_func(void * priv, const char * name,
+                             const gavl_value_t * val)
+  {
+  clone_t * c = priv;
+  bg_ffmpeg_set_codec_parameter(c->avctx, &c->options, name, val);
+  }
+
+static AVCodecContext * clone_context(bg_ffmpeg_codec_context_t * ctx,
+                                      int thread_count)
+  {
+  clone_t c;
+  AVCodecParameters * par;
+
+  if(!(c.avctx = avcodec_alloc_context3(ctx->codec)))
+    return NULL;
+
+  c.options = NULL;
+  bg_cfg_section_apply(&ctx->params, NULL, clone_apply_func, &c);
+  av_dict_copy(&c.options, ctx->open_options, 0);
+
+  /* Format is set by us, not by parameters */
+  par = avcodec_parameters_alloc();
+  avcodec_parameters_from_context(par, ctx->avctx);
+  avcodec_parameters_to_context(c.avctx, par);
+  avcodec_parameters_free(&par);
+
+  /* The encoder creates it's own extradata */
+  av_freep(&c.avctx->extradata);
+  c.avctx->extradata_size = 0;
+  
+  c.avctx->time_base    = ctx->avctx->time_base;
+  c.avctx->gop_size     = ctx->avctx->gop_size;
+  c.avctx->flags        = ctx->avctx->flags;
+  c.avctx->flags2       = ctx->avctx->flags2;
+  c.avctx->thread_count = thread_count;
+  c.avctx->thread_type  = ctx->avctx->thread_type;
+
+  if(avcodec_open2(c.avctx, ctx->codec, &c.options) < 0)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "avcodec_open2 failed for new context");
+    avcodec_free_context(&c.avctx);
+    }
+  av_dict_free(&c.options);
+
+  /* All chunks must fit to the codec header we already exported */
+  if(c.avctx && avcodec_is_open(ctx->avctx) &&
+     ((c.avctx->extradata_size != ctx->avctx->extradata_size) ||
+      (c.avctx->extradata_size &&
+       memcmp(c.avctx->extradata, ctx->avctx->extradata,
+              c.avctx->extradata_size))))
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Codec header of new context differs");
+    avcodec_free_context(&c.avctx);
+    }
+  return c.avctx;
+  }
+
+static AVCodecContext * create_context(void * data)
+  {
+  return clone_context(data, 1);
+  }
+
+#define MAX_CONTEXTS 16
+
+/*
+ *  Use several contexts for intra-only codecs or chunked encoding.
+ *  Chunks need closed GOPs and are rounded up to whole GOPs. Since
+ *  all chunks get the same bitrate, the rate control target for the
+ *  whole stream stays the same.
+ *
+ *  Audio chunks are only supported for MP2 and AC-3, which have
+ *  no bit reservoir. They are primed with one frame of the previous
+ *  chunk, so the filterbank sees the same samples as in a serial encode.
+ */
+
+static int init_parallel(bg_ffmpeg_codec_context_t * ctx,
+                         const ffmpeg_codec_info_t * info)
+  {
+  int num;
+  int chunk_frames = 0;
+  int overlap = 0;
+  
+  if((ctx->num_contexts == 1) || ctx->total_passes || ctx->live)
+    return 1;
+
+  if(ctx->type == AVMEDIA_TYPE_AUDIO)
+    {
+    if((ctx->chunk_frames <= 0) ||
+       ((ctx->id != AV_CODEC_ID_MP2) && (ctx->id != AV_CODEC_ID_AC3)))
+      return 1;
+    chunk_frames = ctx->chunk_frames;
+    overlap = 1;
+    }
+  else if(!(info->flags & FLAG_INTRA_ONLY))
+    {
+    if(ctx->chunk_frames <= 0)
+      return 1;
+
+    chunk_frames = ctx->chunk_frames;
+    
+    if(ctx->avctx->gop_size > 1)
+      chunk_frames = ((chunk_frames + ctx->avctx->gop_size - 1) /
+                      ctx->avctx->gop_size) * ctx->avctx->gop_size;
+    }
+
+  num = bgen_threads_reserve(ctx->num_contexts);
+
+  if(num > MAX_CONTEXTS)
+    {
+    bgen_threads_release(num - MAX_CONTEXTS);
+    num = MAX_CONTEXTS;
+    }
+
+  if(num < 2) // No cores left, encode serially
+    {
+    bgen_threads_release(num);
+    return 1;
+    }
+  
+  ctx->num_threads = num;
+  
+  /* The contexts do the threading */
+  ctx->avctx->thread_count = 1;
+
+  if(chunk_frames && (ctx->type == AVMEDIA_TYPE_VIDEO))
+    ctx->avctx->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+
+  /* Each frame must be decodable on its own. FFV1 would otherwise
+     keep its context states across frames, which compresses better
+     but breaks parallel contexts */
+  if((ctx->type == AVMEDIA_TYPE_VIDEO) && (info->flags & FLAG_INTRA_ONLY))
+    ctx->avctx->gop_size = 1;
+  
+  if(!(ctx->par = bg_ffmpeg_parallel_create(num, chunk_frames, overlap,
+                                            create_context,
+                                            (ctx->type == AVMEDIA_TYPE_VIDEO) ?
+                                            put_video_packet : put_audio_packet,
+                                            ctx)))
+    return 0;
+  
+  return 1;
   }
 
 void bg_ffmpeg_set_video_dimensions_avctx(AVCodecContext * avctx,
@@ -640,6 +1395,38 @@ void bg_ffmpeg_set_video_dimensions_params(AVCodecParameters * avctx,
   }
 
 
+/*
+ *  Low latency: No frame reordering, no lookahead and no frame threading
+ *  (see init_threads()), so each packet comes out right after its frame.
+ */
+
+static void init_low_latency(bg_ffmpeg_codec_context_t * ctx,
+                             const ffmpeg_codec_info_t * info)
+  {
+  char * str;
+  AVDictionaryEntry * tune;
+  
+  if(info->flags & FLAG_B_FRAMES)
+    ctx->avctx->max_b_frames = 0;
+
+  ctx->avctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
+  if(!strcmp(ctx->codec->name, "libx264"))
+    {
+    /* Can be combined with the psy tunings */
+    if(!(tune = av_dict_get(ctx->options, "tune", NULL, 0)))
+      av_dict_set(&ctx->options, "tune", "zerolatency", 0);
+    else if(!strstr(tune->value, "zerolatency"))
+      {
+      str = bg_sprintf("%s,zerolatency", tune->value);
+      av_dict_set(&ctx->options, "tune", str, 0);
+      free(str);
+      }
+    }
+  else if((ctx->id == AV_CODEC_ID_VP8) || (ctx->id == AV_CODEC_ID_VP9))
+    av_dict_set(&ctx->options, "lag-in-frames", "0", 0);
+  }
+
 gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
                                                gavl_compression_info_t * ci,
                                                gavl_video_format_t * fmt,
@@ -647,7 +1434,6 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
   {
   int do_convert = 0;
   const ffmpeg_codec_info_t * info;
-  gavl_video_sink_get_func get_func = NULL;
   AVOutputFormat * ofmt;
 
   //  if(!find_encoder(ctx))
@@ -655,10 +1441,27 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
 
   if(!ctx->codec)
     return NULL;
+
+  /* Next clip. Multipass encoding always starts over */
+  if(ctx->flags & FLAG_INITIALIZED)
+    {
+    if(!ctx->total_passes &&
+       gavl_video_formats_equal(&ctx->open_vfmt, fmt) &&
+       bg_ffmpeg_codec_reset(ctx))
+      {
+      gavl_video_format_copy(fmt, &ctx->vfmt);
+      set_compression_info(ctx, ci, m);
+      return ctx->vsink;
+      }
+    if(!reinit(ctx))
+      return NULL;
+    }
+  
+  gavl_video_format_copy(&ctx->open_vfmt, fmt);
   
   info = bg_ffmpeg_get_codec_info(ctx->id,
                                   AVMEDIA_TYPE_VIDEO);
-  
+
   /* Set format for codec */
 
   bg_ffmpeg_set_video_dimensions_avctx(ctx->avctx, fmt);
@@ -670,6 +1473,8 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
   bg_ffmpeg_choose_pixelformat(ctx->codec->pix_fmts,
                                &ctx->avctx->pix_fmt,
                                &fmt->pixelformat, &do_convert);
+  if(ctx->avctx->pix_fmt == AV_PIX_FMT_NONE)
+    return NULL;
   
   /* Framerate */
   if(info->flags & FLAG_CONSTANT_FRAMERATE ||
@@ -735,54 +1540,57 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
      ((ofmt = guess_format(ctx->format->short_name, NULL, NULL)) &&
       (ofmt->flags & AVFMT_GLOBALHEADER)))
     ctx->avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  /* The user can override the decision of the format writer */
+  if(ctx->latency != LATENCY_AUTO)
+    ctx->live = (ctx->latency == LATENCY_LOW);
+  
+  if(ctx->live)
+    init_low_latency(ctx, info);
+  
+  /* avcodec_open2() will eat our options */
+  av_dict_copy(&ctx->open_options, ctx->options, 0);
+  
+  if(!init_parallel(ctx, info))
+    return NULL;
+  
+  if(!ctx->num_threads)
+    init_threads(ctx);
+  unregister_threads(ctx);
   
   if(avcodec_open2(ctx->avctx, ctx->codec, &ctx->options) < 0)
     {
     gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "avcodec_open2 failed for video");
     return NULL;
     }
+
+  if(ctx->live)
+    gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
+             "Low latency mode for %s, codec delay: %d frames",
+             ctx->codec->name, ctx->avctx->delay);
   
-  ctx->pc = bg_encoder_pts_cache_create();
+  /* Frames the encoder keeps before the first packet comes out.
+     The cache grows if this was too optimistic. */
+  ctx->pc = bg_ffmpeg_pts_cache_create(ctx->avctx->delay +
+                                       ctx->avctx->max_b_frames + 1);
   
   gavl_video_format_copy(&ctx->vfmt, fmt);
+  ctx->perf.timescale = fmt->timescale;
 
-  /* Create temporary frame if necessary */
   if(do_convert)
-    {
-    fprintf(stderr, "Need colorspace conversion\n");
-    ctx->vframe = gavl_video_frame_create(&ctx->vfmt);
-    get_func = get_video_func;
-
     get_pixelformat_converter(ctx, ctx->avctx->pix_fmt, do_convert);
-    
-    }
 
-  ctx->vsink = gavl_video_sink_create(get_func, write_video_func, ctx, &ctx->vfmt);
+  ctx->vsink = gavl_video_sink_create(get_video_func, write_video_func, ctx, &ctx->vfmt);
   
   /* Set up compression info */
   set_compression_info(ctx, ci, m);
 
-  if(ci)
-    {
-    if(!(info->flags & FLAG_INTRA_ONLY))
-      {
-      if((ctx->avctx->gop_size > 1) ||
-         (ctx->avctx->gop_size < 0))
-        {
-        ci->flags |= GAVL_COMPRESSION_HAS_P_FRAMES;
-        }
-      if((info->flags & FLAG_B_FRAMES) &&
-         ((ctx->avctx->max_b_frames > 0) || ctx->avctx->has_b_frames))
-        ci->flags |= GAVL_COMPRESSION_HAS_B_FRAMES |
-          GAVL_COMPRESSION_HAS_P_FRAMES;
-      }
-    }
-
   ctx->frame->width  = ctx->vfmt.image_width;
   ctx->frame->height = ctx->vfmt.image_height;
  
   ctx->frame->format = ctx->avctx->pix_fmt;
  
+  ctx->trace = bgen_trace_create(LOG_DOMAIN, ctx->codec->name);
   ctx->flags |= FLAG_INITIALIZED;
   
   return ctx->vsink;
@@ -796,52 +1604,212 @@ void bg_ffmpeg_codec_set_packet_sink(bg_ffmpeg_codec_context_t * ctx,
 
 void bg_ffmpeg_codec_flush(bg_ffmpeg_codec_context_t * ctx)
   {
-  int result;
-
   /* Flush */
   if(!(ctx->flags & FLAG_INITIALIZED))
     return;
 
   if(ctx->type == AVMEDIA_TYPE_VIDEO)
+    {
     flush_video(ctx, NULL);
-  else // Audio
+
+    if(ctx->packets_out)
+      gavl_log(ctx->live ? GAVL_LOG_INFO : GAVL_LOG_DEBUG, LOG_DOMAIN,
+               "Maximum encoder delay of %s: %d frames",
+               ctx->codec->name, ctx->max_delay);
+    }
+  else if(!ctx->pcm_bytes) // Audio
+    flush_audio(ctx);
+
+  bgen_stats_log(&ctx->perf, LOG_DOMAIN, ctx->codec->name);
+
+  if(ctx->trace)
     {
-    while(1)
-      {
-      // fprintf(stderr, "Flush audio %d\n", ctx->aframe->valid_samples);
-      result = flush_audio(ctx);
-      if(result <= 0)
-        break;
-      }
+    bgen_trace_destroy(ctx->trace);
+    ctx->trace = NULL;
     }
   
   ctx->flags |= FLAG_FLUSHED;
   }
 
-void bg_ffmpeg_codec_destroy(bg_ffmpeg_codec_context_t * ctx)
+/* Release everything, which was set up by the open functions */
+
+static void close_codec(bg_ffmpeg_codec_context_t * ctx)
   {
+  int i;
+  
   if(!(ctx->flags & FLAG_FLUSHED))
     bg_ffmpeg_codec_flush(ctx);
-  
-  /* Destroy */
-  if(ctx->avctx)
-    avcodec_free_context(&ctx->avctx);
 
+  if(ctx->trace)
+    {
+    bgen_trace_destroy(ctx->trace);
+    ctx->trace = NULL;
+    }
+  
+  if(ctx->par)
+    {
+    bg_ffmpeg_parallel_destroy(ctx->par);
+    ctx->par = NULL;
+    }
+  
+  if(ctx->num_threads)
+    {
+    bgen_threads_release(ctx->num_threads);
+    ctx->num_threads = 0;
+    }
+  
   if(ctx->pc)
-    bg_encoder_pts_cache_destroy(ctx->pc);
+    {
+    bg_ffmpeg_pts_cache_destroy(ctx->pc);
+    ctx->pc = NULL;
+    }
   
-  if(ctx->aframe)
-    gavl_audio_frame_destroy(ctx->aframe);
-  if(ctx->vframe)
-    gavl_video_frame_destroy(ctx->vframe);
+  if(ctx->pool)
+    {
+    for(i = 0; i < ctx->pool_size; i++)
+      destroy_pool_frame(ctx->pool[i]);
+    free(ctx->pool);
+    ctx->pool = NULL;
+    ctx->pool_size = 0;
+    }
+  ctx->pool_get = NULL;
+  ctx->pool_cur = NULL;
   
   if(ctx->asink)
+    {
     gavl_audio_sink_destroy(ctx->asink);
+    ctx->asink = NULL;
+    }
   if(ctx->vsink)
+    {
     gavl_video_sink_destroy(ctx->vsink);
-
-  if(ctx->frame->extended_data != ctx->frame->data)
+    ctx->vsink = NULL;
+    }
+  
+  if(ctx->frame && (ctx->frame->extended_data != ctx->frame->data))
+    {
     av_freep(&ctx->frame->extended_data);
+    ctx->frame->extended_data = ctx->frame->data;
+    }
+  
+  if(ctx->slicer)
+    {
+    bg_ffmpeg_slicer_destroy(ctx->slicer);
+    ctx->slicer = NULL;
+    }
+  
+  ctx->convert_frame = NULL;
+  ctx->pcm_encode = NULL;
+  ctx->pcm_bytes = 0;
+  ctx->frames_in = 0;
+  ctx->packets_out = 0;
+  ctx->max_delay = 0;
+  bgen_stats_init(&ctx->perf, 0);
+  ctx->flags = 0;
+  }
+
+/*
+ *  Reusing an opened encoder for the next clip
+ */
+
+/* Bring the flushed encoder back into a state where it accepts frames */
+
+static int flush_context(bg_ffmpeg_codec_context_t * ctx)
+  {
+  AVCodecContext * avctx;
+  
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+  if(ctx->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)
+    {
+    avcodec_flush_buffers(ctx->avctx);
+    return 1;
+    }
+#endif
+
+  /* Encoder cannot be flushed: Replace the context with a fresh one */
+  if(!(avctx = clone_context(ctx, ctx->avctx->thread_count)))
+    return 0;
+  
+  avcodec_free_context(&ctx->avctx);
+  ctx->avctx = avctx;
+  return 1;
+  }
+
+int bg_ffmpeg_codec_reset(bg_ffmpeg_codec_context_t * ctx)
+  {
+  if(!(ctx->flags & FLAG_INITIALIZED))
+    return 1;
+  
+  if(!(ctx->flags & FLAG_FLUSHED))
+    bg_ffmpeg_codec_flush(ctx);
+  
+  if(ctx->flags & FLAG_ERROR)
+    return 0;
+
+  /* The parallel contexts never see the end of the stream,
+     native encoders have no context */
+  if(!ctx->par && !ctx->pcm_bytes && !flush_context(ctx))
+    return 0;
+
+  if(ctx->pc)
+    {
+    bg_ffmpeg_pts_cache_destroy(ctx->pc);
+    ctx->pc = bg_ffmpeg_pts_cache_create(ctx->avctx->delay +
+                                         ctx->avctx->max_b_frames + 1);
+    }
+  
+  ctx->in_pts  = GAVL_TIME_UNDEFINED;
+  ctx->out_pts = GAVL_TIME_UNDEFINED;
+  ctx->frames_in = 0;
+  ctx->packets_out = 0;
+  ctx->max_delay = 0;
+  bgen_stats_init(&ctx->perf, ctx->perf.timescale);
+  ctx->trace = bgen_trace_create(LOG_DOMAIN, ctx->codec->name);
+  ctx->flags &= ~FLAG_FLUSHED;
+  return 1;
+  }
+
+/* Format changed: Start over with a fresh context */
+
+static int reinit(bg_ffmpeg_codec_context_t * ctx)
+  {
+  clone_t c;
+  
+  close_codec(ctx);
+  avcodec_free_context(&ctx->avctx);
+
+  if(!(ctx->avctx = avcodec_alloc_context3(ctx->codec)))
+    return 0;
+
+  ctx->avctx->codec_id   = ctx->id;
+  ctx->avctx->codec_type = ctx->type;
+  
+  c.avctx = ctx->avctx;
+  c.options = NULL;
+  bg_cfg_section_apply(&ctx->params, NULL, clone_apply_func, &c);
+  av_dict_free(&c.options);
+
+  /* These are the options, which were there before the first open */
+  av_dict_free(&ctx->options);
+  ctx->options = ctx->open_options;
+  ctx->open_options = NULL;
+  return 1;
+  }
+
+void bg_ffmpeg_codec_destroy(bg_ffmpeg_codec_context_t * ctx)
+  {
+  close_codec(ctx);
+  unregister_threads(ctx);
+  bgen_stats_unregister(&ctx->perf);
+  
+  /* Destroy */
+  if(ctx->avctx)
+    avcodec_free_context(&ctx->avctx);
+
+  gavl_dictionary_free(&ctx->params);
+  av_dict_free(&ctx->options);
+  av_dict_free(&ctx->open_options);
+  gavl_buffer_free(&ctx->pcm_buf);
   
   if(ctx->frame)
     free(ctx->frame);
@@ -864,22 +1832,13 @@ void bg_ffmpeg_codec_destroy(bg_ffmpeg_codec_context_t * ctx)
 
 static void convert_frame_bgra(bg_ffmpeg_codec_context_t * ctx, gavl_video_frame_t * f)
   {
-  int i, j;
-  uint8_t * ptr;
-  uint8_t swp;
-  
-  for(i = 0; i < ctx->vfmt.image_height; i++)
-    {
-    ptr = f->planes[0] + i * f->strides[0];
-    for(j = 0; j < ctx->vfmt.image_width; j++)
-      {
-      /* RGBA -> BGRA */
-      swp = ptr[0];
-      ptr[0] = ptr[2];
-      ptr[2] = swp;
-      ptr += 4;
-      }
-    }
+  /* RGBA -> BGRA */
+  bg_ffmpeg_convert_swap_rb(ctx->slicer, &ctx->vfmt, f);
+  }
+
+static void convert_frame_endian(bg_ffmpeg_codec_context_t * ctx, gavl_video_frame_t * f)
+  {
+  bg_ffmpeg_convert_swap_endian(ctx->slicer, &ctx->vfmt, f);
   }
 
 static void 
@@ -893,5 +1852,9 @@ get_pixelformat_converter(bg_ffmpeg_codec_context_t * ctx,
       ctx->convert_frame = convert_frame_bgra;
       }
     }
-  
+  else if(do_convert & CONVERT_ENDIAN)
+    ctx->convert_frame = convert_frame_endian;
+
+  if(ctx->convert_frame)
+    ctx->slicer = bg_ffmpeg_slicer_create(&ctx->vfmt);
   }
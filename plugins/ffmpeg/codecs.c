@@ -20,6 +20,8 @@
  * *****************************************************************/
 
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include "ffmpeg_common.h"
 #include "params.h"
@@ -28,6 +30,7 @@
 #include <gmerlin/log.h>
 #include <libavutil/channel_layout.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 
 #define LOG_DOMAIN "ffmpeg.codecs"
 
@@ -121,6 +124,7 @@ static const bg_parameter_info_t parameters_libfaac[] =
       .val_default = GAVL_VALUE_INIT_INT(100),
       .help_string = TRS("Quantizer quality"),
     },
+    PARAM_THREAD_COUNT,
     { /* */ }
   };
 
@@ -138,6 +142,7 @@ static const bg_parameter_info_t parameters_libvorbis[] =
       .val_default = GAVL_VALUE_INIT_INT(3),
       .help_string = TRS("Quantizer quality"),
     },
+    PARAM_THREAD_COUNT,
     { /* End */ },
   };
     
@@ -254,7 +259,9 @@ static const bg_parameter_info_t parameters_libvorbis[] =
     PARAM_STRICT_STANDARD_COMPLIANCE,       \
     PARAM_NOISE_REDUCTION, \
     PARAM_FLAG_GRAY, \
-    PARAM_FLAG_BITEXACT
+    PARAM_FLAG_BITEXACT, \
+    PARAM_LATENCY, \
+    PARAM_THREAD_COUNT
 
 static const bg_parameter_info_t parameters_mpeg4[] = {
   ENCODE_PARAM_VIDEO_FRAMETYPES_IPB,
@@ -269,6 +276,7 @@ static const bg_parameter_info_t parameters_mpeg4[] = {
   ENCODE_PARAM_VIDEO_QPEL,
   ENCODE_PARAM_VIDEO_MASKING,
   ENCODE_PARAM_VIDEO_MISC,
+  ENCODE_PARAM_VIDEO_CHUNKS,
   { /* End of parameters */ }
 };
 
@@ -276,6 +284,7 @@ static const bg_parameter_info_t parameters_mjpeg[] = {
   ENCODE_PARAM_VIDEO_RATECONTROL,
   ENCODE_PARAM_VIDEO_QUANTIZER_I,
   ENCODE_PARAM_VIDEO_MISC,
+  PARAM_PARALLEL_CONTEXTS,
   { /* End of parameters */ }
 };
 
@@ -385,6 +394,43 @@ static const bg_parameter_info_t parameters_libx264[] = {
     .val_default = GAVL_VALUE_INIT_INT(-1),
     .help_string = TRS("Negative means disable, 0 means lossless"),
   },
+  {
+    .name =      "libx264_maxrate",
+    .long_name = TRS("Maximum bit rate (kbps)"),
+    .type =      BG_PARAMETER_INT,
+    .val_min     = GAVL_VALUE_INIT_INT(0),
+    .val_max     = GAVL_VALUE_INIT_INT(100000),
+    .val_default = GAVL_VALUE_INIT_INT(0),
+    .help_string = TRS("Maximum bit rate for the VBV. 0 means unlimited. Requires the VBV buffer size."),
+  },
+  {
+    .name =      "libx264_bufsize",
+    .long_name = TRS("VBV buffer size (kbits)"),
+    .type =      BG_PARAMETER_INT,
+    .val_min     = GAVL_VALUE_INIT_INT(0),
+    .val_max     = GAVL_VALUE_INIT_INT(100000),
+    .val_default = GAVL_VALUE_INIT_INT(0),
+    .help_string = TRS("Decoder buffer size. For the lowest latency, make it about one frame (maximum bit rate divided by the frame rate)."),
+  },
+  {
+    .name =      "libx264_rc-lookahead",
+    .long_name = TRS("Rate control lookahead"),
+    .type =      BG_PARAMETER_SLIDER_INT,
+    .val_min     = GAVL_VALUE_INIT_INT(-1),
+    .val_max     = GAVL_VALUE_INIT_INT(250),
+    .val_default = GAVL_VALUE_INIT_INT(-1),
+    .help_string = TRS("Frames to look ahead for rate control and frame type decision. Each frame adds one frame of latency. -1 means the default of the preset."),
+  },
+  {
+    .name =      "libx264_intra-refresh",
+    .long_name = TRS("Periodic intra refresh"),
+    .type =      BG_PARAMETER_CHECKBUTTON,
+    .val_default = GAVL_VALUE_INIT_INT(0),
+    .help_string = TRS("Instead of keyframes, refresh the picture with a column of intra blocks moving across it. This avoids the bit rate peaks of keyframes, so a small VBV buffer is possible."),
+  },
+  PARAM_LATENCY,
+  PARAM_THREAD_COUNT,
+  ENCODE_PARAM_VIDEO_CHUNKS,
   { /* End */ },
 };
 
@@ -463,6 +509,7 @@ static const bg_parameter_info_t parameters_libvpx[] = {
     .val_max = GAVL_VALUE_INIT_INT(1000), // Bogus
     .val_default = GAVL_VALUE_INIT_INT(0),
   },
+  PARAM_LATENCY,
   PARAM_THREAD_COUNT,
   {
     .name = "frametypes",
@@ -527,6 +574,167 @@ static const bg_parameter_info_t parameters_libvpx[] = {
                                      TRS("Centered"),
                                      (char *)0},
   },
+  ENCODE_PARAM_VIDEO_CHUNKS,
+  { /* End */ },
+};
+
+static const bg_parameter_info_t parameters_libvpx_vp9[] = {
+  {
+    .name = "rc",
+    .long_name = TRS("Rate control"),
+    .type = BG_PARAMETER_SECTION,
+  },
+  {
+    .name =      "ff_bit_rate_video",
+    .long_name = TRS("Bit rate (kbps)"),
+    .type =      BG_PARAMETER_INT,
+    .val_min     = GAVL_VALUE_INIT_INT(0),
+    .val_max     = GAVL_VALUE_INIT_INT(100000),
+    .val_default = GAVL_VALUE_INIT_INT(0),
+    .help_string = TRS("0 means constant quality"),
+  },
+  PARAM_RC_MIN_RATE,
+  PARAM_RC_MAX_RATE,
+  PARAM_RC_BUFFER_SIZE,
+  {
+    .name =      "libvpx_crf",
+    .long_name = TRS("Constant quality"),
+    .type =      BG_PARAMETER_SLIDER_INT,
+    .val_default = GAVL_VALUE_INIT_INT(31),
+    .val_min =     GAVL_VALUE_INIT_INT(0),
+    .val_max =     GAVL_VALUE_INIT_INT(63),
+    .help_string = TRS("Lower values mean better quality. With a bit rate, this is the quality limit (constrained quality).")
+  },
+  {
+    .name = "speed",
+    .long_name = TRS("Speed"),
+    .type = BG_PARAMETER_SECTION,
+  },
+  {
+    .name =      "libvpx_deadline",
+    .long_name = TRS("Speed"),
+    .type =      BG_PARAMETER_STRINGLIST,
+    .val_default = GAVL_VALUE_INIT_STRING("good"),
+    .multi_names = (char const *[]){"best",
+                                    "good",
+                                    "realtime",
+                                    (char *)0},
+    .multi_labels = (char const *[]){TRS("Best quality"),
+                                     TRS("Good quality"),
+                                     TRS("Realtime"),
+                                     (char *)0},
+  },
+  {
+    .name = "libvpx_cpu-used",
+    .long_name = TRS("CPU usage modifier"),
+    .type = BG_PARAMETER_SLIDER_INT,
+    .val_min = GAVL_VALUE_INIT_INT(0),
+    .val_max = GAVL_VALUE_INIT_INT(8),
+    .val_default = GAVL_VALUE_INIT_INT(2),
+    .help_string = TRS("Higher values are faster with lower quality. Values above 4 are for realtime only."),
+  },
+  {
+    .name = "threads",
+    .long_name = TRS("Threads"),
+    .type = BG_PARAMETER_SECTION,
+  },
+  PARAM_LATENCY,
+  PARAM_THREAD_COUNT,
+  {
+    .name = "libvpx_row-mt",
+    .long_name = TRS("Row based multithreading"),
+    .type = BG_PARAMETER_CHECKBUTTON,
+    .val_default = GAVL_VALUE_INIT_INT(1),
+    .help_string = TRS("Let the threads work on rows of the same tile. Without this, the number of threads is limited by the tile columns."),
+  },
+  {
+    .name = "libvpx_tile-columns",
+    .long_name = TRS("Tile columns (log2)"),
+    .type = BG_PARAMETER_SLIDER_INT,
+    .val_min = GAVL_VALUE_INIT_INT(-1),
+    .val_max = GAVL_VALUE_INIT_INT(6),
+    .val_default = GAVL_VALUE_INIT_INT(-1),
+    .help_string = TRS("Split the picture into 2^n tile columns, which can be encoded and decoded in parallel. The number is limited by the picture width. -1 means the default of libvpx."),
+  },
+  {
+    .name = "libvpx_frame-parallel",
+    .long_name = TRS("Frame parallel decoding"),
+    .type = BG_PARAMETER_CHECKBUTTON,
+    .val_default = GAVL_VALUE_INIT_INT(0),
+    .help_string = TRS("Disable backward adaptation of the probabilities, so decoders can decode frames in parallel. Costs some compression."),
+  },
+  {
+    .name = "frametypes",
+    .long_name = TRS("Frame types"),
+    .type = BG_PARAMETER_SECTION,
+  },
+  {
+    .name = "ff_gop_size",
+    .long_name = TRS("Maximum GOP size"),
+    .type = BG_PARAMETER_INT,
+    .val_min = GAVL_VALUE_INIT_INT(-1),
+    .val_max = GAVL_VALUE_INIT_INT(1000), // Bogus
+    .val_default = GAVL_VALUE_INIT_INT(-1),
+    .help_string = TRS("Maximum keyframe distance, -1 means automatic"),
+  },
+  {
+    .name = "libvpx_auto-alt-ref",
+    .long_name = TRS("Enable alternate reference frames"),
+    .type = BG_PARAMETER_CHECKBUTTON,
+    .val_default = GAVL_VALUE_INIT_INT(1),
+  },
+  {
+    .name = "libvpx_lag-in-frames",
+    .long_name = TRS("Lookahead"),
+    .help_string = TRS("Number of frames to look ahead for alternate reference frame selection"),
+    .type = BG_PARAMETER_INT,
+    .val_min = GAVL_VALUE_INIT_INT(0),
+    .val_max = GAVL_VALUE_INIT_INT(25),
+    .val_default = GAVL_VALUE_INIT_INT(25),
+  },
+  ENCODE_PARAM_VIDEO_CHUNKS,
+  { /* End */ },
+};
+
+static const bg_parameter_info_t parameters_libsvtav1[] = {
+  {
+    .name =      "libsvtav1_preset",
+    .long_name = TRS("Preset"),
+    .type =      BG_PARAMETER_SLIDER_INT,
+    .val_min     = GAVL_VALUE_INIT_INT(0),
+    .val_max     = GAVL_VALUE_INIT_INT(13),
+    .val_default = GAVL_VALUE_INIT_INT(8),
+    .help_string = TRS("Speed/quality tradeoff. 0 is the slowest with the best quality, 13 the fastest. Presets below 4 are very slow."),
+  },
+  {
+    .name =      "ff_bit_rate_video",
+    .long_name = TRS("Bit rate (kbps)"),
+    .type =      BG_PARAMETER_INT,
+    .val_min     = GAVL_VALUE_INIT_INT(0),
+    .val_max     = GAVL_VALUE_INIT_INT(100000),
+    .val_default = GAVL_VALUE_INIT_INT(0),
+    .help_string = TRS("If > 0 encode with average bitrate, otherwise with constant quality"),
+  },
+  {
+    .name =      "libsvtav1_crf",
+    .long_name = TRS("Constant quality"),
+    .type =      BG_PARAMETER_SLIDER_INT,
+    .val_min     = GAVL_VALUE_INIT_INT(1),
+    .val_max     = GAVL_VALUE_INIT_INT(63),
+    .val_default = GAVL_VALUE_INIT_INT(35),
+    .help_string = TRS("Lower values mean better quality"),
+  },
+  {
+    .name = "ff_gop_size",
+    .long_name = TRS("Maximum GOP size"),
+    .type = BG_PARAMETER_INT,
+    .val_min = GAVL_VALUE_INIT_INT(-1),
+    .val_max = GAVL_VALUE_INIT_INT(1000), // Bogus
+    .val_default = GAVL_VALUE_INIT_INT(-1),
+    .help_string = TRS("Maximum keyframe distance, -1 means automatic"),
+  },
+  PARAM_LATENCY,
+  PARAM_THREAD_COUNT,
   { /* End */ },
 };
 
@@ -536,33 +744,152 @@ static const bg_parameter_info_t parameters_tga[] = {
     .long_name = TRS("Use RLE compression"),
     .type =      BG_PARAMETER_CHECKBUTTON,
   },
+  PARAM_LATENCY,
+  PARAM_THREAD_COUNT,
+  PARAM_PARALLEL_CONTEXTS,
   { /* */ }
 };
 
+#define PARAM_SLICES \
+  {                                                 \
+    .name =      "ff_slices",                        \
+    .long_name = TRS("Slices"),                     \
+    .type =      BG_PARAMETER_INT,                   \
+    .val_min     = GAVL_VALUE_INIT_INT(0),           \
+    .val_max     = GAVL_VALUE_INIT_INT(256),         \
+    .val_default = GAVL_VALUE_INIT_INT(0),           \
+    .help_string = TRS("Number of slices, which are encoded by separate threads. 0 means automatic."), \
+  }
+
+static const bg_parameter_info_t parameters_ffv1[] = {
+  {
+    .name =      "ffv1_version",
+    .long_name = TRS("Version"),
+    .type =      BG_PARAMETER_STRINGLIST,
+    .val_default = GAVL_VALUE_INIT_STRING("3"),
+    .multi_names = (char const *[]){"1",
+                                    "3",
+                                    (char *)0},
+    .multi_labels = (char const *[]){TRS("1"),
+                                     TRS("3 (slices and CRCs)"),
+                                     (char *)0},
+  },
+  PARAM_SLICES,
+  {
+    .name =      "ffv1_slicecrc",
+    .long_name = TRS("Slice CRCs"),
+    .type =      BG_PARAMETER_CHECKBUTTON,
+    .val_default = GAVL_VALUE_INIT_INT(1),
+    .help_string = TRS("Protect each slice with a CRC, so errors can be detected and concealed (version 3 only)"),
+  },
+  {
+    .name =      "ffv1_coder",
+    .long_name = TRS("Coder"),
+    .type =      BG_PARAMETER_STRINGLIST,
+    .val_default = GAVL_VALUE_INIT_STRING("range_def"),
+    .multi_names = (char const *[]){"rice",
+                                    "range_def",
+                                    "range_tab",
+                                    (char *)0},
+    .multi_labels = (char const *[]){TRS("Golomb-Rice (fastest)"),
+                                     TRS("Range coder"),
+                                     TRS("Range coder with custom table"),
+                                     (char *)0},
+  },
+  {
+    .name =      "ffv1_context",
+    .long_name = TRS("Large context model"),
+    .type =      BG_PARAMETER_CHECKBUTTON,
+    .val_default = GAVL_VALUE_INIT_INT(0),
+    .help_string = TRS("Slightly better compression, but slower"),
+  },
+  PARAM_LATENCY,
+  PARAM_THREAD_COUNT,
+  PARAM_PARALLEL_CONTEXTS,
+  { /* End of parameters */ }
+};
+
+static const bg_parameter_info_t parameters_utvideo[] = {
+  {
+    .name =      "utvideo_pred",
+    .long_name = TRS("Prediction"),
+    .type =      BG_PARAMETER_STRINGLIST,
+    .val_default = GAVL_VALUE_INIT_STRING("left"),
+    .multi_names = (char const *[]){"none",
+                                    "left",
+                                    "gradient",
+                                    "median",
+                                    (char *)0},
+    .multi_labels = (char const *[]){TRS("None"),
+                                     TRS("Left"),
+                                     TRS("Gradient"),
+                                     TRS("Median"),
+                                     (char *)0},
+  },
+  PARAM_SLICES,
+  PARAM_LATENCY,
+  PARAM_THREAD_COUNT,
+  PARAM_PARALLEL_CONTEXTS,
+  { /* End of parameters */ }
+};
+
+static const bg_parameter_info_t parameters_huffyuv[] = {
+  {
+    .name =      "huffyuv_pred",
+    .long_name = TRS("Prediction"),
+    .type =      BG_PARAMETER_STRINGLIST,
+    .val_default = GAVL_VALUE_INIT_STRING("left"),
+    .multi_names = (char const *[]){"left",
+                                    "plane",
+                                    "median",
+                                    (char *)0},
+    .multi_labels = (char const *[]){TRS("Left"),
+                                     TRS("Plane"),
+                                     TRS("Median"),
+                                     (char *)0},
+  },
+  PARAM_LATENCY,
+  PARAM_THREAD_COUNT,
+  PARAM_PARALLEL_CONTEXTS,
+  { /* End of parameters */ }
+};
+
 /* Audio */
 
+static const bg_parameter_info_t parameters_pcm[] = {
+  PARAM_THREAD_COUNT,
+  { /* End of parameters */ }
+};
+
 static const bg_parameter_info_t parameters_ac3[] = {
   ENCODE_PARAM_AC3
+  PARAM_THREAD_COUNT,
+  ENCODE_PARAM_AUDIO_CHUNKS,
   { /* End of parameters */ }
 };
 
 static const bg_parameter_info_t parameters_dca[] = {
   ENCODE_PARAM_DTS
+  PARAM_THREAD_COUNT,
   { /* End of parameters */ }
 };
 
 static const bg_parameter_info_t parameters_mp2[] = {
   ENCODE_PARAM_MP2
+  PARAM_THREAD_COUNT,
+  ENCODE_PARAM_AUDIO_CHUNKS,
   { /* End of parameters */ }
 };
 
 static const bg_parameter_info_t parameters_mp3[] = {
   ENCODE_PARAM_MP3
+  PARAM_THREAD_COUNT,
   { /* End of parameters */ }
 };
 
 static const bg_parameter_info_t parameters_wma[] = {
   ENCODE_PARAM_WMA
+  PARAM_THREAD_COUNT,
   { /* End of parameters */ }
 };
 
@@ -572,31 +899,37 @@ static const ffmpeg_codec_info_t audio_codecs[] =
       .name      = "pcm_s16be",
       .long_name = TRS("16 bit PCM"),
       .id        = AV_CODEC_ID_PCM_S16BE,
+      .parameters = parameters_pcm,
     },
     {
       .name      = "pcm_s16le",
       .long_name = TRS("16 bit PCM"),
       .id        = AV_CODEC_ID_PCM_S16LE,
+      .parameters = parameters_pcm,
     },
     {
       .name      = "pcm_s8",
       .long_name = TRS("8 bit PCM"),
       .id        = AV_CODEC_ID_PCM_S8,
+      .parameters = parameters_pcm,
     },
     {
       .name      = "pcm_u8",
       .long_name = TRS("8 bit PCM"),
       .id        = AV_CODEC_ID_PCM_U8,
+      .parameters = parameters_pcm,
     },
     {
       .name      = "pcm_alaw",
       .long_name = TRS("alaw"),
       .id        = AV_CODEC_ID_PCM_ALAW,
+      .parameters = parameters_pcm,
     },
     {
       .name      = "pcm_mulaw",
       .long_name = TRS("mulaw"),
       .id        = AV_CODEC_ID_PCM_MULAW,
+      .parameters = parameters_pcm,
     },
     {
       .name      = "ac3",
@@ -719,6 +1052,27 @@ static const ffmpeg_codec_info_t video_codecs[] =
       .parameters = parameters_tga,
       .flags      = FLAG_INTRA_ONLY,
     },
+    {
+      .name       = "ffv1",
+      .long_name  = TRS("FFV1 (lossless)"),
+      .id         = AV_CODEC_ID_FFV1,
+      .parameters = parameters_ffv1,
+      .flags      = FLAG_INTRA_ONLY,
+    },
+    {
+      .name       = "utvideo",
+      .long_name  = TRS("UT Video (lossless)"),
+      .id         = AV_CODEC_ID_UTVIDEO,
+      .parameters = parameters_utvideo,
+      .flags      = FLAG_INTRA_ONLY,
+    },
+    {
+      .name       = "huffyuv",
+      .long_name  = TRS("HuffYUV (lossless)"),
+      .id         = AV_CODEC_ID_HUFFYUV,
+      .parameters = parameters_huffyuv,
+      .flags      = FLAG_INTRA_ONLY,
+    },
     {
       .name       = "libvpx",
       .long_name  = TRS("VP8"),
@@ -726,6 +1080,20 @@ static const ffmpeg_codec_info_t video_codecs[] =
       .parameters = parameters_libvpx,
       .flags      = 0,
     },
+    {
+      .name       = "libvpx-vp9",
+      .long_name  = TRS("VP9"),
+      .id         = AV_CODEC_ID_VP9,
+      .parameters = parameters_libvpx_vp9,
+      .flags      = 0,
+    },
+    {
+      .name       = "libsvtav1",
+      .long_name  = TRS("AV1"),
+      .id         = AV_CODEC_ID_AV1,
+      .parameters = parameters_libsvtav1,
+      .flags      = 0,
+    },
 #if 0
     {
       .name       = "wmv2",
@@ -1046,71 +1414,48 @@ typedef struct
   int i;
   } enum_t;
 
-#define PARAM_INT(n, var) \
-  if(!strcmp(n, name)) \
-    { \
-    ctx->var = val->v.i;                         \
-    }
-
-#define PARAM_INT_SCALE(n, var, scale)   \
-  if(!strcmp(n, name)) \
-    { \
-    ctx->var = val->v.i * scale;                 \
-    }
-
-#define PARAM_STR_INT_SCALE(n, var, scale) \
-  if(!strcmp(n, name)) \
-    { \
-    ctx->var = atoi(val->v.str) * scale; \
-    }
+/*
+ *  Parameter dispatch: All codec parameters are described in one table,
+ *  which is sorted by name (in strcmp() order) for binary search.
+ */
 
+#define PT_INT              0 // Integer field
+#define PT_INT_SCALE        1 // Integer field, value multiplied by scale
+#define PT_STR_INT_SCALE    2 // Integer field from a string, multiplied by scale
+#define PT_FLOAT            3 // Float field
+#define PT_QP2LAMBDA        4 // Integer field, value is a quantizer
+#define PT_QP2LAMBDA_FLOAT  5 // Float field, value is a quantizer
+#define PT_QUALITY          6 // Integer field, integer quantizer
+#define PT_ENUM             7 // Integer field, string value from enums
+#define PT_CMP_CHROMA       8 // FF_CMP_CHROMA in a compare function
+#define PT_FLAG             9 // Flag in flags
+#define PT_FLAG2           10 // Flag in flags2
+#define PT_DICT_STRING     11 // AVOption
+#define PT_DICT_INT        12 // AVOption
+#define PT_DICT_FLOAT      13 // AVOption
+#define PT_PRIV_BOOL       14 // Private option of the codec, set directly
 
-#define PARAM_QP2LAMBDA(n, var)   \
-  if(!strcmp(n, name)) \
-    { \
-    ctx->var = (int)(val->v.d * FF_QP2LAMBDA+0.5);  \
-    }
-#define PARAM_FLOAT(n, var)   \
-  if(!strcmp(n, name)) \
-    { \
-    ctx->var = val->v.d;                 \
-    }
+typedef struct
+  {
+  const char * name;
+  int type;
 
-#define PARAM_CMP_CHROMA(n,var)              \
-  {                                             \
-  if(!strcmp(n, name))                    \
-    {                                           \
-    if(val->v.i)                            \
-      ctx->var |= FF_CMP_CHROMA;                \
-    else                                        \
-      ctx->var &= ~FF_CMP_CHROMA;               \
-                                                \
-    }                                           \
-  }
+  /* Field in the AVCodecContext */
+  size_t offset;
+  int size;
+  
+  int scale;
+  int flag;
+  const char * key; // AVOption
+  
+  const enum_t * enums;
+  int num_enums;
+  } param_desc_t;
 
-#define PARAM_FLAG(n,flag)                  \
-  {                                             \
-  if(!strcmp(n, name))                    \
-    {                                           \
-    if(val->v.i)                            \
-      ctx->flags |= flag;                \
-    else                                        \
-      ctx->flags &= ~flag;               \
-                                                \
-    }                                           \
-  }
+#define FIELD(f) .offset = offsetof(AVCodecContext, f), \
+                 .size = sizeof(((AVCodecContext*)0)->f)
 
-#define PARAM_FLAG2(n,flag)                  \
-  {                                             \
-  if(!strcmp(n, name))                    \
-    {                                           \
-    if(val->v.i)                            \
-      ctx->flags2 |= flag;                \
-    else                                        \
-      ctx->flags2 &= ~flag;               \
-                                                \
-    }                                           \
-  }
+#define ENUMS(arr) .enums = arr, .num_enums = sizeof(arr)/sizeof(arr[0])
 
 static const enum_t compare_func[] =
   {
@@ -1142,45 +1487,165 @@ static const enum_t faac_profile[] =
     { "ltp",  FF_PROFILE_AAC_LTP  }
   };
 
-#define PARAM_ENUM(n, var, arr) \
-  if(!strcmp(n, name)) \
-    { \
-    for(i = 0; i < sizeof(arr)/sizeof(arr[0]); i++) \
-      {                                             \
-      if(!strcmp(val->v.str, arr[i].s))       \
-        {                                           \
-        ctx->var = arr[i].i;                        \
-        break;                                      \
-        }                                           \
-      }                                             \
-    }
+static const param_desc_t param_descs[] =
+  {
+    { "faac_profile",                   PT_ENUM, FIELD(profile), ENUMS(faac_profile) },
+    { "faac_quality",                   PT_QUALITY, FIELD(global_quality) },
+    { "ff_b_quant_factor",              PT_FLOAT, FIELD(b_quant_factor) },
+    { "ff_b_quant_offset",              PT_QP2LAMBDA_FLOAT, FIELD(b_quant_offset) },
+    { "ff_bidir_refine",                PT_INT, FIELD(bidir_refine) },
+    { "ff_bit_rate_audio",              PT_INT_SCALE, FIELD(bit_rate), .scale = 1000 },
+    { "ff_bit_rate_str",                PT_STR_INT_SCALE, FIELD(bit_rate), .scale = 1000 },
+    { "ff_bit_rate_tolerance",          PT_INT_SCALE, FIELD(bit_rate_tolerance), .scale = 1000 },
+    { "ff_bit_rate_video",              PT_INT_SCALE, FIELD(bit_rate), .scale = 1000 },
+    { "ff_dark_masking",                PT_FLOAT, FIELD(dark_masking) },
+    { "ff_dia_size",                    PT_INT, FIELD(dia_size) },
+    { "ff_flag2_fast",                  PT_FLAG2, .flag = AV_CODEC_FLAG2_FAST },
+    { "ff_flag_4mv",                    PT_FLAG, .flag = AV_CODEC_FLAG_4MV },
+    { "ff_flag_ac_pred",                PT_FLAG, .flag = AV_CODEC_FLAG_AC_PRED },
+    { "ff_flag_bitexact",               PT_FLAG, .flag = AV_CODEC_FLAG_BITEXACT },
+    { "ff_flag_closed_gop",             PT_FLAG, .flag = AV_CODEC_FLAG_CLOSED_GOP },
+    { "ff_flag_gray",                   PT_FLAG, .flag = AV_CODEC_FLAG_GRAY },
+    { "ff_flag_loop_filter",            PT_FLAG, .flag = AV_CODEC_FLAG_LOOP_FILTER },
+    { "ff_flag_qpel",                   PT_FLAG, .flag = AV_CODEC_FLAG_QPEL },
+    { "ff_flag_qscale",                 PT_FLAG, .flag = AV_CODEC_FLAG_QSCALE },
+    { "ff_gop_size",                    PT_INT, FIELD(gop_size) },
+    { "ff_i_quant_factor",              PT_FLOAT, FIELD(i_quant_factor) },
+    { "ff_i_quant_offset",              PT_QP2LAMBDA_FLOAT, FIELD(i_quant_offset) },
+    { "ff_ildct_cmp",                   PT_ENUM, FIELD(ildct_cmp), ENUMS(compare_func) },
+    { "ff_ildct_cmp_chroma",            PT_CMP_CHROMA, FIELD(ildct_cmp) },
+    { "ff_keyint_min",                  PT_INT, FIELD(keyint_min) },
+    { "ff_last_predictor_count",        PT_INT, FIELD(last_predictor_count) },
+    { "ff_lumi_masking",                PT_FLOAT, FIELD(lumi_masking) },
+    { "ff_max_b_frames",                PT_INT, FIELD(max_b_frames) },
+    { "ff_max_qdiff",                   PT_INT, FIELD(max_qdiff) },
+    { "ff_mb_cmp",                      PT_ENUM, FIELD(mb_cmp), ENUMS(compare_func) },
+    { "ff_mb_cmp_chroma",               PT_CMP_CHROMA, FIELD(mb_cmp) },
+    { "ff_mb_decision",                 PT_ENUM, FIELD(mb_decision), ENUMS(mb_decision) },
+    { "ff_mb_lmax",                     PT_QP2LAMBDA, FIELD(mb_lmax) },
+    { "ff_mb_lmin",                     PT_QP2LAMBDA, FIELD(mb_lmin) },
+    { "ff_me_cmp",                      PT_ENUM, FIELD(me_cmp), ENUMS(compare_func) },
+    { "ff_me_cmp_chroma",               PT_CMP_CHROMA, FIELD(me_cmp) },
+    { "ff_me_pre_cmp",                  PT_ENUM, FIELD(me_pre_cmp), ENUMS(compare_func) },
+    { "ff_me_range",                    PT_INT, FIELD(me_range) },
+    { "ff_me_sub_cmp",                  PT_ENUM, FIELD(me_sub_cmp), ENUMS(compare_func) },
+    { "ff_me_sub_cmp_chroma",           PT_CMP_CHROMA, FIELD(me_sub_cmp) },
+    { "ff_me_subpel_quality",           PT_INT, FIELD(me_subpel_quality) },
+    { "ff_nsse_weight",                 PT_INT, FIELD(nsse_weight) },
+    { "ff_p_masking",                   PT_FLOAT, FIELD(p_masking) },
+    { "ff_pre_dia_size",                PT_INT, FIELD(pre_dia_size) },
+    { "ff_pre_me_cmp_chroma",           PT_CMP_CHROMA, FIELD(me_pre_cmp) },
+    { "ff_qblur",                       PT_FLOAT, FIELD(qblur) },
+    { "ff_qcompress",                   PT_FLOAT, FIELD(qcompress) },
+    { "ff_qmax",                        PT_INT, FIELD(qmax) },
+    { "ff_qmin",                        PT_INT, FIELD(qmin) },
+    { "ff_rc_buffer_size",              PT_INT_SCALE, FIELD(rc_buffer_size), .scale = 1000 },
+    { "ff_rc_initial_buffer_occupancy", PT_INT_SCALE, FIELD(rc_initial_buffer_occupancy), .scale = 1000 },
+    { "ff_rc_max_rate",                 PT_INT, FIELD(rc_max_rate) },
+    { "ff_rc_min_rate",                 PT_INT, FIELD(rc_min_rate) },
+    { "ff_slices",                      PT_INT, FIELD(slices) },
+    { "ff_spatial_cplx_masking",        PT_FLOAT, FIELD(spatial_cplx_masking) },
+    { "ff_strict_std_compliance",       PT_INT, FIELD(strict_std_compliance) },
+    { "ff_temporal_cplx_masking",       PT_FLOAT, FIELD(temporal_cplx_masking) },
+    { "ff_thread_count",                PT_INT, FIELD(thread_count) },
+    { "ff_trellis",                     PT_INT, FIELD(trellis) },
+    { "ffv1_coder",                     PT_DICT_STRING, .key = "coder" },
+    { "ffv1_context",                   PT_DICT_INT, .key = "context" },
+    { "ffv1_slicecrc",                  PT_DICT_INT, .key = "slicecrc" },
+    { "ffv1_version",                   PT_STR_INT_SCALE, FIELD(level), .scale = 1 },
+    { "huffyuv_pred",                   PT_DICT_STRING, .key = "pred" },
+    { "libsvtav1_crf",                  PT_DICT_INT, .key = "crf" },
+    { "libsvtav1_preset",               PT_DICT_INT, .key = "preset" },
+    { "libvpx_arnr-max-frames",         PT_DICT_INT, .key = "arnr-max-frames" },
+    { "libvpx_arnr-type",               PT_DICT_STRING, .key = "arnr-type" },
+    { "libvpx_auto-alt-ref",            PT_DICT_INT, .key = "alt-ref" },
+    { "libvpx_cpu-used",                PT_DICT_INT, .key = "cpu-used" },
+    { "libvpx_crf",                     PT_DICT_INT, .key = "crf" },
+    { "libvpx_deadline",                PT_DICT_STRING, .key = "deadline" },
+    { "libvpx_frame-parallel",          PT_DICT_INT, .key = "frame-parallel" },
+    { "libvpx_lag-in-frames",           PT_DICT_INT, .key = "lag-in-frames" },
+    { "libvpx_row-mt",                  PT_DICT_INT, .key = "row-mt" },
+    { "libvpx_tile-columns",            PT_DICT_INT, .key = "tile-columns" },
+    { "libx264_bufsize",                PT_INT_SCALE, FIELD(rc_buffer_size), .scale = 1000 },
+    { "libx264_crf",                    PT_DICT_FLOAT, .key = "crf" },
+    { "libx264_intra-refresh",          PT_DICT_INT, .key = "intra-refresh" },
+    { "libx264_maxrate",                PT_INT_SCALE, FIELD(rc_max_rate), .scale = 1000 },
+    { "libx264_preset",                 PT_DICT_STRING, .key = "preset" },
+    { "libx264_qp",                     PT_DICT_FLOAT, .key = "qp" },
+    { "libx264_rc-lookahead",           PT_DICT_INT, .key = "rc-lookahead" },
+    { "libx264_tune",                   PT_DICT_STRING, .key = "tune" },
+    { "tga_rle",                        PT_PRIV_BOOL, .key = "rle" },
+    { "utvideo_pred",                   PT_DICT_STRING, .key = "pred" },
+    { "vorbis_quality",                 PT_QUALITY, FIELD(global_quality) },
+  };
 
-#define PARAM_DICT_STRING(n, ffmpeg_key) \
-  if(!strcmp(n, name)) \
-    { \
-    if(val->v.str && (val->v.str[0] != '$')) \
-      av_dict_set(options,                      \
-                  ffmpeg_key, val->v.str, 0); \
-    }
+#define NUM_PARAM_DESCS ((int)(sizeof(param_descs)/sizeof(param_descs[0])))
+
+static int compare_param_desc(const void * key, const void * desc)
+  {
+  return strcmp(key, ((const param_desc_t *)desc)->name);
+  }
+
+/* param_descs[] is sorted by hand. If someone got it wrong, we fall
+   back to a linear search instead of silently missing parameters */
+
+static pthread_once_t param_descs_once = PTHREAD_ONCE_INIT;
+static int param_descs_sorted = 0;
 
-#define PARAM_DICT_FLOAT(n, ffmpeg_key) \
-  if(!strcmp(n, name)) \
-    { \
-    char * str; \
-    str = bg_sprintf("%f", val->v.d); \
-    av_dict_set(options, ffmpeg_key, str, 0); \
-    free(str); \
+static void check_param_descs(void)
+  {
+  int i;
+  
+  for(i = 1; i < NUM_PARAM_DESCS; i++)
+    {
+    if(strcmp(param_descs[i-1].name, param_descs[i].name) >= 0)
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+               "Parameter table is not sorted: %s comes before %s",
+               param_descs[i-1].name, param_descs[i].name);
+      return;
+      }
     }
+  param_descs_sorted = 1;
+  }
 
-#define PARAM_DICT_INT(n, ffmpeg_key) \
-  if(!strcmp(n, name)) \
-    { \
-    char * str; \
-    str = bg_sprintf("%d", val->v.i); \
-    av_dict_set(options, ffmpeg_key, str, 0); \
-    free(str); \
+static const param_desc_t * find_param_desc(const char * name)
+  {
+  int i;
+  
+  pthread_once(&param_descs_once, check_param_descs);
+
+  if(param_descs_sorted)
+    return bsearch(name, param_descs, NUM_PARAM_DESCS,
+                   sizeof(param_descs[0]), compare_param_desc);
+
+  for(i = 0; i < NUM_PARAM_DESCS; i++)
+    {
+    if(!strcmp(name, param_descs[i].name))
+      return &param_descs[i];
     }
+  return NULL;
+  }
+
+/* bit_rate and the rate control limits are int64_t */
 
+static void set_int_field(AVCodecContext * ctx, const param_desc_t * d, int64_t v)
+  {
+  void * ptr = (uint8_t*)ctx + d->offset;
+  
+  if(d->size == sizeof(int64_t))
+    *((int64_t*)ptr) = v;
+  else
+    *((int*)ptr) = v;
+  }
+
+static void set_flag(int * flags, int flag, int set)
+  {
+  if(set)
+    *flags |= flag;
+  else
+    *flags &= ~flag;
+  }
 
 void
 bg_ffmpeg_set_codec_parameter(AVCodecContext * ctx,
@@ -1189,105 +1654,75 @@ bg_ffmpeg_set_codec_parameter(AVCodecContext * ctx,
                               const gavl_value_t * val)
   {
   int i;
-/*
- *   IMPORTANT: To keep the mess at a reasonable level,
- *   *all* parameters *must* appear in the same order as in
- *   the AVCocecContext structure, except the flags, which come at the very end
- */
+  char * str;
+  const param_desc_t * d;
   
-  PARAM_INT_SCALE("ff_bit_rate_video",bit_rate,1000);
-  PARAM_INT_SCALE("ff_bit_rate_audio",bit_rate,1000);
-  
-  PARAM_STR_INT_SCALE("ff_bit_rate_str", bit_rate, 1000);
-
-  PARAM_INT_SCALE("ff_bit_rate_tolerance",bit_rate_tolerance,1000);
-  PARAM_INT("ff_gop_size",gop_size);
-  PARAM_FLOAT("ff_qcompress",qcompress);
-  PARAM_FLOAT("ff_qblur",qblur);
-  PARAM_INT("ff_qmin",qmin);
-  PARAM_INT("ff_qmax",qmax);
-  PARAM_INT("ff_max_qdiff",max_qdiff);
-  PARAM_INT("ff_max_b_frames",max_b_frames);
-  PARAM_FLOAT("ff_b_quant_factor",b_quant_factor);
-  PARAM_INT("ff_strict_std_compliance",strict_std_compliance);
-  PARAM_QP2LAMBDA("ff_b_quant_offset",b_quant_offset);
-  PARAM_INT("ff_rc_min_rate",rc_min_rate);
-  PARAM_INT("ff_rc_max_rate",rc_max_rate);
-  PARAM_INT_SCALE("ff_rc_buffer_size",rc_buffer_size,1000);
-  PARAM_FLOAT("ff_i_quant_factor",i_quant_factor);
-  PARAM_QP2LAMBDA("ff_i_quant_offset",i_quant_offset);
-  PARAM_FLOAT("ff_lumi_masking",lumi_masking);
-  PARAM_FLOAT("ff_temporal_cplx_masking",temporal_cplx_masking);
-  PARAM_FLOAT("ff_spatial_cplx_masking",spatial_cplx_masking);
-  PARAM_FLOAT("ff_p_masking",p_masking);
-  PARAM_FLOAT("ff_dark_masking",dark_masking);
-  PARAM_ENUM("ff_me_cmp",me_cmp,compare_func);
-  PARAM_CMP_CHROMA("ff_me_cmp_chroma",me_cmp);
-  PARAM_ENUM("ff_me_sub_cmp",me_sub_cmp,compare_func);
-  PARAM_CMP_CHROMA("ff_me_sub_cmp_chroma",me_sub_cmp);
-  PARAM_ENUM("ff_mb_cmp",mb_cmp,compare_func);
-  PARAM_CMP_CHROMA("ff_mb_cmp_chroma",mb_cmp);
-  PARAM_ENUM("ff_ildct_cmp",ildct_cmp,compare_func);
-  PARAM_CMP_CHROMA("ff_ildct_cmp_chroma",ildct_cmp);
-  PARAM_INT("ff_dia_size",dia_size);
-  PARAM_INT("ff_last_predictor_count",last_predictor_count);
-  PARAM_ENUM("ff_me_pre_cmp",me_pre_cmp,compare_func);
-  PARAM_CMP_CHROMA("ff_pre_me_cmp_chroma",me_pre_cmp);
-  PARAM_INT("ff_pre_dia_size",pre_dia_size);
-  PARAM_INT("ff_me_subpel_quality",me_subpel_quality);
-  PARAM_INT("ff_me_range",me_range);
-  PARAM_ENUM("ff_mb_decision",mb_decision,mb_decision);
-  PARAM_INT_SCALE("ff_rc_initial_buffer_occupancy",rc_initial_buffer_occupancy,1000);
-  PARAM_INT("ff_nsse_weight",nsse_weight);
-  PARAM_QP2LAMBDA("ff_mb_lmin", mb_lmin);
-  PARAM_QP2LAMBDA("ff_mb_lmax", mb_lmax);
-  PARAM_INT("ff_bidir_refine",bidir_refine);
-  PARAM_INT("ff_keyint_min",keyint_min);
-  PARAM_FLAG("ff_flag_qscale",AV_CODEC_FLAG_QSCALE);
-  PARAM_FLAG("ff_flag_4mv",AV_CODEC_FLAG_4MV);
-  PARAM_FLAG("ff_flag_qpel",AV_CODEC_FLAG_QPEL);
-  //  PARAM_FLAG("ff_flag_part",CODEC_FLAG_PART);
-  PARAM_FLAG("ff_flag_gray",AV_CODEC_FLAG_GRAY);
-  //  PARAM_FLAG("ff_flag_alt_scan",CODEC_FLAG_ALT_SCAN);
-  PARAM_INT("ff_trellis",trellis);
-  PARAM_FLAG("ff_flag_bitexact",AV_CODEC_FLAG_BITEXACT);
-  PARAM_FLAG("ff_flag_ac_pred",AV_CODEC_FLAG_AC_PRED);
-  //  PARAM_FLAG("ff_flag_h263p_umv",CODEC_FLAG_H263P_UMV);
-  //  PARAM_FLAG("ff_flag_cbp_rd",CODEC_FLAG_CBP_RD);
-  //  PARAM_FLAG("ff_flag_qp_rd",CODEC_FLAG_QP_RD);
-  //  PARAM_FLAG("ff_flag_h263p_aiv",CODEC_FLAG_H263P_AIV);
-  //  PARAM_FLAG("ffx_flag_obmc",CODEC_FLAG_OBMC);
-  PARAM_FLAG("ff_flag_loop_filter",AV_CODEC_FLAG_LOOP_FILTER);
-  //  PARAM_FLAG("ff_flag_h263p_slice_struct",CODEC_FLAG_H263P_SLICE_STRUCT);
-  PARAM_FLAG("ff_flag_closed_gop",AV_CODEC_FLAG_CLOSED_GOP);
-  PARAM_FLAG2("ff_flag2_fast",AV_CODEC_FLAG2_FAST);
-  //  PARAM_FLAG2("ff_flag2_strict_gop",CODEC_FLAG2_STRICT_GOP);
-  PARAM_INT("ff_thread_count",thread_count);
-  
-  PARAM_DICT_STRING("libx264_preset", "preset");
-  PARAM_DICT_STRING("libx264_tune",   "tune");
-  PARAM_DICT_FLOAT("libx264_crf", "crf");
-  PARAM_DICT_FLOAT("libx264_qp", "qp");
-
-  PARAM_ENUM("faac_profile", profile, faac_profile);
+  if(!(d = find_param_desc(name)))
+    {
+    gavl_log(GAVL_LOG_DEBUG, LOG_DOMAIN, "Unknown parameter %s", name);
+    return;
+    }
 
-  if(!strcmp(name, "faac_quality"))
-    ctx->global_quality = FF_QP2LAMBDA * val->v.i;
-  else if(!strcmp(name, "vorbis_quality"))
-    ctx->global_quality = FF_QP2LAMBDA * val->v.i;
-  
-  if(!strcmp(name, "tga_rle"))
+  switch(d->type)
     {
-    av_opt_set_int(ctx->priv_data, "rle", !!(val->v.i), 0);
+    case PT_INT:
+      set_int_field(ctx, d, val->v.i);
+      break;
+    case PT_INT_SCALE:
+      set_int_field(ctx, d, (int64_t)val->v.i * d->scale);
+      break;
+    case PT_STR_INT_SCALE:
+      set_int_field(ctx, d, (int64_t)atoi(val->v.str) * d->scale);
+      break;
+    case PT_FLOAT:
+      *((float*)((uint8_t*)ctx + d->offset)) = val->v.d;
+      break;
+    case PT_QP2LAMBDA:
+      set_int_field(ctx, d, (int)(val->v.d * FF_QP2LAMBDA+0.5));
+      break;
+    case PT_QP2LAMBDA_FLOAT:
+      *((float*)((uint8_t*)ctx + d->offset)) = (int)(val->v.d * FF_QP2LAMBDA+0.5);
+      break;
+    case PT_QUALITY:
+      set_int_field(ctx, d, FF_QP2LAMBDA * val->v.i);
+      break;
+    case PT_ENUM:
+      for(i = 0; i < d->num_enums; i++)
+        {
+        if(!strcmp(val->v.str, d->enums[i].s))
+          {
+          set_int_field(ctx, d, d->enums[i].i);
+          break;
+          }
+        }
+      break;
+    case PT_CMP_CHROMA:
+      set_flag((int*)((uint8_t*)ctx + d->offset), FF_CMP_CHROMA, val->v.i);
+      break;
+    case PT_FLAG:
+      set_flag(&ctx->flags, d->flag, val->v.i);
+      break;
+    case PT_FLAG2:
+      set_flag(&ctx->flags2, d->flag, val->v.i);
+      break;
+    case PT_DICT_STRING:
+      if(val->v.str && (val->v.str[0] != '$'))
+        av_dict_set(options, d->key, val->v.str, 0);
+      break;
+    case PT_DICT_INT:
+      str = bg_sprintf("%d", val->v.i);
+      av_dict_set(options, d->key, str, 0);
+      free(str);
+      break;
+    case PT_DICT_FLOAT:
+      str = bg_sprintf("%f", val->v.d);
+      av_dict_set(options, d->key, str, 0);
+      free(str);
+      break;
+    case PT_PRIV_BOOL:
+      av_opt_set_int(ctx->priv_data, d->key, !!(val->v.i), 0);
+      break;
     }
-  
-  PARAM_DICT_STRING("libvpx_deadline", "deadline");
-  PARAM_DICT_INT("libvpx_cpu-used",   "cpu-used");
-  PARAM_DICT_INT("libvpx_auto-alt-ref", "alt-ref");
-  PARAM_DICT_INT("libvpx_lag-in-frames", "lag-in-frames");
-  PARAM_DICT_INT("libvpx_arnr-max-frames", "arnr-max-frames");
-  PARAM_DICT_INT("libvpx_crf", "crf");
-  PARAM_DICT_STRING("libvpx_arnr-type", "arnr-type");
   }
 
 /* Type conversion */
@@ -1343,6 +1778,18 @@ pixelformats[] =
     { AV_PIX_FMT_RGB24,    GAVL_RGB_24    },  ///< Packed pixel, 3 bytes per pixel, RGBRGB...
     { AV_PIX_FMT_BGR24,    GAVL_BGR_24    },  ///< Packed pixel, 3 bytes per pixel, BGRBGR...
     { AV_PIX_FMT_BGRA,     GAVL_RGBA_32, CONVERT_OTHER },
+
+    /* 16 bit formats, gavl uses native endianess */
+    { AV_PIX_FMT_GRAY16LE,    GAVL_GRAY_16,      PIX_FMT_LE },
+    { AV_PIX_FMT_GRAY16BE,    GAVL_GRAY_16,      PIX_FMT_BE },
+    { AV_PIX_FMT_RGB48LE,     GAVL_RGB_48,       PIX_FMT_LE },
+    { AV_PIX_FMT_RGB48BE,     GAVL_RGB_48,       PIX_FMT_BE },
+    { AV_PIX_FMT_RGBA64LE,    GAVL_RGBA_64,      PIX_FMT_LE },
+    { AV_PIX_FMT_RGBA64BE,    GAVL_RGBA_64,      PIX_FMT_BE },
+    { AV_PIX_FMT_YUV422P16LE, GAVL_YUV_422_P_16, PIX_FMT_LE },
+    { AV_PIX_FMT_YUV422P16BE, GAVL_YUV_422_P_16, PIX_FMT_BE },
+    { AV_PIX_FMT_YUV444P16LE, GAVL_YUV_444_P_16, PIX_FMT_LE },
+    { AV_PIX_FMT_YUV444P16BE, GAVL_YUV_444_P_16, PIX_FMT_BE },
     
 #if 0 // Not needed in the forseeable future    
 #if LIBAVUTIL_VERSION_INT < (50<<16)
@@ -1354,76 +1801,72 @@ pixelformats[] =
 #endif // Not needed
 };
 
-static gavl_pixelformat_t bg_pixelformat_ffmpeg_2_gavl(enum AVPixelFormat p)
+/*
+ *  Format negotiation: Each format supported by the encoder gets a cost
+ *  for converting the input format into it, the cheapest one wins.
+ *  Ties are resolved in the order of the encoder's list.
+ */
+
+/* Costs of our own in-place conversions, cheaper than any gavl conversion */
+#define COST_CONVERT_ENDIAN 1
+#define COST_CONVERT_OTHER  1
+
+static int pixelformat_index(enum AVPixelFormat p)
   {
   int i;
   for(i = 0; i < sizeof(pixelformats)/sizeof(pixelformats[0]); i++)
     {
     if(pixelformats[i].ffmpeg_csp == p)
-      return pixelformats[i].gavl_csp;
+      return i;
     }
-  return GAVL_PIXELFORMAT_NONE;
-  }
-
-static enum AVPixelFormat bg_pixelformat_gavl_2_ffmpeg(gavl_pixelformat_t p, int * do_convert,
-                                                     const enum AVPixelFormat * supported)
-  {
-  int i, j;
-  for(i = 0; i < sizeof(pixelformats)/sizeof(pixelformats[0]); i++)
-    {
-    if(pixelformats[i].gavl_csp == p)
-      {
-      j = 0;
-
-      while(supported[j] != AV_PIX_FMT_NONE)
-        {
-        if(pixelformats[i].ffmpeg_csp == supported[j])
-          {
-          if(do_convert)
-            *do_convert = pixelformats[i].convert_flags;
-          return pixelformats[i].ffmpeg_csp;
-          }
-        j++;
-        }
-      }
-    }
-  return AV_PIX_FMT_NONE;
+  return -1;
   }
 
 void bg_ffmpeg_choose_pixelformat(const enum AVPixelFormat * supported,
                                   enum AVPixelFormat * ffmpeg_fmt,
                                   gavl_pixelformat_t * gavl_fmt, int * do_convert)
   {
-  int i, num;
-  gavl_pixelformat_t * gavl_fmts;
-
-  /* Count pixelformats */
-  i = 0;
-  num = 0;
-
-  while(supported[i] != AV_PIX_FMT_NONE)
+  int i, idx;
+  int cost;
+  int min_cost = -1;
+  int min_idx = -1;
+  
+  for(i = 0; supported && (supported[i] != AV_PIX_FMT_NONE); i++)
     {
-    if(bg_pixelformat_ffmpeg_2_gavl(supported[i]) != GAVL_PIXELFORMAT_NONE)
-      num++;
-    i++;
+    if((idx = pixelformat_index(supported[i])) < 0)
+      continue;
+
+    cost = gavl_pixelformat_conversion_penalty(*gavl_fmt, pixelformats[idx].gavl_csp);
+    
+    if(pixelformats[idx].convert_flags & CONVERT_ENDIAN)
+      cost += COST_CONVERT_ENDIAN;
+    if(pixelformats[idx].convert_flags & CONVERT_OTHER)
+      cost += COST_CONVERT_OTHER;
+    
+    if((min_idx < 0) || (cost < min_cost))
+      {
+      min_cost = cost;
+      min_idx = idx;
+      }
     }
-  
-  gavl_fmts = malloc((num+1) * sizeof(gavl_fmts));
-  
-  i = 0;
-  num = 0;
-  
-  while(supported[i] != AV_PIX_FMT_NONE)
+
+  if(min_idx < 0)
     {
-    if((gavl_fmts[num] = bg_pixelformat_ffmpeg_2_gavl(supported[i])) != GAVL_PIXELFORMAT_NONE)
-      num++;
-    i++;
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "No supported pixelformat");
+    *ffmpeg_fmt = AV_PIX_FMT_NONE;
+    return;
     }
-  gavl_fmts[num] = GAVL_PIXELFORMAT_NONE;
 
-  *gavl_fmt = gavl_pixelformat_get_best(*gavl_fmt, gavl_fmts, NULL);
-  *ffmpeg_fmt = bg_pixelformat_gavl_2_ffmpeg(*gavl_fmt, do_convert, supported);
-  free(gavl_fmts);
+  gavl_log(GAVL_LOG_DEBUG, LOG_DOMAIN,
+           "Pixelformat: %s -> %s (%s), cost: %d",
+           gavl_pixelformat_to_string(*gavl_fmt),
+           gavl_pixelformat_to_string(pixelformats[min_idx].gavl_csp),
+           av_get_pix_fmt_name(pixelformats[min_idx].ffmpeg_csp), min_cost);
+  
+  *gavl_fmt = pixelformats[min_idx].gavl_csp;
+  *ffmpeg_fmt = pixelformats[min_idx].ffmpeg_csp;
+  if(do_convert)
+    *do_convert = pixelformats[min_idx].convert_flags;
   }
 
 static const struct
@@ -1467,6 +1910,72 @@ gavl_sample_format_t bg_sample_format_ffmpeg_2_gavl(enum AVSampleFormat p,
   return GAVL_SAMPLE_NONE;
   }
 
+/* Sample format costs */
+#define COST_SAMPLE_FORMAT     4 // Different format
+#define COST_SAMPLE_PRECISION  2 // Conversion to fewer bits
+#define COST_INTERLEAVE        1 // Different interleave mode
+
+enum AVSampleFormat bg_ffmpeg_choose_sampleformat(const enum AVSampleFormat * supported,
+                                                  gavl_audio_format_t * fmt)
+  {
+  int i, j;
+  int cost;
+  int min_cost = -1;
+  int min_idx = -1;
+  gavl_interleave_mode_t il;
+
+  for(i = 0; supported && (supported[i] != AV_SAMPLE_FMT_NONE); i++)
+    {
+    for(j = 0; j < sizeof(sampleformats)/sizeof(sampleformats[0]); j++)
+      {
+      if(sampleformats[j].ffmpeg_fmt == supported[i])
+        break;
+      }
+    if(j == sizeof(sampleformats)/sizeof(sampleformats[0]))
+      continue;
+
+    cost = 0;
+    
+    if(sampleformats[j].gavl_fmt != fmt->sample_format)
+      {
+      cost += COST_SAMPLE_FORMAT;
+      if(gavl_bytes_per_sample(sampleformats[j].gavl_fmt) <
+         gavl_bytes_per_sample(fmt->sample_format))
+        cost += COST_SAMPLE_PRECISION;
+      }
+
+    il = sampleformats[j].planar ? GAVL_INTERLEAVE_NONE : GAVL_INTERLEAVE_ALL;
+    
+    if((il != fmt->interleave_mode) && (fmt->num_channels > 1))
+      cost += COST_INTERLEAVE;
+    
+    if((min_idx < 0) || (cost < min_cost))
+      {
+      min_cost = cost;
+      min_idx = j;
+      }
+    }
+
+  if(min_idx < 0)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "No supported sample format");
+    return AV_SAMPLE_FMT_NONE;
+    }
+  
+  gavl_log(GAVL_LOG_DEBUG, LOG_DOMAIN,
+           "Sample format: %s (%s) -> %s (%s), cost: %d",
+           gavl_sample_format_to_string(fmt->sample_format),
+           gavl_interleave_mode_to_string(fmt->interleave_mode),
+           gavl_sample_format_to_string(sampleformats[min_idx].gavl_fmt),
+           av_get_sample_fmt_name(sampleformats[min_idx].ffmpeg_fmt), min_cost);
+  
+  fmt->sample_format = sampleformats[min_idx].gavl_fmt;
+  fmt->interleave_mode =
+    sampleformats[min_idx].planar ? GAVL_INTERLEAVE_NONE : GAVL_INTERLEAVE_ALL;
+  
+  return sampleformats[min_idx].ffmpeg_fmt;
+  }
+
 /* Compressed stream support */
 
 static const struct
@@ -1500,6 +2009,8 @@ codec_ids[] =
     { GAVL_CODEC_ID_DIRAC,     AV_CODEC_ID_DIRAC      }, //!< Complete DIRAC frames, sequence end code appended to last packet
     { GAVL_CODEC_ID_DV,        AV_CODEC_ID_DVVIDEO    }, //!< DV (several variants)
     { GAVL_CODEC_ID_VP8,       AV_CODEC_ID_VP8        }, //!< VP8 (as in webm)
+    { GAVL_CODEC_ID_VP9,       AV_CODEC_ID_VP9        }, //!< VP9 (as in webm)
+    { GAVL_CODEC_ID_AV1,       AV_CODEC_ID_AV1        }, //!< AV1
     { GAVL_CODEC_ID_DIV3,      AV_CODEC_ID_MSMPEG4V3  }, //!< Old style Divx
     { GAVL_CODEC_ID_NONE,      AV_CODEC_ID_NONE       },
   };
@@ -0,0 +1,492 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Pixelformat fixups for formats gavl doesn't support directly.
+ *  All conversions are done in place. The kernels work on single rows,
+ *  large images are split into slices, which are processed by
+ *  the threads of a bg_ffmpeg_slicer_t.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ffmpeg_common.h"
+
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "ffmpeg_convert"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+#define MAX_SLICES      16
+#define SLICE_MIN_BYTES (256*1024) // Don't bother starting threads for less
+
+typedef void (*row_func_t)(uint8_t * ptr, int num);
+
+/* RGBA <-> BGRA, num is the number of pixels */
+
+static void swap_rb_c(uint8_t * ptr, int num)
+  {
+  int i;
+  uint8_t swp;
+  
+  for(i = 0; i < num; i++)
+    {
+    swp = ptr[0];
+    ptr[0] = ptr[2];
+    ptr[2] = swp;
+    ptr += 4;
+    }
+  }
+
+/* 16 bit endian swap, num is the number of 16 bit words */
+
+static void bswap16_c(uint8_t * ptr, int num)
+  {
+  int i;
+  uint8_t swp;
+  
+  for(i = 0; i < num; i++)
+    {
+    swp = ptr[0];
+    ptr[0] = ptr[1];
+    ptr[1] = swp;
+    ptr += 2;
+    }
+  }
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("ssse3")))
+static void swap_rb_ssse3(uint8_t * ptr, int num)
+  {
+  int i;
+  __m128i v;
+  const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                     10, 9, 8, 11, 14, 13, 12, 15);
+  
+  for(i = 0; i + 4 <= num; i += 4)
+    {
+    v = _mm_loadu_si128((const __m128i*)ptr);
+    _mm_storeu_si128((__m128i*)ptr, _mm_shuffle_epi8(v, mask));
+    ptr += 16;
+    }
+  swap_rb_c(ptr, num - i);
+  }
+
+__attribute__((target("ssse3")))
+static void bswap16_ssse3(uint8_t * ptr, int num)
+  {
+  int i;
+  __m128i v;
+  const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                     9, 8, 11, 10, 13, 12, 15, 14);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    v = _mm_loadu_si128((const __m128i*)ptr);
+    _mm_storeu_si128((__m128i*)ptr, _mm_shuffle_epi8(v, mask));
+    ptr += 16;
+    }
+  bswap16_c(ptr, num - i);
+  }
+
+__attribute__((target("avx2")))
+static void swap_rb_avx2(uint8_t * ptr, int num)
+  {
+  int i;
+  __m256i v;
+  const __m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                        10, 9, 8, 11, 14, 13, 12, 15,
+                                        2, 1, 0, 3, 6, 5, 4, 7,
+                                        10, 9, 8, 11, 14, 13, 12, 15);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    v = _mm256_loadu_si256((const __m256i*)ptr);
+    _mm256_storeu_si256((__m256i*)ptr, _mm256_shuffle_epi8(v, mask));
+    ptr += 32;
+    }
+  swap_rb_c(ptr, num - i);
+  }
+
+__attribute__((target("avx2")))
+static void bswap16_avx2(uint8_t * ptr, int num)
+  {
+  int i;
+  __m256i v;
+  const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                        9, 8, 11, 10, 13, 12, 15, 14,
+                                        1, 0, 3, 2, 5, 4, 7, 6,
+                                        9, 8, 11, 10, 13, 12, 15, 14);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    v = _mm256_loadu_si256((const __m256i*)ptr);
+    _mm256_storeu_si256((__m256i*)ptr, _mm256_shuffle_epi8(v, mask));
+    ptr += 32;
+    }
+  bswap16_c(ptr, num - i);
+  }
+
+#endif // HAVE_X86_KERNELS
+
+#ifdef HAVE_NEON_KERNELS
+
+static void swap_rb_neon(uint8_t * ptr, int num)
+  {
+  int i;
+  uint8x16x4_t v;
+  uint8x16_t swp;
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    v = vld4q_u8(ptr);
+    swp = v.val[0];
+    v.val[0] = v.val[2];
+    v.val[2] = swp;
+    vst4q_u8(ptr, v);
+    ptr += 64;
+    }
+  swap_rb_c(ptr, num - i);
+  }
+
+static void bswap16_neon(uint8_t * ptr, int num)
+  {
+  int i;
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    vst1q_u8(ptr, vrev16q_u8(vld1q_u8(ptr)));
+    ptr += 16;
+    }
+  bswap16_c(ptr, num - i);
+  }
+
+#endif // HAVE_NEON_KERNELS
+
+/* Runtime dispatch */
+
+static row_func_t get_swap_rb(void)
+  {
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return swap_rb_avx2;
+  if(__builtin_cpu_supports("ssse3"))
+    return swap_rb_ssse3;
+#endif
+#ifdef HAVE_NEON_KERNELS
+  return swap_rb_neon;
+#endif
+  return swap_rb_c;
+  }
+
+static row_func_t get_bswap16(void)
+  {
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return bswap16_avx2;
+  if(__builtin_cpu_supports("ssse3"))
+    return bswap16_ssse3;
+#endif
+#ifdef HAVE_NEON_KERNELS
+  return bswap16_neon;
+#endif
+  return bswap16_c;
+  }
+
+/* Slicing */
+
+typedef struct
+  {
+  row_func_t func;
+  uint8_t * data;
+  int stride;
+  int num; // Per row
+  int start_row;
+  int end_row;
+  } slice_t;
+
+static void do_slice(slice_t * s)
+  {
+  int i;
+
+  for(i = s->start_row; i < s->end_row; i++)
+    s->func(s->data + i * s->stride, s->num);
+  }
+
+/*
+ *  The slicer keeps its threads for the lifetime of the encoder, so
+ *  a frame costs two condition signals per thread instead of a
+ *  pthread_create() and pthread_join(). The number of threads is taken
+ *  from the thread budget and limited by the image size.
+ */
+
+typedef struct
+  {
+  pthread_t thread;
+  bg_ffmpeg_slicer_t * s;
+  slice_t slice;
+  } slice_worker_t;
+
+struct bg_ffmpeg_slicer_s
+  {
+  int num_threads;   // Including the calling thread
+  int num_workers;   // Started threads (num_threads - 1)
+  slice_worker_t workers[MAX_SLICES-1];
+
+  pthread_mutex_t mutex;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+
+  int job;           // Incremented for each new job
+  int num_slices;    // Slices of the current job
+  int pending;       // Slices not done yet
+  int quit;
+  };
+
+static void * slice_thread(void * data)
+  {
+  int job = 0;
+  slice_worker_t * w = data;
+  bg_ffmpeg_slicer_t * s = w->s;
+  int idx = w - s->workers + 1; // Slice 0 is done by the caller
+
+  pthread_mutex_lock(&s->mutex);
+
+  while(1)
+    {
+    while((s->job == job) && !s->quit)
+      pthread_cond_wait(&s->start_cond, &s->mutex);
+
+    if(s->quit)
+      break;
+
+    job = s->job;
+
+    if(idx >= s->num_slices)
+      continue;
+    
+    pthread_mutex_unlock(&s->mutex);
+    do_slice(&w->slice);
+    pthread_mutex_lock(&s->mutex);
+
+    if(!--s->pending)
+      pthread_cond_signal(&s->done_cond);
+    }
+
+  pthread_mutex_unlock(&s->mutex);
+  return NULL;
+  }
+
+bg_ffmpeg_slicer_t * bg_ffmpeg_slicer_create(const gavl_video_format_t * fmt)
+  {
+  int i;
+  int num;
+  int wanted;
+  bg_ffmpeg_slicer_t * ret;
+
+  wanted = ((int64_t)fmt->image_width * fmt->image_height *
+            gavl_pixelformat_bytes_per_pixel(fmt->pixelformat)) / SLICE_MIN_BYTES;
+
+  if(wanted > MAX_SLICES)
+    wanted = MAX_SLICES;
+  
+  if(wanted < 2)
+    return NULL;
+  
+  /* Automatic share, the calling thread counts as well */
+  num = bgen_threads_reserve(0);
+  if(num > wanted)
+    {
+    bgen_threads_release(num - wanted);
+    num = wanted;
+    }
+  if(num < 2) // No cores left
+    {
+    bgen_threads_release(num);
+    return NULL;
+    }
+  
+  ret = calloc(1, sizeof(*ret));
+  ret->num_threads = num;
+  
+  pthread_mutex_init(&ret->mutex, NULL);
+  pthread_cond_init(&ret->start_cond, NULL);
+  pthread_cond_init(&ret->done_cond, NULL);
+
+  for(i = 0; i < ret->num_threads - 1; i++)
+    {
+    ret->workers[i].s = ret;
+    if(pthread_create(&ret->workers[i].thread, NULL, slice_thread, &ret->workers[i]))
+      break;
+    ret->num_workers++;
+    }
+
+  gavl_log(GAVL_LOG_DEBUG, LOG_DOMAIN, "Using %d threads for the pixelformat conversion",
+           ret->num_workers + 1);
+  
+  return ret;
+  }
+
+void bg_ffmpeg_slicer_destroy(bg_ffmpeg_slicer_t * s)
+  {
+  int i;
+  
+  pthread_mutex_lock(&s->mutex);
+  s->quit = 1;
+  pthread_cond_broadcast(&s->start_cond);
+  pthread_mutex_unlock(&s->mutex);
+
+  for(i = 0; i < s->num_workers; i++)
+    pthread_join(s->workers[i].thread, NULL);
+
+  pthread_mutex_destroy(&s->mutex);
+  pthread_cond_destroy(&s->start_cond);
+  pthread_cond_destroy(&s->done_cond);
+
+  bgen_threads_release(s->num_threads);
+  free(s);
+  }
+
+static void run_sliced(bg_ffmpeg_slicer_t * s,
+                       row_func_t func, uint8_t * data, int stride,
+                       int num, int row_bytes, int num_rows)
+  {
+  int i;
+  int num_slices;
+  slice_t slice;
+  
+  num_slices = (int64_t)row_bytes * num_rows / SLICE_MIN_BYTES;
+
+  if(s && (num_slices > s->num_workers + 1))
+    num_slices = s->num_workers + 1;
+  
+  if(!s || (num_slices < 2))
+    {
+    slice.func      = func;
+    slice.data      = data;
+    slice.stride    = stride;
+    slice.num       = num;
+    slice.start_row = 0;
+    slice.end_row   = num_rows;
+    do_slice(&slice);
+    return;
+    }
+  
+  for(i = 0; i < num_slices; i++)
+    {
+    slice_t * sl = i ? &s->workers[i-1].slice : &slice;
+    
+    sl->func      = func;
+    sl->data      = data;
+    sl->stride    = stride;
+    sl->num       = num;
+    sl->start_row = (num_rows * i) / num_slices;
+    sl->end_row   = (num_rows * (i+1)) / num_slices;
+    }
+
+  pthread_mutex_lock(&s->mutex);
+  s->num_slices = num_slices;
+  s->pending = num_slices - 1;
+  s->job++;
+  pthread_cond_broadcast(&s->start_cond);
+  pthread_mutex_unlock(&s->mutex);
+
+  /* The first slice is done by us */
+  do_slice(&slice);
+  
+  pthread_mutex_lock(&s->mutex);
+  while(s->pending)
+    pthread_cond_wait(&s->done_cond, &s->mutex);
+  pthread_mutex_unlock(&s->mutex);
+  }
+
+void bg_ffmpeg_convert_swap_rb(bg_ffmpeg_slicer_t * s,
+                               const gavl_video_format_t * fmt,
+                               gavl_video_frame_t * f)
+  {
+  static row_func_t func = NULL;
+
+  if(!func)
+    func = get_swap_rb();
+  
+  run_sliced(s, func, f->planes[0], f->strides[0],
+             fmt->image_width, fmt->image_width * 4, fmt->image_height);
+  }
+
+void bg_ffmpeg_convert_bswap16(uint8_t * ptr, int num)
+  {
+  static row_func_t func = NULL;
+
+  if(!func)
+    func = get_bswap16();
+  func(ptr, num);
+  }
+
+void bg_ffmpeg_convert_swap_endian(bg_ffmpeg_slicer_t * s,
+                                   const gavl_video_format_t * fmt,
+                                   gavl_video_frame_t * f)
+  {
+  int i;
+  int num_planes;
+  int sub_h, sub_v;
+  int width, height, row_bytes;
+  static row_func_t func = NULL;
+
+  if(!func)
+    func = get_bswap16();
+
+  num_planes = gavl_pixelformat_num_planes(fmt->pixelformat);
+  gavl_pixelformat_chroma_sub(fmt->pixelformat, &sub_h, &sub_v);
+  
+  for(i = 0; i < num_planes; i++)
+    {
+    width  = fmt->image_width;
+    height = fmt->image_height;
+
+    if(num_planes == 1)
+      row_bytes = width * gavl_pixelformat_bytes_per_pixel(fmt->pixelformat);
+    else
+      {
+      if(i)
+        {
+        width  = (width + sub_h - 1) / sub_h;
+        height = (height + sub_v - 1) / sub_v;
+        }
+      row_bytes = width * gavl_pixelformat_bytes_per_component(fmt->pixelformat);
+      }
+    run_sliced(s, func, f->planes[i], f->strides[i],
+               row_bytes / 2, row_bytes, height);
+    }
+  }
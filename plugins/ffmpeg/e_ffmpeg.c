@@ -45,6 +45,9 @@ static const ffmpeg_format_info_t formats[] =
       .video_codecs = (enum AVCodecID[]){  AV_CODEC_ID_MPEG4,
                                            AV_CODEC_ID_MSMPEG4V3,
                                            AV_CODEC_ID_MJPEG,
+                                           AV_CODEC_ID_FFV1,
+                                           AV_CODEC_ID_UTVIDEO,
+                                           AV_CODEC_ID_HUFFYUV,
                                            AV_CODEC_ID_NONE },
       .flags = FLAG_CONSTANT_FRAMERATE,
     },
@@ -133,12 +136,14 @@ static const ffmpeg_format_info_t formats[] =
       .audio_codecs = (enum AVCodecID[]){ AV_CODEC_ID_MP3,
                                         AV_CODEC_ID_MP2,
                                         AV_CODEC_ID_AC3,
+                                        AV_CODEC_ID_AAC,
                                         AV_CODEC_ID_NONE },
       
       .video_codecs = (enum AVCodecID[]){ AV_CODEC_ID_MPEG1VIDEO,
                                         AV_CODEC_ID_MPEG2VIDEO,
+                                        AV_CODEC_ID_H264,
                                         AV_CODEC_ID_NONE },
-      .flags = FLAG_CONSTANT_FRAMERATE | FLAG_PIPE,
+      .flags = FLAG_CONSTANT_FRAMERATE | FLAG_PIPE | FLAG_ANNEX_B,
     },
     {
       .name =       "Matroska",
@@ -159,9 +164,15 @@ static const ffmpeg_format_info_t formats[] =
                                           AV_CODEC_ID_MPEG1VIDEO,
                                           AV_CODEC_ID_MPEG2VIDEO,
                                           AV_CODEC_ID_VP8,
+                                          AV_CODEC_ID_VP9,
+                                          AV_CODEC_ID_AV1,
                                           AV_CODEC_ID_MSMPEG4V3,
+                                          AV_CODEC_ID_FFV1,
+                                          AV_CODEC_ID_UTVIDEO,
+                                          AV_CODEC_ID_HUFFYUV,
                                           AV_CODEC_ID_NONE },
       //      .flags = FLAG_CONSTANT_FRAMERATE,
+      .flags = FLAG_RESERVE_INDEX,
     },
     {
       .name =       "webm",
@@ -173,8 +184,10 @@ static const ffmpeg_format_info_t formats[] =
                                           AV_CODEC_ID_NONE },
       
       .video_codecs = (enum AVCodecID[]){ AV_CODEC_ID_VP8,
+                                          AV_CODEC_ID_VP9,
+                                          AV_CODEC_ID_AV1,
                                           AV_CODEC_ID_NONE },
-      .flags = FLAG_PIPE,
+      .flags = FLAG_PIPE | FLAG_RESERVE_INDEX,
     },
     {
       .name =       "MP4",
@@ -187,8 +200,27 @@ static const ffmpeg_format_info_t formats[] =
 
       .video_codecs = (enum AVCodecID[]){  AV_CODEC_ID_MPEG4,
                                            AV_CODEC_ID_H264,
+                                           AV_CODEC_ID_VP9,
+                                           AV_CODEC_ID_AV1,
                                            AV_CODEC_ID_NONE },
-
+      .flags = FLAG_FRAGMENT | FLAG_RESERVE_INDEX,
+    },
+    {
+      .name =       "HLS (segmented MPEG-2 TS or fragmented MP4)",
+      .short_name = "hls",
+      .extension =  "m3u8",
+      .max_audio_streams = 1,
+      .max_video_streams = 1,
+      .audio_codecs = (enum AVCodecID[]){ AV_CODEC_ID_AAC,
+                                          AV_CODEC_ID_MP3,
+                                          AV_CODEC_ID_AC3,
+                                          AV_CODEC_ID_MP2,
+                                          AV_CODEC_ID_NONE },
+      
+      .video_codecs = (enum AVCodecID[]){ AV_CODEC_ID_H264,
+                                          AV_CODEC_ID_MPEG2VIDEO,
+                                          AV_CODEC_ID_NONE },
+      .flags = FLAG_CONSTANT_FRAMERATE,
     },
 #if 0 // Encoded file is messed up
     {
@@ -83,7 +83,7 @@ static const ffmpeg_format_info_t formats[] =
       .max_audio_streams = 1,
       .audio_codecs = (enum AVCodecID[]){  AV_CODEC_ID_AAC,
                                            AV_CODEC_ID_NONE },
-      .flags = FLAG_PIPE,
+      .flags = FLAG_PIPE | FLAG_ANNEX_B,
     },
 #endif
     { /* End of formats */ }
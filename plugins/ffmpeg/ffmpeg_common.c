@@ -19,18 +19,24 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  * *****************************************************************/
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include <config.h>
 
 #include "ffmpeg_common.h"
+#include <bgen_probes.h>
 #include <gmerlin/translation.h>
 #include <gmerlin/utils.h>
 #include <gmerlin/log.h>
 
 #include <gavl/metatags.h>
 
+#include <libavutil/opt.h>
+
 #define LOG_DOMAIN "ffmpeg"
 
 // #define DUMP_AUDIO_PACKETS
@@ -41,17 +47,171 @@ static void copy_extradata(AVCodecParameters * avctx,
                            const gavl_compression_info_t * ci);
 
 
+#define FRAGMENT_AUTO     0 // Fragment only if the output is not seekable
+#define FRAGMENT_KEYFRAME 1
+#define FRAGMENT_DURATION 2
+
+#define SEGMENT_MPEGTS    0
+#define SEGMENT_FMP4      1
+
+#define QUEUE_OVERFLOW_FLUSH 0 // Write packets out of order
+#define QUEUE_OVERFLOW_ERROR 1 // Return GAVL_SINK_ERROR
+
+static const bg_parameter_info_t format_parameters[] =
+  {
+    {
+      .name =      "format",
+      .long_name = TRS("Format"),
+      .type =      BG_PARAMETER_STRINGLIST,
+    },
+    {
+      .name =        "io_buffer_size",
+      .long_name =   TRS("I/O buffer size (kB)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(65536),
+      .val_default = GAVL_VALUE_INIT_INT(0),
+      .help_string = TRS("Size of the output buffer. 0 means automatic: A large buffer for files, \
+a small buffer, which is flushed after each packet, for pipes and live streams."),
+    },
+    {
+      .name =        "fragment_mode",
+      .long_name =   TRS("Fragmentation"),
+      .type =        BG_PARAMETER_STRINGLIST,
+      .val_default = GAVL_VALUE_INIT_STRING("auto"),
+      .multi_names = (char const *[]){ "auto",
+                                       "keyframe",
+                                       "duration",
+                                       NULL },
+      .multi_labels = (char const *[]){ TRS("Non-seekable outputs only"),
+                                        TRS("At keyframes"),
+                                        TRS("Fixed duration"),
+                                        NULL },
+      .help_string = TRS("Write fragmented files (empty moov, one moof per fragment). \
+Fragmented files can be written to pipes. Applies only to MP4."),
+    },
+    {
+      .name =        "fragment_duration",
+      .long_name =   TRS("Fragment duration (ms)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(10),
+      .val_max =     GAVL_VALUE_INIT_INT(60000),
+      .val_default = GAVL_VALUE_INIT_INT(2000),
+      .help_string = TRS("Fragment duration for fixed duration fragmentation"),
+    },
+    {
+      .name =        "fragment_size",
+      .long_name =   TRS("Maximum fragment size (kB)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(1048576),
+      .val_default = GAVL_VALUE_INIT_INT(4096),
+      .help_string = TRS("Start a new fragment if the current one exceeds this size. \
+This limits the memory the muxer needs for buffering a fragment. 0 means unlimited."),
+    },
+    {
+      .name =        "fragment_index",
+      .long_name =   TRS("Write fragment index"),
+      .type =        BG_PARAMETER_CHECKBUTTON,
+      .val_default = GAVL_VALUE_INIT_INT(1),
+      .help_string = TRS("Write a fragment index (mfra) at the end and \
+a segment index (sidx) at the start for seekable outputs"),
+    },
+    {
+      .name =        "reserve_index",
+      .long_name =   TRS("Reserve space for the index"),
+      .type =        BG_PARAMETER_CHECKBUTTON,
+      .val_default = GAVL_VALUE_INIT_INT(1),
+      .help_string = TRS("Reserve space for the index (MP4 moov atom, Matroska cues) at the start \
+of the file, so it can be played over the network without an extra pass. The size is estimated \
+from the approximate duration. If the estimate turns out to be too small, the index is written \
+at the end. Applies only to MP4 and Matroska."),
+    },
+    {
+      .name =        "max_interleave_delta",
+      .long_name =   TRS("Maximum interleave delta (ms)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(600000),
+      .val_default = GAVL_VALUE_INIT_INT(10000),
+      .help_string = TRS("Packets are queued until all streams have a packet. If the queued packets \
+span more than this time, packets are written even if some streams have nothing queued (e.g. sparse \
+subtitle streams). 0 means unlimited."),
+    },
+    {
+      .name =        "max_queue_size",
+      .long_name =   TRS("Maximum interleaving queue size (MB)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(65536),
+      .val_default = GAVL_VALUE_INIT_INT(256),
+      .help_string = TRS("Maximum memory for packets waiting to be interleaved. 0 means unlimited."),
+    },
+    {
+      .name =        "queue_overflow",
+      .long_name =   TRS("Queue overflow"),
+      .type =        BG_PARAMETER_STRINGLIST,
+      .val_default = GAVL_VALUE_INIT_STRING("flush"),
+      .multi_names = (char const *[]){ "flush",
+                                       "error",
+                                       NULL },
+      .multi_labels = (char const *[]){ TRS("Write packets"),
+                                        TRS("Stop with an error"),
+                                        NULL },
+      .help_string = TRS("What to do if the interleaving queue exceeds its maximum size. \
+Writing the packets keeps the memory bounded, but the file might be badly interleaved."),
+    },
+    {
+      .name =        "segment_duration",
+      .long_name =   TRS("Segment duration (s)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(1),
+      .val_max =     GAVL_VALUE_INIT_INT(60),
+      .val_default = GAVL_VALUE_INIT_INT(6),
+      .help_string = TRS("Target segment duration. Segments are cut at the first keyframe after \
+this duration, so the keyframe interval of the video encoder should be a divisor of it. \
+Applies only to HLS."),
+    },
+    {
+      .name =        "segment_type",
+      .long_name =   TRS("Segment type"),
+      .type =        BG_PARAMETER_STRINGLIST,
+      .val_default = GAVL_VALUE_INIT_STRING("mpegts"),
+      .multi_names = (char const *[]){ "mpegts",
+                                       "fmp4",
+                                       NULL },
+      .multi_labels = (char const *[]){ TRS("MPEG-2 transport stream"),
+                                        TRS("Fragmented MP4"),
+                                        NULL },
+      .help_string = TRS("Applies only to HLS"),
+    },
+    {
+      .name =        "playlist_live",
+      .long_name =   TRS("Live playlist"),
+      .type =        BG_PARAMETER_CHECKBUTTON,
+      .val_default = GAVL_VALUE_INIT_INT(0),
+      .help_string = TRS("Write a rolling playlist and delete segments, which dropped out of it. \
+Otherwise a VOD playlist with all segments is written. Applies only to HLS."),
+    },
+    {
+      .name =        "playlist_size",
+      .long_name =   TRS("Live playlist size"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(1),
+      .val_max =     GAVL_VALUE_INIT_INT(1000),
+      .val_default = GAVL_VALUE_INIT_INT(6),
+      .help_string = TRS("Number of segments in a live playlist. Applies only to HLS."),
+    },
+    { /* End */ }
+  };
+
 static bg_parameter_info_t *
 create_format_parameters(const ffmpeg_format_info_t * formats)
   {
   int num_formats, i;
   
   bg_parameter_info_t * ret;
-  ret = calloc(2, sizeof(*ret));
-
-  ret[0].name = gavl_strrep(ret[0].name, "format");
-  ret[0].long_name = gavl_strrep(ret[0].long_name, TRS("Format"));
-  ret[0].type = BG_PARAMETER_STRINGLIST;
+  ret = bg_parameter_info_copy_array(format_parameters);
 
   num_formats = 0;
   while(formats[num_formats].name)
@@ -75,6 +235,48 @@ create_format_parameters(const ffmpeg_format_info_t * formats)
   return ret;
   }
 
+/*
+ *  The parameters depend only on the format table, which is the same for
+ *  all instances of a plugin module. They are built on first use and
+ *  shared read-only.
+ */
+
+static struct
+  {
+  bg_parameter_info_t * parameters;
+  bg_parameter_info_t * audio_parameters;
+  bg_parameter_info_t * video_parameters;
+  } shared;
+
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_shared(const ffmpeg_format_info_t * formats)
+  {
+  pthread_mutex_lock(&shared_mutex);
+  
+  if(!shared.parameters)
+    {
+    shared.audio_parameters = bg_ffmpeg_create_audio_parameters(formats);
+    shared.video_parameters = bg_ffmpeg_create_video_parameters(formats);
+    shared.parameters = create_format_parameters(formats);
+    }
+  
+  pthread_mutex_unlock(&shared_mutex);
+  }
+
+#ifdef __GNUC__
+/* Called when the module is unloaded */
+static void __attribute__((destructor)) free_shared(void)
+  {
+  if(shared.parameters)
+    bg_parameter_info_destroy_array(shared.parameters);
+  if(shared.audio_parameters)
+    bg_parameter_info_destroy_array(shared.audio_parameters);
+  if(shared.video_parameters)
+    bg_parameter_info_destroy_array(shared.video_parameters);
+  }
+#endif
+
 void * bg_ffmpeg_create(const ffmpeg_format_info_t * formats)
   {
   ffmpeg_priv_t * ret;
@@ -82,13 +284,6 @@ void * bg_ffmpeg_create(const ffmpeg_format_info_t * formats)
   ret = calloc(1, sizeof(*ret));
   
   ret->formats = formats;
-
-  ret->audio_parameters =
-    bg_ffmpeg_create_audio_parameters(formats);
-  ret->video_parameters =
-    bg_ffmpeg_create_video_parameters(formats);
-  ret->parameters = create_format_parameters(formats);
-  
   return ret;
   }
 
@@ -105,13 +300,8 @@ void bg_ffmpeg_destroy(void * data)
   ffmpeg_priv_t * priv;
   priv = data;
 
-  if(priv->parameters)
-    bg_parameter_info_destroy_array(priv->parameters);
-  if(priv->audio_parameters)
-    bg_parameter_info_destroy_array(priv->audio_parameters);
-  if(priv->video_parameters)
-    bg_parameter_info_destroy_array(priv->video_parameters);
-
+  bgen_stats_unregister(&priv->perf);
+  
   if(priv->audio_streams)
     free(priv->audio_streams);
   if(priv->video_streams)
@@ -123,21 +313,24 @@ const bg_parameter_info_t * bg_ffmpeg_get_parameters(void * data)
   {
   ffmpeg_priv_t * priv;
   priv = data;
-  return priv->parameters;
+  init_shared(priv->formats);
+  return shared.parameters;
   }
 
 const bg_parameter_info_t * bg_ffmpeg_get_audio_parameters(void * data)
   {
   ffmpeg_priv_t * priv;
   priv = data;
-  return priv->audio_parameters;
+  init_shared(priv->formats);
+  return shared.audio_parameters;
   }
 
 const bg_parameter_info_t * bg_ffmpeg_get_video_parameters(void * data)
   {
   ffmpeg_priv_t * priv;
   priv = data;
-  return priv->video_parameters;
+  init_shared(priv->formats);
+  return shared.video_parameters;
   }
 
 void bg_ffmpeg_set_parameter(void * data, const char * name,
@@ -164,7 +357,49 @@ void bg_ffmpeg_set_parameter(void * data, const char * name,
       i++;
       }
     }
-  
+  else if(!strcmp(name, "io_buffer_size"))
+    priv->io_buffer_size = v->v.i * 1024;
+  else if(!strcmp(name, "fragment_mode"))
+    {
+    if(!strcmp(v->v.str, "keyframe"))
+      priv->fragment_mode = FRAGMENT_KEYFRAME;
+    else if(!strcmp(v->v.str, "duration"))
+      priv->fragment_mode = FRAGMENT_DURATION;
+    else
+      priv->fragment_mode = FRAGMENT_AUTO;
+    }
+  else if(!strcmp(name, "fragment_duration"))
+    priv->fragment_duration = v->v.i;
+  else if(!strcmp(name, "fragment_size"))
+    priv->fragment_size = v->v.i * 1024;
+  else if(!strcmp(name, "fragment_index"))
+    priv->fragment_index = v->v.i;
+  else if(!strcmp(name, "reserve_index"))
+    priv->reserve_index = v->v.i;
+  else if(!strcmp(name, "max_interleave_delta"))
+    priv->max_interleave_delta = v->v.i;
+  else if(!strcmp(name, "max_queue_size"))
+    priv->max_queue_bytes = (int64_t)v->v.i * 1024 * 1024;
+  else if(!strcmp(name, "queue_overflow"))
+    {
+    if(!strcmp(v->v.str, "error"))
+      priv->queue_overflow = QUEUE_OVERFLOW_ERROR;
+    else
+      priv->queue_overflow = QUEUE_OVERFLOW_FLUSH;
+    }
+  else if(!strcmp(name, "segment_duration"))
+    priv->segment_duration = v->v.i;
+  else if(!strcmp(name, "segment_type"))
+    {
+    if(!strcmp(v->v.str, "fmp4"))
+      priv->segment_type = SEGMENT_FMP4;
+    else
+      priv->segment_type = SEGMENT_MPEGTS;
+    }
+  else if(!strcmp(name, "playlist_live"))
+    priv->playlist_live = v->v.i;
+  else if(!strcmp(name, "playlist_size"))
+    priv->playlist_size = v->v.i;
   }
 
 static void set_metadata(ffmpeg_priv_t * priv,
@@ -264,6 +499,8 @@ static int ffmpeg_open(void * data, const char * filename,
   priv = data;
   if(!priv->format)
     return 0;
+
+  priv->duration = GAVL_TIME_UNDEFINED;
   
   /* Initialize format context */
   fmt = guess_format(priv->format->short_name, NULL, NULL);
@@ -271,20 +508,44 @@ static int ffmpeg_open(void * data, const char * filename,
     return 0;
   priv->ctx = avformat_alloc_context();
 
-  if(filename)
+  if(fmt->flags & AVFMT_NOFILE)
+    {
+    char * tmp_string;
+    
+    /* The muxer opens the files (playlist and segments) itself */
+    if(!filename || !strcmp(filename, "-"))
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "%s can only be written to files",
+               priv->format->name);
+      return 0;
+      }
+    tmp_string = bg_filename_ensure_extension(filename,
+                                              priv->format->extension);
+    
+    if(!bg_encoder_cb_create_output_file(priv->cb, tmp_string))
+      {
+      free(tmp_string);
+      return 0;
+      }
+    priv->ctx->url = ffmpeg_string(tmp_string);
+    free(tmp_string);
+    }
+  else if(filename)
     {
     if(!strcmp(filename, "-"))
       {
-      if(!(priv->format->flags & FLAG_PIPE))
+      if(!(priv->format->flags & (FLAG_PIPE|FLAG_FRAGMENT)))
         {
         gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "%s cannot be written to a pipe",
                priv->format->name);
         return 0;
         }
       priv->ctx->url = ffmpeg_string("pipe:");
+      priv->io_priv = gavf_io_create_file(stdout, 1, 0, 0);
       }
     else
       {
+      FILE * f;
       char * tmp_string =
         bg_filename_ensure_extension(filename,
                                      priv->format->extension);
@@ -294,13 +555,22 @@ static int ffmpeg_open(void * data, const char * filename,
         free(tmp_string);
         return 0;
         }
+      if(!(f = fopen(tmp_string, "w")))
+        {
+        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Cannot open file %s: %s",
+                 tmp_string, strerror(errno));
+        free(tmp_string);
+        return 0;
+        }
       priv->ctx->url = ffmpeg_string(tmp_string);
+      priv->io_priv = gavf_io_create_file(f, 1, 1, 1);
       free(tmp_string);
       }
+    priv->io = priv->io_priv;
     }
   else if(io)
     {
-    if(!(priv->format->flags & FLAG_PIPE) &&
+    if(!(priv->format->flags & (FLAG_PIPE|FLAG_FRAGMENT)) &&
        !gavf_io_can_seek(io))
       {
       gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "%s cannot be written to a pipe",
@@ -308,10 +578,12 @@ static int ffmpeg_open(void * data, const char * filename,
       return 0;
       }
     priv->io = io;
-    priv->ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
     }
   else
     return 0;
+
+  if(!(fmt->flags & AVFMT_NOFILE))
+    priv->ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
   
   priv->ctx->max_delay = (int)(0.7 * (float)AV_TIME_BASE);
   priv->ctx->oformat = fmt;
@@ -322,6 +594,8 @@ static int ffmpeg_open(void * data, const char * filename,
     {
     set_metadata(priv, metadata);
 
+    gavl_dictionary_get_long(metadata, GAVL_META_APPROX_DURATION, &priv->duration);
+
     if((cl = gavl_dictionary_get_chapter_list(metadata)))
       set_chapters(priv->ctx, cl, metadata);
     }
@@ -417,6 +691,324 @@ int bg_ffmpeg_add_video_stream(void * data,
                                   int64_t duration, int stream)
 */
 
+/*
+ *  Interleaving: We keep our own per-stream packet queues instead of relying
+ *  on av_interleaved_write_frame(), whose queue is unbounded. Packets are
+ *  written in dts order with av_write_frame().
+ */
+
+static int64_t packet_time(bg_ffmpeg_stream_common_t * com, int idx)
+  {
+  AVPacket * p = com->queue[(com->queue_start + idx) % com->queue_alloc];
+  return av_rescale_q(p->dts, com->stream->time_base, AV_TIME_BASE_Q);
+  }
+
+static void queue_push(ffmpeg_priv_t * priv,
+                       bg_ffmpeg_stream_common_t * com, AVPacket * p)
+  {
+  if(com->queue_len == com->queue_alloc)
+    {
+    int i;
+    AVPacket ** queue;
+    int alloc = com->queue_alloc ? com->queue_alloc * 2 : 16;
+
+    queue = malloc(alloc * sizeof(*queue));
+    for(i = 0; i < com->queue_len; i++)
+      queue[i] = com->queue[(com->queue_start + i) % com->queue_alloc];
+
+    if(com->queue)
+      free(com->queue);
+    
+    com->queue = queue;
+    com->queue_alloc = alloc;
+    com->queue_start = 0;
+    }
+  
+  com->queue[(com->queue_start + com->queue_len) % com->queue_alloc] = p;
+  com->queue_len++;
+  com->queue_bytes += p->size;
+  priv->queue_bytes += p->size;
+
+  if(com->trace)
+    bgen_trace_queue(com->trace);
+
+  if(com->queue_len > com->queue_len_max)
+    com->queue_len_max = com->queue_len;
+  if(com->queue_bytes > com->queue_bytes_max)
+    com->queue_bytes_max = com->queue_bytes;
+  }
+
+static int queue_write(ffmpeg_priv_t * priv, bg_ffmpeg_stream_common_t * com)
+  {
+  int result;
+  gavl_time_t t, io_time;
+  AVPacket * p = com->queue[com->queue_start];
+
+  com->queue_start = (com->queue_start + 1) % com->queue_alloc;
+  com->queue_len--;
+  com->queue_bytes -= p->size;
+  priv->queue_bytes -= p->size;
+
+  bgen_stats_lock(&priv->perf);
+  priv->perf.frames++;
+  bgen_stats_unlock(&priv->perf);
+  
+  t = bgen_stats_time();
+  io_time = priv->perf.io_time;
+  
+  result = av_write_frame(priv->ctx, p);
+
+  BGEN_PROBE_PAGE_OUT(priv->ctx->oformat->name, com->stream->index,
+                      p->pts, p->size, 1);
+  av_packet_free(&p);
+
+  /* Bytes can still be in the AVIO buffer here */
+  if(com->trace)
+    bgen_trace_write(com->trace, 1);
+
+  /* av_write_frame() calls io_write() */
+  bgen_stats_add_time(&priv->perf, t, &priv->perf.mux_time);
+  bgen_stats_lock(&priv->perf);
+  priv->perf.mux_time -= priv->perf.io_time - io_time;
+  bgen_stats_unlock(&priv->perf);
+
+  if(result < 0)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "av_write_frame failed: %s", av_err2str(result));
+    priv->got_error = 1;
+    return 0;
+    }
+  bgen_stats_lock(&priv->perf);
+  priv->perf.packets++;
+  bgen_stats_unlock(&priv->perf);
+  return 1;
+  }
+
+/* Return the stream with the earliest packet or NULL if all queues are empty.
+   complete is set if all streams have packets queued, delta is the time
+   span of the queued packets */
+
+static bg_ffmpeg_stream_common_t * queue_head(ffmpeg_priv_t * priv,
+                                              int * complete, int64_t * delta)
+  {
+  int i;
+  int64_t t;
+  int64_t min_time = 0;
+  int64_t max_time = 0;
+  bg_ffmpeg_stream_common_t * ret = NULL;
+
+  *complete = 1;
+  
+  for(i = 0; i < priv->num_streams; i++)
+    {
+    bg_ffmpeg_stream_common_t * com = priv->streams[i];
+    
+    if(!com->queue_len)
+      {
+      *complete = 0;
+      continue;
+      }
+
+    t = packet_time(com, 0);
+    if(!ret || (t < min_time))
+      {
+      ret = com;
+      min_time = t;
+      }
+    
+    t = packet_time(com, com->queue_len - 1);
+    if(t > max_time)
+      max_time = t;
+    }
+  
+  *delta = ret ? max_time - min_time : 0;
+  return ret;
+  }
+
+static void log_queue_overflow(ffmpeg_priv_t * priv, int level)
+  {
+  int i;
+
+  gavl_log(level, LOG_DOMAIN,
+           "Interleaving queue exceeds %"PRId64" bytes", priv->max_queue_bytes);
+  
+  for(i = 0; i < priv->num_streams; i++)
+    {
+    if(!priv->streams[i]->queue_len)
+      gavl_log(level, LOG_DOMAIN, "Stream %d has no packets queued", i);
+    }
+  }
+
+/* Live output: A stream, which is late, holds back the others
+   for no more than this (in ms) */
+#define LIVE_INTERLEAVE_DELTA 100
+
+/* Write out queued packets. If force is set, all queues are emptied */
+
+static int flush_queues(ffmpeg_priv_t * priv, int force)
+  {
+  int complete;
+  int64_t delta;
+  int max_delta = priv->max_interleave_delta;
+  bg_ffmpeg_stream_common_t * com;
+
+  if(priv->live && (!max_delta || (max_delta > LIVE_INTERLEAVE_DELTA)))
+    max_delta = LIVE_INTERLEAVE_DELTA;
+
+  if(!force && priv->max_queue_bytes && (priv->queue_bytes > priv->max_queue_bytes))
+    {
+    if(priv->queue_overflow == QUEUE_OVERFLOW_ERROR)
+      {
+      log_queue_overflow(priv, GAVL_LOG_ERROR);
+      priv->got_error = 1;
+      return 0;
+      }
+    else if(!priv->queue_overflowed)
+      log_queue_overflow(priv, GAVL_LOG_WARNING);
+    priv->queue_overflowed = 1;
+    }
+  
+  while((com = queue_head(priv, &complete, &delta)))
+    {
+    if(!complete && !force)
+      {
+      if((!max_delta || (delta <= (int64_t)max_delta * 1000)) &&
+         (!priv->max_queue_bytes || (priv->queue_bytes <= priv->max_queue_bytes)))
+        break;
+      com->forced_writes++;
+      }
+    if(!queue_write(priv, com))
+      return 0;
+    }
+  return 1;
+  }
+
+static void dump_queue_stats(ffmpeg_priv_t * priv)
+  {
+  int i;
+  int level = priv->queue_overflowed ? GAVL_LOG_INFO : GAVL_LOG_DEBUG;
+  
+  for(i = 0; i < priv->num_streams; i++)
+    {
+    bg_ffmpeg_stream_common_t * com = priv->streams[i];
+    gavl_log(level, LOG_DOMAIN,
+             "Stream %d: %"PRId64" packets, max queue: %d packets, %"PRId64" bytes, %"PRId64" forced writes",
+             i, com->num_packets, com->queue_len_max, com->queue_bytes_max, com->forced_writes);
+    }
+  }
+
+static void free_queue(bg_ffmpeg_stream_common_t * com)
+  {
+  while(com->queue_len)
+    {
+    av_packet_free(&com->queue[com->queue_start]);
+    com->queue_start = (com->queue_start + 1) % com->queue_alloc;
+    com->queue_len--;
+    }
+  if(com->queue)
+    {
+    free(com->queue);
+    com->queue = NULL;
+    }
+  }
+
+static void count_packet(bg_ffmpeg_stream_common_t * com)
+  {
+  gavl_time_t end_time;
+  
+  com->num_packets++;
+  if(com->pkt->flags & AV_PKT_FLAG_KEY)
+    com->num_keyframes++;
+
+  end_time = av_rescale_q(com->pkt->pts + com->pkt->duration,
+                          com->stream->time_base, AV_TIME_BASE_Q);
+  if(end_time > com->end_time)
+    com->end_time = end_time;
+  }
+
+/* Pass a packet (NULL for flushing) through the bitstream filter
+   and queue the output */
+
+static int filter_packet(ffmpeg_priv_t * priv,
+                         bg_ffmpeg_stream_common_t * com,
+                         AVPacket * p)
+  {
+  int result;
+  
+  result = av_bsf_send_packet(com->bsf, p);
+  av_packet_free(&p);
+
+  if(result < 0)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "av_bsf_send_packet failed: %s",
+             av_err2str(result));
+    priv->got_error = 1;
+    return 0;
+    }
+
+  while(1)
+    {
+    if(!(p = av_packet_alloc()))
+      {
+      priv->got_error = 1;
+      return 0;
+      }
+    
+    result = av_bsf_receive_packet(com->bsf, p);
+    
+    if((result == AVERROR(EAGAIN)) || (result == AVERROR_EOF))
+      {
+      av_packet_free(&p);
+      break;
+      }
+    else if(result < 0)
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "av_bsf_receive_packet failed: %s",
+               av_err2str(result));
+      av_packet_free(&p);
+      priv->got_error = 1;
+      return 0;
+      }
+    p->stream_index = com->stream->index;
+    queue_push(priv, com, p);
+    }
+  return 1;
+  }
+
+/* Queue com->pkt and write out what can be written */
+
+static gavl_sink_status_t write_packet(ffmpeg_priv_t * priv,
+                                       bg_ffmpeg_stream_common_t * com)
+  {
+  AVPacket * p;
+  
+  count_packet(com);
+
+  /* Copies the data, the gavl packet will be reused */
+  p = av_packet_clone(com->pkt);
+  com->pkt->data = NULL;
+  com->pkt->size = 0;
+
+  if(!p)
+    {
+    priv->got_error = 1;
+    return GAVL_SINK_ERROR;
+    }
+
+  if(com->bsf)
+    {
+    if(!filter_packet(priv, com, p))
+      return GAVL_SINK_ERROR;
+    }
+  else
+    queue_push(priv, com, p);
+  
+  if(!flush_queues(priv, 0))
+    return GAVL_SINK_ERROR;
+  
+  return GAVL_SINK_OK;
+  }
+
 static gavl_sink_status_t
 write_text_packet_func(void * data, gavl_packet_t * p)
   {
@@ -445,14 +1037,8 @@ write_text_packet_func(void * data, gavl_packet_t * p)
   //  pkt.convergence_duration = pkt.duration;
   st->com.pkt->dts = st->com.pkt->pts;
   st->com.pkt->stream_index = st->com.stream->index;
-  
-  if(av_interleaved_write_frame(priv->ctx, st->com.pkt) != 0)
-    {
-    priv->got_error = 1;
-    return GAVL_SINK_ERROR;
-    }
-  st->com.pkt->data = NULL;
-  return GAVL_SINK_OK;
+
+  return write_packet(priv, &st->com);
   }
 
 int bg_ffmpeg_add_text_stream(void * data,
@@ -624,21 +1210,14 @@ write_video_packet_func(void * priv, gavl_packet_t * packet)
     st->com.pkt->flags &= ~AV_PKT_FLAG_KEY;
   
   st->com.pkt->stream_index= st->com.stream->index;
-  
+
   /* write the compressed frame in the media file */
-  if(av_interleaved_write_frame(f->ctx, st->com.pkt) != 0)
-    {
-    f->got_error = 1;
-    return GAVL_SINK_ERROR;
-    }
-  st->com.pkt->data = NULL;
-  return GAVL_SINK_OK;
+  return write_packet(f, &st->com);
   }
 
 static gavl_sink_status_t
 write_audio_packet_func(void * data, gavl_packet_t * packet)
   {
-  AVPacket pkt;
   ffmpeg_priv_t * f;
   bg_ffmpeg_audio_stream_t * st = data;
   AVRational time_base;
@@ -666,7 +1245,7 @@ write_audio_packet_func(void * data, gavl_packet_t * packet)
                                       time_base,
                                       st->com.stream->time_base);
   
-  st->com.pkt->dts = pkt.pts;
+  st->com.pkt->dts = st->com.pkt->pts;
 
   if(st->com.ci.flags & GAVL_COMPRESSION_SBR)
     {
@@ -677,31 +1256,100 @@ write_audio_packet_func(void * data, gavl_packet_t * packet)
   
   st->com.pkt->flags |= AV_PKT_FLAG_KEY;
   st->com.pkt->stream_index= st->com.stream->index;
-  
+
   /* write the compressed frame in the media file */
-  if(av_interleaved_write_frame(f->ctx, &pkt) != 0)
+  return write_packet(f, &st->com);
+  }
+
+
+/*
+ *  Bitstream filters for compressed streams, which come in another
+ *  syntax than the container wants.
+ */
+
+static int wants_annex_b(ffmpeg_priv_t * priv)
+  {
+  if(priv->format->flags & FLAG_ANNEX_B)
+    return 1;
+  if(!strcmp(priv->format->short_name, "hls") &&
+     (priv->segment_type == SEGMENT_MPEGTS))
+    return 1;
+  return 0;
+  }
+
+static const char * get_bsf_name(ffmpeg_priv_t * priv,
+                                 const gavl_compression_info_t * ci)
+  {
+  switch(bg_codec_id_gavl_2_ffmpeg(ci->id))
     {
-    f->got_error = 1;
-    return GAVL_SINK_ERROR;
+    case AV_CODEC_ID_AAC:
+      /* No AudioSpecificConfig means ADTS headers in the packets */
+      if(!wants_annex_b(priv) && !ci->codec_header.len)
+        return "aac_adtstoasc";
+      break;
+    case AV_CODEC_ID_H264:
+      /* avcC header means length prefixed NAL units */
+      if(wants_annex_b(priv) && ci->codec_header.len &&
+         (ci->codec_header.buf[0] == 1))
+        return "h264_mp4toannexb";
+      break;
+    case AV_CODEC_ID_VP9:
+      /* Hidden frames might come as separate packets */
+      return "vp9_superframe";
+    default:
+      break;
     }
-  st->com.pkt->data = NULL;
-  return GAVL_SINK_OK;
+  return NULL;
   }
 
-
-static int open_audio_encoder(bg_ffmpeg_audio_stream_t * st)
+static int init_bsf(ffmpeg_priv_t * priv, bg_ffmpeg_stream_common_t * com)
   {
-  st->com.psink = gavl_packet_sink_create(NULL, write_audio_packet_func, st);
+  int result;
+  const AVBitStreamFilter * filter;
+  const char * name;
+
+  if(!(name = get_bsf_name(priv, &com->ci)))
+    return 1;
   
-  if(st->com.flags & STREAM_IS_COMPRESSED)
+  if(!(filter = av_bsf_get_by_name(name)) ||
+     (av_bsf_alloc(filter, &com->bsf) < 0))
     {
-    bg_ffmpeg_set_audio_format_params(st->com.stream->codecpar,
-                                      &st->format);
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Cannot create bitstream filter %s", name);
+    return 0;
+    }
 
-    if(st->com.ci.flags & GAVL_COMPRESSION_SBR)
-      st->com.stream->codecpar->sample_rate /= 2;
-    
-    return 1;
+  avcodec_parameters_copy(com->bsf->par_in, com->stream->codecpar);
+  com->bsf->time_base_in = com->stream->time_base;
+  
+  if((result = av_bsf_init(com->bsf)) < 0)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Initializing bitstream filter %s failed: %s",
+             name, av_err2str(result));
+    av_bsf_free(&com->bsf);
+    return 0;
+    }
+
+  /* The filter might have changed the extradata */
+  avcodec_parameters_copy(com->stream->codecpar, com->bsf->par_out);
+
+  gavl_log(GAVL_LOG_INFO, LOG_DOMAIN, "Stream %d: Applying bitstream filter %s",
+           com->stream->index, name);
+  return 1;
+  }
+
+static int open_audio_encoder(bg_ffmpeg_audio_stream_t * st)
+  {
+  st->com.psink = gavl_packet_sink_create(NULL, write_audio_packet_func, st);
+  
+  if(st->com.flags & STREAM_IS_COMPRESSED)
+    {
+    bg_ffmpeg_set_audio_format_params(st->com.stream->codecpar,
+                                      &st->format);
+
+    if(st->com.ci.flags & GAVL_COMPRESSION_SBR)
+      st->com.stream->codecpar->sample_rate /= 2;
+    
+    return init_bsf(st->com.ffmpeg, &st->com);
     }
   st->sink = bg_ffmpeg_codec_open_audio(st->com.codec, &st->com.ci, &st->format, NULL);
   if(!st->sink)
@@ -741,7 +1389,7 @@ static int open_video_encoder(bg_ffmpeg_video_stream_t * st)
     st->com.stream->sample_aspect_ratio.num = st->com.stream->codecpar->sample_aspect_ratio.num;
     st->com.stream->sample_aspect_ratio.den = st->com.stream->codecpar->sample_aspect_ratio.den;
     
-    return 1;
+    return init_bsf(st->com.ffmpeg, &st->com);
     }
 
 
@@ -765,22 +1413,557 @@ static int open_video_encoder(bg_ffmpeg_video_stream_t * st)
   return 1;
   }
 
-#define IO_BUFFER_SIZE 2048 // Too large values increase the latency
+/*
+ *  I/O policy: Seekable outputs get a large buffer to keep the number of
+ *  write calls low. Pipes and live streams get a small buffer, which is
+ *  flushed after each packet so we don't add latency.
+ */
+
+#define IO_BUFFER_SIZE_FILE (1024*1024)
+#define IO_BUFFER_SIZE_LIVE 2048
 
 static int io_write(void * opaque, uint8_t * buf, int size)
   {
-  return gavf_io_write_data(opaque, buf, size);
+  int result;
+  gavl_time_t t;
+  ffmpeg_priv_t * priv = opaque;
+
+  BGEN_PROBE_IO_START(priv->ctx->oformat->name, -1, size);
+  t = bgen_stats_time();
+  result = gavf_io_write_data(priv->io, buf, size);
+  bgen_stats_add_time(&priv->perf, t, &priv->perf.io_time);
+  BGEN_PROBE_IO_DONE(priv->ctx->oformat->name, -1, size);
+
+  bgen_stats_lock(&priv->perf);
+  priv->perf.write_calls++;
+  priv->perf.bytes += size;
+  bgen_stats_unlock(&priv->perf);
+  return result;
   }
 
 static int64_t io_seek(void * opaque, int64_t off, int whence)
   {
-  return gavf_io_seek(opaque, off, whence);
+  ffmpeg_priv_t * priv = opaque;
+
+  if(whence & AVSEEK_SIZE)
+    return -1;
+  
+  return gavf_io_seek(priv->io, off, whence & ~AVSEEK_FORCE);
+  }
+
+static int init_io(ffmpeg_priv_t * priv)
+  {
+  int buffer_size;
+  int can_seek = gavf_io_can_seek(priv->io);
+
+  if(priv->io_buffer_size > 0)
+    buffer_size = priv->io_buffer_size;
+  else if(priv->live)
+    buffer_size = IO_BUFFER_SIZE_LIVE;
+  else
+    buffer_size = IO_BUFFER_SIZE_FILE;
+
+  /* Write out each packet as soon as it's muxed */
+  if(priv->live)
+    av_dict_set(&priv->format_options, "flush_packets", "1", 0);
+  
+  priv->ctx->pb = avio_alloc_context(av_malloc(buffer_size),
+                                     buffer_size,
+                                     1, // write_flag
+                                     priv,
+                                     NULL,
+                                     io_write,
+                                     can_seek ? io_seek : NULL);
+  if(!priv->ctx->pb)
+    return 0;
+  
+  return 1;
+  }
+
+static int init_fragments(ffmpeg_priv_t * priv)
+  {
+  int can_seek;
+  
+  if(!(priv->format->flags & FLAG_FRAGMENT))
+    return 0;
+
+  can_seek = gavf_io_can_seek(priv->io);
+  
+  if((priv->fragment_mode == FRAGMENT_AUTO) && can_seek)
+    return 0;
+
+  av_dict_set(&priv->format_options, "movflags",
+              "+empty_moov+default_base_moof", AV_DICT_APPEND);
+
+  if(priv->fragment_mode == FRAGMENT_DURATION)
+    av_dict_set_int(&priv->format_options, "frag_duration",
+                    (int64_t)priv->fragment_duration * 1000, 0);
+  else
+    av_dict_set(&priv->format_options, "movflags", "+frag_keyframe", AV_DICT_APPEND);
+
+  if(priv->fragment_size > 0)
+    av_dict_set_int(&priv->format_options, "frag_size", priv->fragment_size, 0);
+
+  if(priv->fragment_index)
+    {
+    if(can_seek)
+      av_dict_set(&priv->format_options, "movflags", "+global_sidx", AV_DICT_APPEND);
+    }
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+  else
+    av_dict_set(&priv->format_options, "movflags", "+skip_trailer", AV_DICT_APPEND);
+#endif
+  
+  gavl_log(GAVL_LOG_INFO, LOG_DOMAIN, "Writing fragmented %s", priv->format->name);
+  return 1;
+  }
+
+/*
+ *  HLS: libavformat cuts the segments at keyframes and writes the
+ *  segments and the playlist to temporary files, which are renamed
+ *  when they are complete. The files are opened through io_open(), so
+ *  we can tell the callbacks about each of them.
+ */
+
+#define TEMP_SUFFIX ".tmp"
+
+/* Segments of live playlists, which are remembered beyond the playlist
+   size. libavformat keeps one more for clients still loading it. */
+#define SEGMENT_FILES_MARGIN 4
+
+static int add_segment_file(ffmpeg_priv_t * priv, const char * url)
+  {
+  int i;
+  int first;
+  int len;
+  int suffix_len = strlen(TEMP_SUFFIX);
+  char * filename;
+
+  /* The playlist is already known */
+  len = strlen(priv->ctx->url);
+  if(!strncmp(url, priv->ctx->url, len) &&
+     (!url[len] || !strcmp(url + len, TEMP_SUFFIX)))
+    return 1;
+
+  filename = gavl_strdup(url);
+  len = strlen(filename);
+  if((len > suffix_len) && !strcmp(filename + len - suffix_len, TEMP_SUFFIX))
+    filename[len - suffix_len] = '\0';
+  
+  for(i = priv->num_segment_files - 1; i >= 0; i--)
+    {
+    if(!strcmp(priv->segment_files[i], filename))
+      {
+      free(filename);
+      return 1;
+      }
+    }
+  
+  if(!bg_encoder_cb_create_output_file(priv->cb, filename))
+    {
+    free(filename);
+    return 0;
+    }
+
+  /* libavformat deletes the old segments of live playlists without
+     telling us, so forget them as well. The fMP4 init segment (always
+     the first file) is never deleted. */
+  if(priv->playlist_live)
+    {
+    first = (priv->segment_type == SEGMENT_FMP4) ? 1 : 0;
+    if(priv->num_segment_files - first >=
+       priv->playlist_size + SEGMENT_FILES_MARGIN)
+      {
+      free(priv->segment_files[first]);
+      memmove(priv->segment_files + first, priv->segment_files + first + 1,
+              (priv->num_segment_files - first - 1) *
+              sizeof(*priv->segment_files));
+      priv->num_segment_files--;
+      }
+    }
+  
+  if(priv->num_segment_files == priv->segment_files_alloc)
+    {
+    priv->segment_files_alloc += 64;
+    priv->segment_files = realloc(priv->segment_files,
+                                  priv->segment_files_alloc *
+                                  sizeof(*priv->segment_files));
+    }
+  priv->segment_files[priv->num_segment_files++] = filename;
+  return 1;
+  }
+
+static int segment_io_open(struct AVFormatContext * s, AVIOContext ** pb,
+                           const char * url, int flags, AVDictionary ** options)
+  {
+  ffmpeg_priv_t * priv = s->opaque;
+  
+  if((flags & AVIO_FLAG_WRITE) && !add_segment_file(priv, url))
+    return AVERROR(EPERM);
+  
+  return priv->io_open(s, pb, url, flags, options);
+  }
+
+static void free_segment_files(ffmpeg_priv_t * priv, int do_delete)
+  {
+  int i;
+  char * tmp_string;
+  
+  for(i = 0; i < priv->num_segment_files; i++)
+    {
+    if(do_delete)
+      {
+      /* Live playlists delete old segments themselves */
+      remove(priv->segment_files[i]);
+      tmp_string = bg_sprintf("%s"TEMP_SUFFIX, priv->segment_files[i]);
+      remove(tmp_string);
+      free(tmp_string);
+      }
+    free(priv->segment_files[i]);
+    }
+  if(priv->segment_files)
+    free(priv->segment_files);
+  
+  priv->segment_files = NULL;
+  priv->num_segment_files = 0;
+  priv->segment_files_alloc = 0;
+  }
+
+static void init_segments(ffmpeg_priv_t * priv)
+  {
+  char * base;
+  char * pos;
+  char * tmp_string;
+  
+  if(strcmp(priv->format->short_name, "hls"))
+    return;
+
+  priv->ctx->opaque = priv;
+  priv->io_open = priv->ctx->io_open;
+  priv->ctx->io_open = segment_io_open;
+  
+  base = gavl_strdup(priv->ctx->url);
+  if((pos = strrchr(base, '.')))
+    *pos = '\0';
+  
+  av_dict_set_int(&priv->format_options, "hls_time", priv->segment_duration, 0);
+  av_dict_set(&priv->format_options, "hls_flags", "+temp_file+independent_segments",
+              AV_DICT_APPEND);
+  
+  if(priv->segment_type == SEGMENT_FMP4)
+    {
+    av_dict_set(&priv->format_options, "hls_segment_type", "fmp4", 0);
+
+    /* Relative to the playlist directory */
+    if((pos = strrchr(base, '/')))
+      pos++;
+    else
+      pos = base;
+    
+    tmp_string = bg_sprintf("%s_init.mp4", pos);
+    av_dict_set(&priv->format_options, "hls_fmp4_init_filename", tmp_string, 0);
+    free(tmp_string);
+    
+    tmp_string = bg_sprintf("%s_%%05d.m4s", base);
+    }
+  else
+    tmp_string = bg_sprintf("%s_%%05d.ts", base);
+
+  av_dict_set(&priv->format_options, "hls_segment_filename", tmp_string, 0);
+  free(tmp_string);
+  
+  if(priv->playlist_live)
+    {
+    av_dict_set_int(&priv->format_options, "hls_list_size", priv->playlist_size, 0);
+    av_dict_set(&priv->format_options, "hls_flags", "+delete_segments", AV_DICT_APPEND);
+    }
+  else
+    {
+    av_dict_set_int(&priv->format_options, "hls_list_size", 0, 0);
+    av_dict_set(&priv->format_options, "hls_playlist_type", "vod", 0);
+    }
+  
+  free(base);
+  }
+
+/*
+ *  Index reservation: Instead of rewriting the whole file to move the
+ *  index to the front (faststart), we reserve space for it when
+ *  writing the header. The sizes below are upper bounds, so the same
+ *  calculation can be used for the estimation at the start and for the
+ *  check before the trailer is written. Everything, which has a variable
+ *  size (metadata, chapter titles, codec headers, cover art) is added with
+ *  its actual size. If we cannot bound something, the index is written at
+ *  the end.
+ */
+
+#define MOOV_BYTES_BASE       4096 // ftyp, mvhd, iods, meta + hdlr, chpl header
+#define MOOV_BYTES_PER_TRACK  1024 // tkhd, edts, tref, mdia, stsd without extradata etc.
+#define MOOV_BYTES_PER_SAMPLE 41   // stsz + stts + ctts + sdtp (worst case)
+                                   // + stsc + co64 (one chunk per sample)
+#define MOOV_BYTES_PER_SYNC   4    // stss
+#define MOOV_BYTES_PER_TAG    64   // ilst item + data atom, freeform: mean + name
+#define MOOV_BYTES_PER_CHAPTER 9   // chpl entry without the title
+
+#define CUES_BYTES_BASE       1024
+#define CUES_BYTES_PER_POINT  40   // CuePoint with one CueTrackPositions
+
+#define INDEX_MARGIN          1.1
+
+static int is_mp4(ffmpeg_priv_t * priv)
+  {
+  return !strcmp(priv->format->short_name, "mp4");
+  }
+
+static int gop_size(bg_ffmpeg_stream_common_t * com)
+  {
+  const AVCodecDescriptor * desc;
+
+  if((desc = avcodec_descriptor_get(com->stream->codecpar->codec_id)) &&
+     (desc->props & AV_CODEC_PROP_INTRA_ONLY))
+    return 1;
+
+  if(com->codec && (com->codec->avctx->gop_size > 0))
+    return com->codec->avctx->gop_size;
+
+  return 12;
+  }
+
+static int64_t get_dict_size(AVDictionary * dict)
+  {
+  int64_t ret = 0;
+  AVDictionaryEntry * tag = NULL;
+
+  while((tag = av_dict_get(dict, "", tag, AV_DICT_IGNORE_SUFFIX)))
+    ret += MOOV_BYTES_PER_TAG + strlen(tag->key) + strlen(tag->value);
+  return ret;
+  }
+
+/* Sizes of the moov atom, which don't depend on the number of packets:
+   Tracks with their codec headers, metadata, chapters and cover art.
+   Returns -1 if there is no upper bound */
+
+static int64_t get_moov_fixed_size(ffmpeg_priv_t * priv)
+  {
+  int i;
+  int64_t ret;
+  AVStream * st;
+  AVDictionaryEntry * title;
+
+  ret = MOOV_BYTES_BASE + get_dict_size(priv->ctx->metadata);
+
+  for(i = 0; i < priv->ctx->nb_streams; i++)
+    {
+    st = priv->ctx->streams[i];
+
+    ret += MOOV_BYTES_PER_TRACK + st->codecpar->extradata_size +
+      get_dict_size(st->metadata);
+
+    /* Cover art goes into the covr atom of the ilst */
+    if(st->disposition & AV_DISPOSITION_ATTACHED_PIC)
+      {
+      if(st->attached_pic.size <= 0)
+        return -1;
+      ret += MOOV_BYTES_PER_TAG + st->attached_pic.size;
+      }
+    }
+
+  /* Chapters are written twice: As chpl atom (title up to 255 bytes) and
+     as QuickTime text track with one sample per chapter */
+  if(priv->ctx->nb_chapters)
+    {
+    ret += MOOV_BYTES_PER_TRACK;
+    for(i = 0; i < priv->ctx->nb_chapters; i++)
+      {
+      ret += MOOV_BYTES_PER_CHAPTER + MOOV_BYTES_PER_SAMPLE;
+      
+      if((title = av_dict_get(priv->ctx->chapters[i]->metadata, "title", NULL, 0)))
+        ret += strlen(title->value);
+      }
+    }
+  return ret;
+  }
+
+/* Estimate the index size from the packet rates and the duration hint */
+
+static int64_t predict_index_size(ffmpeg_priv_t * priv)
+  {
+  int i;
+  double seconds;
+  double samples = 0.0;
+  double syncs = 0.0;
+  double cues = 0.0;
+  double packets;
+  int64_t ret;
+  int64_t fixed = 0;
+
+  if(is_mp4(priv) && ((fixed = get_moov_fixed_size(priv)) < 0))
+    return -1;
+  
+  seconds = gavl_time_to_seconds(priv->duration);
+  
+  for(i = 0; i < priv->num_audio_streams; i++)
+    {
+    bg_ffmpeg_audio_stream_t * st = &priv->audio_streams[i];
+    int samples_per_frame = st->format.samples_per_frame;
+
+    if(samples_per_frame <= 0)
+      samples_per_frame = 1024;
+    
+    samples += seconds * (double)st->format.samplerate / (double)samples_per_frame;
+    }
+  
+  for(i = 0; i < priv->num_video_streams; i++)
+    {
+    bg_ffmpeg_video_stream_t * st = &priv->video_streams[i];
+
+    if((st->format.framerate_mode == GAVL_FRAMERATE_CONSTANT) &&
+       (st->format.frame_duration > 0))
+      packets = seconds * (double)st->format.timescale / (double)st->format.frame_duration;
+    else
+      packets = seconds * 60.0; // Assume the worst
+
+    samples += packets;
+    syncs += packets / gop_size(&st->com);
+    }
+
+  samples += seconds * priv->num_text_streams;
+
+  /* Matroska writes cues for the video keyframes or
+     for the clusters if there is no video */
+  if(priv->num_video_streams)
+    cues = syncs;
+  else
+    cues = seconds;
+  
+  if(is_mp4(priv))
+    ret = fixed + MOOV_BYTES_PER_SAMPLE * samples + MOOV_BYTES_PER_SYNC * syncs;
+  else
+    ret = CUES_BYTES_BASE + CUES_BYTES_PER_POINT * cues;
+
+  return ret * INDEX_MARGIN;
+  }
+
+/* Upper bound of the index size from what we actually wrote,
+   -1 if there is none */
+
+static int64_t get_index_size(ffmpeg_priv_t * priv)
+  {
+  int i;
+  int64_t samples = 0;
+  int64_t syncs = 0;
+  int64_t cues;
+  int64_t fixed = 0;
+  gavl_time_t end_time = 0;
+
+  if(is_mp4(priv) && ((fixed = get_moov_fixed_size(priv)) < 0))
+    return -1;
+
+  for(i = 0; i < priv->num_audio_streams; i++)
+    {
+    samples += priv->audio_streams[i].com.num_packets;
+    if(priv->audio_streams[i].com.end_time > end_time)
+      end_time = priv->audio_streams[i].com.end_time;
+    }
+  for(i = 0; i < priv->num_video_streams; i++)
+    {
+    samples += priv->video_streams[i].com.num_packets;
+    syncs   += priv->video_streams[i].com.num_keyframes;
+    }
+  for(i = 0; i < priv->num_text_streams; i++)
+    samples += priv->text_streams[i].com.num_packets;
+
+  if(priv->num_video_streams)
+    cues = syncs;
+  else
+    cues = gavl_time_to_seconds(end_time) + 1;
+  
+  if(is_mp4(priv))
+    return fixed + MOOV_BYTES_PER_SAMPLE * samples + MOOV_BYTES_PER_SYNC * syncs;
+  else
+    return CUES_BYTES_BASE + CUES_BYTES_PER_POINT * cues;
+  }
+
+static void init_index(ffmpeg_priv_t * priv)
+  {
+  priv->index_reserved = 0;
+  
+  if(!priv->reserve_index || !priv->io ||
+     !(priv->format->flags & FLAG_RESERVE_INDEX) ||
+     !gavf_io_can_seek(priv->io))
+    return;
+  
+  if(priv->duration == GAVL_TIME_UNDEFINED)
+    {
+    gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
+             "Not reserving index space: Duration unknown");
+    return;
+    }
+  
+  if((priv->index_reserved = predict_index_size(priv)) < 0)
+    {
+    priv->index_reserved = 0;
+    gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
+             "Not reserving index space: Size cannot be bounded");
+    return;
+    }
+  
+  if(is_mp4(priv))
+    av_dict_set_int(&priv->format_options, "moov_size", priv->index_reserved, 0);
+  else
+    av_dict_set_int(&priv->format_options, "reserve_index_space", priv->index_reserved, 0);
+  
+  gavl_log(GAVL_LOG_INFO, LOG_DOMAIN, "Reserving %"PRId64" bytes for the index",
+           priv->index_reserved);
+  }
+
+/* Called before the trailer is written: If the reserved space is too small,
+   fall back to writing the index at the end */
+
+static void finalize_index(ffmpeg_priv_t * priv)
+  {
+  int64_t size;
+  int64_t pos;
+  
+  if(!priv->index_reserved)
+    return;
+
+  size = get_index_size(priv);
+  
+  if((size >= 0) && (size <= priv->index_reserved))
+    return;
+
+  if(size < 0)
+    gavl_log(GAVL_LOG_WARNING, LOG_DOMAIN,
+             "Index size cannot be bounded, writing index at the end");
+  else
+    gavl_log(GAVL_LOG_WARNING, LOG_DOMAIN,
+             "Reserved index space too small (%"PRId64" < %"PRId64" bytes), writing index at the end",
+             priv->index_reserved, size);
+
+  if(is_mp4(priv))
+    {
+    /* The reserved space is left empty by libavformat. Turn it into a free atom */
+    pos = avio_tell(priv->ctx->pb);
+    avio_seek(priv->ctx->pb, priv->index_pos, SEEK_SET);
+    avio_wb32(priv->ctx->pb, priv->index_reserved);
+    avio_write(priv->ctx->pb, (const uint8_t*)"free", 4);
+    avio_seek(priv->ctx->pb, pos, SEEK_SET);
+    
+    av_opt_set_int(priv->ctx->priv_data, "moov_size", 0, 0);
+    }
+  else /* Leaves the reserved EBML Void element as it is */
+    av_opt_set_int(priv->ctx->priv_data, "reserve_index_space", 0, 0);
+  
+  priv->index_reserved = 0;
   }
 
 int bg_ffmpeg_start(void * data)
   {
   ffmpeg_priv_t * priv;
   int i;
+  int live_codec;
+  char label[32];
   priv = data;
   
 #if LIBAVFORMAT_VERSION_MAJOR < 54
@@ -792,15 +1975,32 @@ int bg_ffmpeg_start(void * data)
     }
 #endif
   
+  /* Live output: Non-seekable outputs of formats made for pipes.
+     init_io() chooses the buffer size and flushing from this. */
+  if(priv->ctx->oformat->flags & AVFMT_NOFILE)
+    priv->live = priv->playlist_live;
+  else
+    priv->live = !gavf_io_can_seek(priv->io) &&
+      (priv->format->flags & (FLAG_PIPE|FLAG_FRAGMENT));
+
+  /* A pipe alone doesn't change the encoded stream: Only live playlists
+     get low latency encoding unless the user asks for it */
+  live_codec = (priv->ctx->oformat->flags & AVFMT_NOFILE) &&
+    priv->playlist_live;
+  
   /* Open encoders */
   for(i = 0; i < priv->num_audio_streams; i++)
     {
+    if(priv->audio_streams[i].com.codec)
+      priv->audio_streams[i].com.codec->live = live_codec;
     if(!open_audio_encoder(&priv->audio_streams[i]))
       return 0;
     }
 
   for(i = 0; i < priv->num_video_streams; i++)
     {
+    if(priv->video_streams[i].com.codec)
+      priv->video_streams[i].com.codec->live = live_codec;
     if(!open_video_encoder(&priv->video_streams[i]))
       return 0;
     }
@@ -814,19 +2014,33 @@ int bg_ffmpeg_start(void * data)
 
     }
 
-  if(priv->io)
+  /* Streams in container order for the interleaver */
+  priv->num_streams = priv->ctx->nb_streams;
+  priv->streams = calloc(priv->num_streams, sizeof(*priv->streams));
+
+  for(i = 0; i < priv->num_audio_streams; i++)
+    priv->streams[priv->audio_streams[i].com.stream->index] = &priv->audio_streams[i].com;
+  for(i = 0; i < priv->num_video_streams; i++)
+    priv->streams[priv->video_streams[i].com.stream->index] = &priv->video_streams[i].com;
+  for(i = 0; i < priv->num_text_streams; i++)
+    priv->streams[priv->text_streams[i].com.stream->index] = &priv->text_streams[i].com;
+
+  for(i = 0; i < priv->num_streams; i++)
     {
-    priv->io_buffer = av_malloc(IO_BUFFER_SIZE);
-    priv->ctx->pb = avio_alloc_context(priv->io_buffer,
-                                       IO_BUFFER_SIZE,
-                                       1, // write_flag
-                                       priv->io,
-                                       NULL,
-                                       io_write,
-                                       gavf_io_can_seek(priv->io) ? io_seek : NULL);
+    snprintf(label, sizeof(label), "Stream %d", i);
+    priv->streams[i]->trace = bgen_trace_create(LOG_DOMAIN, label);
     }
-  else if(avio_open(&priv->ctx->pb, priv->ctx->url, AVIO_FLAG_WRITE) < 0)
+  
+  bgen_stats_init(&priv->perf, 0);
+  bgen_stats_register(&priv->perf, LOG_DOMAIN, "Multiplexer");
+  
+  if(!(priv->ctx->oformat->flags & AVFMT_NOFILE) && !init_io(priv))
     return 0;
+
+  init_segments(priv);
+
+  if(!init_fragments(priv))
+    init_index(priv);
   
 #if LIBAVFORMAT_VERSION_MAJOR < 54
   if(av_write_header(priv->ctx))
@@ -835,13 +2049,18 @@ int bg_ffmpeg_start(void * data)
     return 0;
     }
 #else
-  if(avformat_write_header(priv->ctx, NULL))
+  if(avformat_write_header(priv->ctx, &priv->format_options))
     {
     gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "avformat_write_header failed");
     return 0;
     }
 #endif
 
+  /* The MP4 muxer writes the reserved space followed by
+     the mdat header (16 bytes) */
+  if(priv->index_reserved && is_mp4(priv))
+    priv->index_pos = avio_tell(priv->ctx->pb) - priv->index_reserved - 16;
+
   priv->initialized = 1;
   return 1;
   }
@@ -880,6 +2099,13 @@ static void close_common(bg_ffmpeg_stream_common_t * com)
     bg_ffmpeg_codec_destroy(com->codec);
     com->codec = NULL;
     }
+  if(com->bsf)
+    av_bsf_free(&com->bsf);
+  if(com->trace)
+    {
+    bgen_trace_destroy(com->trace);
+    com->trace = NULL;
+    }
   gavl_compression_info_free(&com->ci);
   }
 
@@ -918,22 +2144,37 @@ int bg_ffmpeg_close(void * data, int do_delete)
 
     if(!(st->com.flags & STREAM_IS_COMPRESSED))
       bg_ffmpeg_codec_flush(st->com.codec);
+    else if(st->com.bsf)
+      filter_packet(priv, &st->com, NULL);
     }
   for(i = 0; i < priv->num_video_streams; i++)
     {
     bg_ffmpeg_video_stream_t * st = &priv->video_streams[i];
     if(!(st->com.flags & STREAM_IS_COMPRESSED))
       bg_ffmpeg_codec_flush(st->com.codec);
+    else if(st->com.bsf)
+      filter_packet(priv, &st->com, NULL);
     }
   
   if(priv->initialized)
     {
+    flush_queues(priv, 1);
+    dump_queue_stats(priv);
+    
+    finalize_index(priv);
     av_write_trailer(priv->ctx);
+    if(priv->ctx->pb)
+      avio_flush(priv->ctx->pb);
     
-    if(priv->io)
-      av_free(priv->ctx->pb);
-    else
-      avio_close(priv->ctx->pb);
+    bgen_stats_log(&priv->perf, LOG_DOMAIN, "Multiplexer");
+    bgen_stats_unregister(&priv->perf);
+    }
+
+  if(priv->ctx->pb)
+    {
+    /* The buffer might have been reallocated by libavformat */
+    av_freep(&priv->ctx->pb->buffer);
+    avio_context_free(&priv->ctx->pb);
     }
 
   // Close the encoders
@@ -942,6 +2183,7 @@ int bg_ffmpeg_close(void * data, int do_delete)
     {
     bg_ffmpeg_audio_stream_t * st = &priv->audio_streams[i];
     close_audio_encoder(priv, st);
+    free_queue(&st->com);
     if(st->com.psink)
       gavl_packet_sink_destroy(st->com.psink);
     if(st->com.pkt)
@@ -951,6 +2193,7 @@ int bg_ffmpeg_close(void * data, int do_delete)
     {
     bg_ffmpeg_video_stream_t * st = &priv->video_streams[i];
     close_video_encoder(priv, st);
+    free_queue(&st->com);
     if(st->com.psink)
       gavl_packet_sink_destroy(st->com.psink);
     if(st->com.pkt)
@@ -960,17 +2203,36 @@ int bg_ffmpeg_close(void * data, int do_delete)
     {
     bg_ffmpeg_text_stream_t * st = &priv->text_streams[i];
     close_text_encoder(priv, st);
+    free_queue(&st->com);
     if(st->com.psink)
       gavl_packet_sink_destroy(st->com.psink);
     if(st->com.pkt)
       av_packet_free(&st->com.pkt);
     }
   
-  if(do_delete && !priv->io)
-    remove(priv->ctx->url);
+  if(priv->io_priv)
+    {
+    gavf_io_destroy(priv->io_priv);
+    priv->io_priv = NULL;
+
+    if(do_delete && strcmp(priv->ctx->url, "pipe:"))
+      remove(priv->ctx->url);
+    }
+  else if(do_delete && (priv->ctx->oformat->flags & AVFMT_NOFILE))
+    remove(priv->ctx->url); // Playlist
+
+  free_segment_files(priv, do_delete);
+  priv->io = NULL;
+  
+  if(priv->format_options)
+    av_dict_free(&priv->format_options);
 
-  if(priv->io_buffer)
-    av_free(priv->io_buffer);
+  if(priv->streams)
+    {
+    free(priv->streams);
+    priv->streams = NULL;
+    }
+  priv->queue_overflowed = 0;
   
   avformat_free_context(priv->ctx);
   priv->ctx = NULL;
@@ -978,6 +2240,21 @@ int bg_ffmpeg_close(void * data, int do_delete)
   return 1;
   }
 
+/* Without the bitstream filter, the stream must be encoded */
+
+static int bsf_available(ffmpeg_priv_t * f, const gavl_compression_info_t * info)
+  {
+  const char * name;
+
+  if((name = get_bsf_name(f, info)) && !av_bsf_get_by_name(name))
+    {
+    gavl_log(GAVL_LOG_WARNING, LOG_DOMAIN,
+             "Bitstream filter %s not available in libavcodec", name);
+    return 0;
+    }
+  return 1;
+  }
+
 int bg_ffmpeg_writes_compressed_audio(void * priv,
                                       const gavl_audio_format_t * format,
                                       const gavl_compression_info_t * info)
@@ -992,7 +2269,7 @@ int bg_ffmpeg_writes_compressed_audio(void * priv,
   while(f->format->audio_codecs[i] != AV_CODEC_ID_NONE)
     {
     if(f->format->audio_codecs[i] == ffmpeg_id)
-      return 1;
+      return bsf_available(f, info);
     i++;
     }
   
@@ -1013,7 +2290,7 @@ int bg_ffmpeg_writes_compressed_video(void * priv,
   while(f->format->video_codecs[i] != AV_CODEC_ID_NONE)
     {
     if(f->format->video_codecs[i] == ffmpeg_id)
-      return 1;
+      return bsf_available(f, info);
     i++;
     }
   
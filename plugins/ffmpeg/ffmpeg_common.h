@@ -26,6 +26,8 @@
 #include <gmerlin/plugin.h>
 #include <gmerlin/pluginfuncs.h>
 
+#include <gmerlin_encoders.h>
+
 #ifdef HAVE_LIBAVCORE_AVCORE_H
 #include <libavcore/avcore.h>
 #endif
@@ -34,11 +36,18 @@
 #define guess_format(a, b, c) av_guess_format(a, b, c)
 #endif
 
+#if LIBAVCODEC_VERSION_MAJOR >= 59 // Not included by avcodec.h anymore
+#include <libavcodec/bsf.h>
+#endif
+
 
 #define FLAG_CONSTANT_FRAMERATE (1<<0)
 #define FLAG_INTRA_ONLY         (1<<1)
 #define FLAG_B_FRAMES           (1<<2)
 #define FLAG_PIPE               (1<<3) // Format can be written savely to pipes
+#define FLAG_FRAGMENT           (1<<4) // Format can be fragmented (written to pipes if fragmented)
+#define FLAG_RESERVE_INDEX      (1<<5) // Space for the index can be reserved at the start
+#define FLAG_ANNEX_B            (1<<6) // Elementary stream syntax (H.264 Annex B, ADTS)
 
 typedef struct
   {
@@ -116,6 +125,65 @@ bg_ffmpeg_get_codec_info(enum AVCodecID id, int type);
 
 typedef struct bg_ffmpeg_codec_context_s bg_ffmpeg_codec_context_t;
 
+/* Timing of a frame, which is passed along with the packet */
+
+typedef struct
+  {
+  int64_t pts;      // Codec timebase
+  int64_t duration; // Stream timescale
+  gavl_timecode_t timecode;
+  } bg_ffmpeg_frame_info_t;
+
+/* ptscache.c */
+
+typedef struct bg_ffmpeg_pts_cache_s bg_ffmpeg_pts_cache_t;
+
+bg_ffmpeg_pts_cache_t * bg_ffmpeg_pts_cache_create(int num_frames);
+void bg_ffmpeg_pts_cache_destroy(bg_ffmpeg_pts_cache_t * c);
+
+void bg_ffmpeg_pts_cache_push(bg_ffmpeg_pts_cache_t * c,
+                              const bg_ffmpeg_frame_info_t * info);
+
+int bg_ffmpeg_pts_cache_pop(bg_ffmpeg_pts_cache_t * c, int64_t pts,
+                            bg_ffmpeg_frame_info_t * ret);
+
+/* convert.c */
+
+typedef struct bg_ffmpeg_slicer_s bg_ffmpeg_slicer_t;
+
+/* parallel.c */
+
+typedef struct bg_ffmpeg_parallel_s bg_ffmpeg_parallel_t;
+
+typedef AVCodecContext * (*bg_ffmpeg_create_context_func)(void * data);
+typedef int (*bg_ffmpeg_put_packet_func)(void * data, AVPacket * pkt,
+                                         const bg_ffmpeg_frame_info_t * info);
+
+bg_ffmpeg_parallel_t *
+bg_ffmpeg_parallel_create(int num_workers,
+                          int chunk_frames,
+                          int overlap,
+                          bg_ffmpeg_create_context_func create_context,
+                          bg_ffmpeg_put_packet_func put_packet,
+                          void * data);
+
+int bg_ffmpeg_parallel_put_frame(bg_ffmpeg_parallel_t * p, AVFrame * f,
+                                 const bg_ffmpeg_frame_info_t * info);
+int bg_ffmpeg_parallel_flush(bg_ffmpeg_parallel_t * p);
+void bg_ffmpeg_parallel_destroy(bg_ffmpeg_parallel_t * p);
+
+/*
+ *  Refcounted AVFrame with a gavl frame pointing to its buffers.
+ *  A pool frame is free if the encoder holds no references to it.
+ */
+
+typedef struct
+  {
+  AVFrame * f;
+  gavl_audio_frame_t * af;
+  gavl_video_frame_t * vf;
+  } bg_ffmpeg_frame_t;
+
 struct bg_ffmpeg_codec_context_s
   {
   AVCodec * codec;
@@ -144,6 +212,35 @@ struct bg_ffmpeg_codec_context_s
   enum AVCodecID id;
 
   int flags;
+
+  /* Threading */
+  int live;         // Set by the format writer for live playlists
+  int latency;      // User override for live: 0: Auto, 1: Normal, 2: Low
+  int num_threads;  // Taken from the thread budget
+  int threads_registered;
+
+  /* Actual encoder delay in frames, measured in the serial video path */
+  int64_t frames_in;
+  int64_t packets_out;
+  int max_delay;
+
+  /* Performance counters, logged when flushing */
+  bgen_stats_t perf;
+  bgen_trace_t * trace;
+
+  /* Parallel contexts for intra-only codecs or chunks */
+  int num_contexts; // 0: Auto, 1: Off
+  int chunk_frames; // 0: Off
+  bg_ffmpeg_parallel_t * par;
+
+  /* Codec parameters as set by the user and options as passed to
+     avcodec_open2(), for setting up more contexts */
+  gavl_dictionary_t params;
+  AVDictionary * open_options;
+
+  /* Formats as passed to open, for detecting format changes */
+  gavl_audio_format_t open_afmt;
+  gavl_video_format_t open_vfmt;
   
   gavl_audio_format_t afmt;
   gavl_video_format_t vfmt;
@@ -154,27 +251,30 @@ struct bg_ffmpeg_codec_context_s
 
   AVFrame * frame;
 
-  /* Audio frame to encode */
-  gavl_audio_frame_t * aframe;
-  
-  /*
-   * Video frame to encode.
-   * Used only when we need to convert formats.
-   */
+  /* Frame pool */
+  bg_ffmpeg_frame_t ** pool;
+  int pool_size;
   
-  gavl_video_frame_t * vframe;
+  bg_ffmpeg_frame_t * pool_get; // Handed out by the get function
+  bg_ffmpeg_frame_t * pool_cur; // Collecting audio samples
   
   int64_t in_pts;
   int64_t out_pts;
 
   bg_encoder_framerate_t fr;
   
-  bg_encoder_pts_cache_t * pc;
+  bg_ffmpeg_pts_cache_t * pc;
+
+  /* Native PCM and G.711 encoding */
+  int pcm_bytes; // Per sample, 0: Use libavcodec
+  bg_ffmpeg_pcm_func pcm_encode;
+  gavl_buffer_t pcm_buf;
 
   /* Trivial pixelformat conversions because
      we are too lazy to support all variants in gavl */
   
   void (*convert_frame)(bg_ffmpeg_codec_context_t * ctx, gavl_video_frame_t * f);
+  bg_ffmpeg_slicer_t * slicer;
   
   };
 
@@ -227,6 +327,12 @@ void bg_ffmpeg_codec_set_packet_sink(bg_ffmpeg_codec_context_t * ctx,
 
 void bg_ffmpeg_codec_flush(bg_ffmpeg_codec_context_t * ctx);
 
+/* Flush the encoder and make it ready for the next clip with the same
+   format. Opening an initialized context again does this automatically
+   and reopens the encoder only if the format changed. */
+
+int bg_ffmpeg_codec_reset(bg_ffmpeg_codec_context_t * ctx);
+
 /* ffmpeg_common.c */
 
 typedef struct ffmpeg_priv_s ffmpeg_priv_t;
@@ -251,6 +357,29 @@ typedef struct
   AVDictionary * options;
   enum AVCodecID codec_id; // Set after initializaiton
   gavl_dictionary_t m;
+
+  /* Bitstream filter for compressed streams */
+  AVBSFContext * bsf;
+  
+  /* Counted for the index size estimation */
+  int64_t num_packets;
+  int64_t num_keyframes;
+  gavl_time_t end_time;
+
+  /* Interleaving queue (ring buffer) */
+  AVPacket ** queue;
+  int queue_alloc;
+  int queue_start;
+  int queue_len;
+  int64_t queue_bytes;
+
+  /* Queue statistics */
+  int queue_len_max;
+  int64_t queue_bytes_max;
+  int64_t forced_writes; // Written while other streams had no packets queued
+
+  /* Latency from the codec to av_write_frame() */
+  bgen_trace_t * trace;
   } bg_ffmpeg_stream_common_t;
 
 typedef struct
@@ -287,10 +416,6 @@ struct ffmpeg_priv_s
   
   AVFormatContext * ctx;
   
-  bg_parameter_info_t * audio_parameters;
-  bg_parameter_info_t * video_parameters;
-  bg_parameter_info_t * parameters;
-  
   const ffmpeg_format_info_t * formats;
   const ffmpeg_format_info_t * format;
 
@@ -303,7 +428,54 @@ struct ffmpeg_priv_s
   bg_encoder_callbacks_t * cb;
   
   gavf_io_t * io;
-  unsigned char * io_buffer;
+  gavf_io_t * io_priv; // Created by us for files and stdout
+
+  /* I/O policy */
+  int io_buffer_size; // 0: Automatic
+  int live;           // Non-seekable output, flush after each packet
+
+  AVDictionary * format_options;
+
+  /* Fragmented MP4 */
+  int fragment_mode;
+  int fragment_duration; // Milliseconds
+  int fragment_size;     // Bytes, 0: Unlimited
+  int fragment_index;
+
+  /* Index reservation */
+  int reserve_index;
+  gavl_time_t duration;   // From the metadata, GAVL_TIME_UNDEFINED if unknown
+  int64_t index_reserved; // Bytes
+  int64_t index_pos;      // Start of the reserved space (MP4)
+
+  /* HLS */
+  int segment_duration;   // Seconds
+  int segment_type;
+  int playlist_live;      // Rolling window, old segments are deleted
+  int playlist_size;      // Segments in the window
+
+  /* Files opened by the muxer itself (segments, fMP4 init file).
+     They are passed to the encoder callbacks and removed by
+     bg_ffmpeg_close() if the output is deleted */
+  int (*io_open)(struct AVFormatContext * s, AVIOContext ** pb,
+                 const char * url, int flags, AVDictionary ** options);
+  char ** segment_files;
+  int num_segment_files;
+  int segment_files_alloc;
+  
+  /* Interleaving */
+  bg_ffmpeg_stream_common_t ** streams;
+  int num_streams;
+  
+  int max_interleave_delta; // Milliseconds
+  int64_t max_queue_bytes;  // 0: Unlimited
+  int queue_overflow;
+  int64_t queue_bytes;
+  int queue_overflowed;
+  
+  /* Time in av_write_frame() (excluding io) and in io_write(),
+     muxed packets and the bytes and calls of io_write() */
+  bgen_stats_t perf;
   };
 
 extern const bg_encoder_framerate_t
@@ -392,6 +564,41 @@ void bg_ffmpeg_choose_pixelformat(const enum AVPixelFormat * supported,
 gavl_sample_format_t bg_sample_format_ffmpeg_2_gavl(enum AVSampleFormat p,
                                                     gavl_interleave_mode_t * il);
 
+enum AVSampleFormat bg_ffmpeg_choose_sampleformat(const enum AVSampleFormat * supported,
+                                                  gavl_audio_format_t * fmt);
+
+/* convert.c */
+
+/* Threads for the conversion of one video stream. Returns NULL
+   if the images are too small for multithreading */
+bg_ffmpeg_slicer_t * bg_ffmpeg_slicer_create(const gavl_video_format_t * fmt);
+void bg_ffmpeg_slicer_destroy(bg_ffmpeg_slicer_t * s);
+
+/* s can be NULL */
+void bg_ffmpeg_convert_swap_rb(bg_ffmpeg_slicer_t * s,
+                               const gavl_video_format_t * fmt,
+                               gavl_video_frame_t * f);
+
+void bg_ffmpeg_convert_swap_endian(bg_ffmpeg_slicer_t * s,
+                                   const gavl_video_format_t * fmt,
+                                   gavl_video_frame_t * f);
+
+/* Swap num 16 bit words in place */
+void bg_ffmpeg_convert_bswap16(uint8_t * ptr, int num);
+
+/* pcm.c */
+
+/* Convert num interleaved samples from src to dst */
+typedef void (*bg_ffmpeg_pcm_func)(const uint8_t * src, uint8_t * dst, int num);
+
+/* Return the bytes per encoded sample or 0 if the codec is not supported.
+   The sample format and interleave mode of fmt are changed to what the
+   encode function wants, *func is NULL if the samples can be written as
+   they are. */
+
+int bg_ffmpeg_pcm_init(enum AVCodecID id, gavl_audio_format_t * fmt,
+                       bg_ffmpeg_pcm_func * func);
+
 enum AVCodecID bg_codec_id_gavl_2_ffmpeg(gavl_codec_id_t gavl);
 gavl_codec_id_t bg_codec_id_ffmpeg_2_gavl(enum AVCodecID ffmpeg);
 
@@ -0,0 +1,527 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Parallel encoding with several codec contexts.
+ *
+ *  Jobs are dispatched round-robin to the worker threads. Before a worker
+ *  gets a new job, the packets of its previous job are passed on. Since
+ *  the previous job of the next worker is always the oldest one in flight,
+ *  packets come out in the order the frames went in.
+ *
+ *  There are two modes:
+ *
+ *  - Intra-only codecs: Each worker owns one AVCodecContext for the
+ *    whole stream and a job is a single frame.
+ *
+ *  - Chunks: A job is a sequence of frames, which is encoded by a fresh
+ *    codec context. Each chunk therefore starts with a keyframe and
+ *    (with closed GOPs) has no references to other chunks.
+ *
+ *  Audio codecs without a bit reservoir (MP2, AC-3) can be encoded in
+ *  chunks as well. Their only dependency across frames is the overlap of
+ *  the filterbank, so each chunk is primed with the last frame(s) of the
+ *  previous chunk. The packets of the primer frames are dropped. Since
+ *  these encoders output exactly one packet per frame, packets are
+ *  assigned to the frames by their position.
+ *
+ *  The timing of the frames travels with the jobs, the PTS cache is not
+ *  used.
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+
+#include "ffmpeg_common.h"
+
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "ffmpeg_parallel"
+
+#define STATE_IDLE 0 // No job
+#define STATE_BUSY 1 // Job is being encoded
+#define STATE_DONE 2 // Packets are ready
+
+typedef struct
+  {
+  AVCodecContext * avctx;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  int state;
+  int error;
+
+  /* Job */
+  AVFrame ** frames;
+  bg_ffmpeg_frame_info_t * info;
+  int num_frames;
+  int frames_alloc;
+  int num_primer; // The first num_primer frames belong to the previous chunk
+
+  AVPacket ** packets;
+  int num_packets;
+  int packets_alloc;
+
+  bg_ffmpeg_parallel_t * p;
+  } worker_t;
+
+struct bg_ffmpeg_parallel_s
+  {
+  worker_t * workers;
+  int num_workers;
+  int next; // Next worker to get a frame, has the oldest job
+  int quit;
+
+  int chunk_frames; // 0: Intra-only mode
+
+  /* Last frames for priming the next chunk */
+  int overlap;
+  AVFrame ** prev;
+  bg_ffmpeg_frame_info_t * prev_info;
+  int num_prev;
+
+  bg_ffmpeg_create_context_func create_context;
+  bg_ffmpeg_put_packet_func put_packet;
+  void * data;
+  };
+
+static AVPacket * next_packet(worker_t * w)
+  {
+  if(w->num_packets == w->packets_alloc)
+    {
+    w->packets_alloc += 4;
+    w->packets = realloc(w->packets, w->packets_alloc * sizeof(*w->packets));
+    memset(w->packets + w->num_packets, 0,
+           (w->packets_alloc - w->num_packets) * sizeof(*w->packets));
+    }
+  if(!w->packets[w->num_packets])
+    w->packets[w->num_packets] = av_packet_alloc();
+  return w->packets[w->num_packets];
+  }
+
+static int receive_packets(worker_t * w)
+  {
+  int result;
+
+  while(1)
+    {
+    result = avcodec_receive_packet(w->avctx, next_packet(w));
+
+    if((result == AVERROR(EAGAIN)) || (result == AVERROR_EOF))
+      break;
+    else if(result < 0)
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "avcodec_receive_packet failed");
+      return 0;
+      }
+    w->num_packets++;
+    }
+  return 1;
+  }
+
+static int send_frame(worker_t * w, AVFrame * f)
+  {
+  if(avcodec_send_frame(w->avctx, f) < 0)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "avcodec_send_frame failed");
+    return 0;
+    }
+  return receive_packets(w);
+  }
+
+/* Called without the mutex held */
+
+static void encode_job(worker_t * w)
+  {
+  int i;
+
+  if(w->p->chunk_frames &&
+     !(w->avctx = w->p->create_context(w->p->data)))
+    w->error = 1;
+
+  for(i = 0; i < w->num_frames; i++)
+    {
+    if(!w->error && !send_frame(w, w->frames[i]))
+      w->error = 1;
+    av_frame_unref(w->frames[i]);
+    }
+
+  /* Chunks are finished with their own context */
+  if(w->p->chunk_frames && w->avctx)
+    {
+    if(!w->error && !send_frame(w, NULL))
+      w->error = 1;
+    avcodec_free_context(&w->avctx);
+    }
+  }
+
+static void * worker_thread(void * data)
+  {
+  worker_t * w = data;
+
+  pthread_mutex_lock(&w->mutex);
+
+  while(1)
+    {
+    while((w->state != STATE_BUSY) && !w->p->quit)
+      pthread_cond_wait(&w->cond, &w->mutex);
+
+    if(w->p->quit)
+      break;
+
+    pthread_mutex_unlock(&w->mutex);
+    encode_job(w);
+    pthread_mutex_lock(&w->mutex);
+
+    w->state = STATE_DONE;
+    pthread_cond_broadcast(&w->cond);
+    }
+
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+  }
+
+/* Find the frame belonging to a packet. Packets come out
+   roughly in input order so we start after the last match */
+
+static const bg_ffmpeg_frame_info_t *
+find_info(worker_t * w, int64_t pts, int * idx)
+  {
+  int i, j;
+
+  for(i = 0; i < w->num_frames; i++)
+    {
+    j = (*idx + i) % w->num_frames;
+    if(w->info[j].pts == pts)
+      {
+      *idx = j + 1;
+      return &w->info[j];
+      }
+    }
+  return NULL;
+  }
+
+/* Wait until the worker is done and pass its packets on */
+
+static int collect(bg_ffmpeg_parallel_t * p, worker_t * w)
+  {
+  int i;
+  int idx = 0;
+  int ret = 1;
+  const bg_ffmpeg_frame_info_t * info;
+  
+  pthread_mutex_lock(&w->mutex);
+  while(w->state == STATE_BUSY)
+    pthread_cond_wait(&w->cond, &w->mutex);
+  pthread_mutex_unlock(&w->mutex);
+
+  if(w->state == STATE_IDLE)
+    return !w->error;
+
+  for(i = 0; i < w->num_packets; i++)
+    {
+    /* Audio chunks: Each frame gives one packet. The encoders shift the
+       timestamps by their initial padding, so we don't match them */
+    if(p->overlap)
+      info = (i < w->num_frames) ? &w->info[i] : NULL;
+    else
+      info = find_info(w, w->packets[i]->pts, &idx);
+    
+    if(!info)
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+               "Got no frame for pts %"PRId64, w->packets[i]->pts);
+      ret = 0;
+      }
+    /* Primer packets were already output by the previous chunk */
+    else if(info - w->info < w->num_primer)
+      {
+      av_packet_unref(w->packets[i]);
+      continue;
+      }
+    
+    if(ret && !p->put_packet(p->data, w->packets[i], info))
+      ret = 0;
+    av_packet_unref(w->packets[i]);
+    }
+  w->num_packets = 0;
+  w->num_frames = 0;
+  w->num_primer = 0;
+  w->state = STATE_IDLE;
+
+  if(w->error)
+    ret = 0;
+
+  return ret;
+  }
+
+bg_ffmpeg_parallel_t *
+bg_ffmpeg_parallel_create(int num_workers,
+                          int chunk_frames,
+                          int overlap,
+                          bg_ffmpeg_create_context_func create_context,
+                          bg_ffmpeg_put_packet_func put_packet,
+                          void * data)
+  {
+  int i;
+  worker_t * w;
+  bg_ffmpeg_parallel_t * ret = calloc(1, sizeof(*ret));
+
+  ret->chunk_frames = chunk_frames;
+
+  if(chunk_frames && (overlap > 0))
+    {
+    ret->overlap = overlap;
+    ret->prev = calloc(overlap, sizeof(*ret->prev));
+    ret->prev_info = calloc(overlap, sizeof(*ret->prev_info));
+    for(i = 0; i < overlap; i++)
+      ret->prev[i] = av_frame_alloc();
+    }
+  
+  ret->create_context = create_context;
+  ret->put_packet = put_packet;
+  ret->data = data;
+  ret->workers = calloc(num_workers, sizeof(*ret->workers));
+
+  for(i = 0; i < num_workers; i++)
+    {
+    w = &ret->workers[i];
+
+    /* Chunks create their contexts on the fly */
+    if(!chunk_frames && !(w->avctx = create_context(data)))
+      goto fail;
+
+    w->p = ret;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    if(pthread_create(&w->thread, NULL, worker_thread, w))
+      {
+      pthread_mutex_destroy(&w->mutex);
+      pthread_cond_destroy(&w->cond);
+      if(w->avctx)
+        avcodec_free_context(&w->avctx);
+      goto fail;
+      }
+    ret->num_workers++;
+    }
+
+  if(chunk_frames)
+    gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
+             "Encoding chunks of %d frames (overlap: %d) with %d parallel contexts",
+             chunk_frames, ret->overlap, num_workers);
+  else
+    gavl_log(GAVL_LOG_INFO, LOG_DOMAIN, "Encoding with %d parallel contexts",
+             num_workers);
+  return ret;
+
+  fail:
+  gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Setting up worker %d failed", i);
+  bg_ffmpeg_parallel_destroy(ret);
+  return NULL;
+  }
+
+static void start_job(bg_ffmpeg_parallel_t * p, worker_t * w)
+  {
+  pthread_mutex_lock(&w->mutex);
+  w->state = STATE_BUSY;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+
+  p->next++;
+  if(p->next == p->num_workers)
+    p->next = 0;
+  }
+
+/* Append a frame to the job of a worker */
+
+static int add_frame(worker_t * w, AVFrame * f,
+                     const bg_ffmpeg_frame_info_t * info)
+  {
+  if(w->num_frames == w->frames_alloc)
+    {
+    w->frames_alloc += 16;
+    w->frames = realloc(w->frames, w->frames_alloc * sizeof(*w->frames));
+    w->info   = realloc(w->info,   w->frames_alloc * sizeof(*w->info));
+    memset(w->frames + w->num_frames, 0,
+           (w->frames_alloc - w->num_frames) * sizeof(*w->frames));
+    }
+
+  if(!w->frames[w->num_frames])
+    w->frames[w->num_frames] = av_frame_alloc();
+  
+  if(av_frame_ref(w->frames[w->num_frames], f) < 0)
+    return 0;
+
+  w->info[w->num_frames] = *info;
+  w->num_frames++;
+  return 1;
+  }
+
+/* Remember the last frames for the next chunk */
+
+static int push_prev(bg_ffmpeg_parallel_t * p, AVFrame * f,
+                     const bg_ffmpeg_frame_info_t * info)
+  {
+  int i;
+  AVFrame * tmp;
+  
+  if(p->num_prev == p->overlap)
+    {
+    tmp = p->prev[0];
+    av_frame_unref(tmp);
+    for(i = 1; i < p->overlap; i++)
+      {
+      p->prev[i-1]      = p->prev[i];
+      p->prev_info[i-1] = p->prev_info[i];
+      }
+    p->prev[p->overlap-1] = tmp;
+    p->num_prev--;
+    }
+  
+  if(av_frame_ref(p->prev[p->num_prev], f) < 0)
+    return 0;
+  p->prev_info[p->num_prev] = *info;
+  p->num_prev++;
+  return 1;
+  }
+
+static void clear_prev(bg_ffmpeg_parallel_t * p)
+  {
+  int i;
+  for(i = 0; i < p->num_prev; i++)
+    av_frame_unref(p->prev[i]);
+  p->num_prev = 0;
+  }
+
+int bg_ffmpeg_parallel_put_frame(bg_ffmpeg_parallel_t * p, AVFrame * f,
+                                 const bg_ffmpeg_frame_info_t * info)
+  {
+  int i;
+  worker_t * w = &p->workers[p->next];
+
+  /* Pass on the packets of the previous job, this
+     also makes the job of the worker empty */
+  if((w->state != STATE_IDLE) && !collect(p, w))
+    return 0;
+  
+  /* First frame of a job */
+  if(!w->num_frames)
+    {
+    for(i = 0; i < p->num_prev; i++)
+      {
+      if(!add_frame(w, p->prev[i], &p->prev_info[i]))
+        return 0;
+      }
+    w->num_primer = p->num_prev;
+    }
+  
+  if(!add_frame(w, f, info))
+    return 0;
+
+  /* Reference the copy of the worker, the caller might
+     pass frames, which aren't refcounted */
+  if(p->overlap && !push_prev(p, w->frames[w->num_frames-1], info))
+    return 0;
+  
+  if(w->num_frames - w->num_primer >= p->chunk_frames)
+    start_job(p, w);
+  
+  return 1;
+  }
+
+int bg_ffmpeg_parallel_flush(bg_ffmpeg_parallel_t * p)
+  {
+  int i;
+  int ret = 1;
+
+  /* Incomplete chunk */
+  if(p->workers[p->next].num_frames &&
+     (p->workers[p->next].state == STATE_IDLE))
+    start_job(p, &p->workers[p->next]);
+  
+  for(i = 0; i < p->num_workers; i++)
+    {
+    if(!collect(p, &p->workers[(p->next + i) % p->num_workers]))
+      ret = 0;
+    }
+
+  /* The next frame starts a new stream */
+  clear_prev(p);
+  return ret;
+  }
+
+void bg_ffmpeg_parallel_destroy(bg_ffmpeg_parallel_t * p)
+  {
+  int i, j;
+  worker_t * w;
+
+  /* Stop threads */
+  for(i = 0; i < p->num_workers; i++)
+    {
+    w = &p->workers[i];
+    pthread_mutex_lock(&w->mutex);
+    p->quit = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    }
+
+  for(i = 0; i < p->num_workers; i++)
+    {
+    w = &p->workers[i];
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+
+    for(j = 0; j < w->packets_alloc; j++)
+      {
+      if(w->packets[j])
+        av_packet_free(&w->packets[j]);
+      }
+    if(w->packets)
+      free(w->packets);
+
+    for(j = 0; j < w->frames_alloc; j++)
+      {
+      if(w->frames[j])
+        av_frame_free(&w->frames[j]);
+      }
+    if(w->frames)
+      free(w->frames);
+    if(w->info)
+      free(w->info);
+    
+    if(w->avctx)
+      avcodec_free_context(&w->avctx);
+    }
+  free(p->workers);
+
+  if(p->prev)
+    {
+    for(i = 0; i < p->overlap; i++)
+      av_frame_free(&p->prev[i]);
+    free(p->prev);
+    free(p->prev_info);
+    }
+  free(p);
+  }
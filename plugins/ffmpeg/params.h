@@ -980,5 +980,73 @@ RC buffer size") \
     .long_name = TRS("Thread count"),    \
     .type = BG_PARAMETER_INT,             \
     .val_default = GAVL_VALUE_INIT_INT(0), \
-    .help_string = TRS("Number of threads to use") \
+    .val_min = GAVL_VALUE_INIT_INT(0), \
+    .val_max = GAVL_VALUE_INIT_INT(64), \
+    .help_string = TRS("Number of threads to use. 0 means automatic: The CPU cores are split among the encoders of the process, as far as the codec supports threading.") \
   }
+
+/**  */
+#define PARAM_PARALLEL_CONTEXTS  \
+  { \
+    .name = "parallel_contexts", \
+    .long_name = TRS("Parallel encoders"),    \
+    .type = BG_PARAMETER_INT,             \
+    .val_default = GAVL_VALUE_INIT_INT(0), \
+    .val_min = GAVL_VALUE_INIT_INT(0), \
+    .val_max = GAVL_VALUE_INIT_INT(16), \
+    .help_string = TRS("Number of encoder instances, which compress frames (or chunks) in parallel. 0 means one per available CPU core, 1 disables parallel encoding.") \
+  }
+
+/**  */
+#define PARAM_CHUNK_FRAMES  \
+  { \
+    .name = "chunk_frames", \
+    .long_name = TRS("Chunk size"),    \
+    .type = BG_PARAMETER_INT,             \
+    .val_default = GAVL_VALUE_INIT_INT(0), \
+    .val_min = GAVL_VALUE_INIT_INT(0), \
+    .val_max = GAVL_VALUE_INIT_INT(10000), \
+    .help_string = TRS("Split the video into chunks of this many frames (rounded up to whole GOPs), which are encoded in parallel. Each chunk starts with a keyframe and uses closed GOPs. All frames of the chunks in progress are kept in memory. 0 disables chunked encoding, which is also never used for multipass or live encoding.") \
+  }
+
+/**  */
+#define PARAM_LATENCY  \
+  { \
+    .name = "latency", \
+    .long_name = TRS("Latency"),    \
+    .type = BG_PARAMETER_STRINGLIST,             \
+    .val_default = GAVL_VALUE_INIT_STRING("auto"), \
+    .multi_names = (char const *[]){ "auto", "normal", "low", NULL }, \
+    .multi_labels = (char const *[]){ TRS("Auto"), TRS("Normal"), TRS("Low"), NULL }, \
+    .help_string = TRS("Low latency disables B-frames, lookahead and frame threading, so each frame is encoded as soon as it arrives. Auto uses low latency only for live HLS playlists.") \
+  }
+
+/**  */
+#define PARAM_AUDIO_CHUNK_FRAMES  \
+  { \
+    .name = "chunk_frames", \
+    .long_name = TRS("Chunk size"),    \
+    .type = BG_PARAMETER_INT,             \
+    .val_default = GAVL_VALUE_INIT_INT(0), \
+    .val_min = GAVL_VALUE_INIT_INT(0), \
+    .val_max = GAVL_VALUE_INIT_INT(10000), \
+    .help_string = TRS("Split the audio into chunks of this many frames, which are encoded in parallel. Each chunk is primed with the last frame of the previous one, so the result is almost identical to a serial encode. 0 disables chunked encoding, which is also never used for live encoding.") \
+  }
+
+#define ENCODE_PARAM_AUDIO_CHUNKS \
+  {                                           \
+    .name =      "chunks",                       \
+    .long_name = TRS("Chunked encoding"),                     \
+    .type =      BG_PARAMETER_SECTION,         \
+  },                                        \
+    PARAM_AUDIO_CHUNK_FRAMES, \
+    PARAM_PARALLEL_CONTEXTS
+
+#define ENCODE_PARAM_VIDEO_CHUNKS \
+  {                                           \
+    .name =      "chunks",                       \
+    .long_name = TRS("Chunked encoding"),                     \
+    .type =      BG_PARAMETER_SECTION,         \
+  },                                        \
+    PARAM_CHUNK_FRAMES, \
+    PARAM_PARALLEL_CONTEXTS
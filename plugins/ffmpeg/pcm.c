@@ -0,0 +1,191 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Native encoders for PCM and G.711. These are just sample conversions,
+ *  so we don't need libavcodec for them.
+ *
+ *  A-law and mu-law are encoded with 16 KB tables built the same way as
+ *  in libavcodec (each value is mapped to the code, which decodes to the
+ *  nearest value), so the output is bit identical.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <pthread.h>
+
+#include "ffmpeg_common.h"
+
+#define SIGN_BIT   0x80
+#define QUANT_MASK 0x0f
+#define SEG_SHIFT  4
+#define SEG_MASK   0x70
+#define BIAS       0x84
+
+static uint8_t alaw_table[16384];
+static uint8_t ulaw_table[16384];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static int alaw2linear(uint8_t a_val)
+  {
+  int t, seg;
+
+  a_val ^= 0x55;
+  t = a_val & QUANT_MASK;
+  seg = (a_val & SEG_MASK) >> SEG_SHIFT;
+  if(seg)
+    t = (t + t + 1 + 32) << (seg + 2);
+  else
+    t = (t + t + 1) << 3;
+  return (a_val & SIGN_BIT) ? t : -t;
+  }
+
+static int ulaw2linear(uint8_t u_val)
+  {
+  int t;
+
+  u_val = ~u_val;
+  t = ((u_val & QUANT_MASK) << 3) + BIAS;
+  t <<= (u_val & SEG_MASK) >> SEG_SHIFT;
+  return (u_val & SIGN_BIT) ? (BIAS - t) : (t - BIAS);
+  }
+
+/* Table index is the 14 bit linear value + 8192 */
+
+static void build_table(uint8_t * table, int (*xlaw2linear)(uint8_t), int mask)
+  {
+  int i, j, v, v1, v2;
+
+  j = 1;
+  table[8192] = mask;
+  for(i = 0; i < 127; i++)
+    {
+    v1 = xlaw2linear(i ^ mask);
+    v2 = xlaw2linear((i + 1) ^ mask);
+    v = (v1 + v2 + 4) >> 3;
+    for(; j < v; j++)
+      {
+      table[8192 - j] = (i ^ (mask ^ 0x80));
+      table[8192 + j] = (i ^ mask);
+      }
+    }
+  for(; j < 8192; j++)
+    {
+    table[8192 - j] = (127 ^ (mask ^ 0x80));
+    table[8192 + j] = (127 ^ mask);
+    }
+  table[0] = table[1];
+  }
+
+static void build_tables(void)
+  {
+  build_table(alaw_table, alaw2linear, 0xd5);
+  build_table(ulaw_table, ulaw2linear, 0xff);
+  }
+
+/* Encode functions */
+
+static void encode_swap16(const uint8_t * src, uint8_t * dst, int num)
+  {
+  memcpy(dst, src, num * 2);
+  bg_ffmpeg_convert_bswap16(dst, num);
+  }
+
+static inline void encode_xlaw(const uint8_t * table,
+                               const uint8_t * src, uint8_t * dst, int num)
+  {
+  int i;
+  const int16_t * s = (const int16_t *)src;
+
+  for(i = 0; i + 4 <= num; i += 4)
+    {
+    dst[i]   = table[(s[i]   + 32768) >> 2];
+    dst[i+1] = table[(s[i+1] + 32768) >> 2];
+    dst[i+2] = table[(s[i+2] + 32768) >> 2];
+    dst[i+3] = table[(s[i+3] + 32768) >> 2];
+    }
+  for(; i < num; i++)
+    dst[i] = table[(s[i] + 32768) >> 2];
+  }
+
+static void encode_alaw(const uint8_t * src, uint8_t * dst, int num)
+  {
+  encode_xlaw(alaw_table, src, dst, num);
+  }
+
+static void encode_ulaw(const uint8_t * src, uint8_t * dst, int num)
+  {
+  encode_xlaw(ulaw_table, src, dst, num);
+  }
+
+int bg_ffmpeg_pcm_init(enum AVCodecID id, gavl_audio_format_t * fmt,
+                       bg_ffmpeg_pcm_func * func)
+  {
+  int ret;
+
+  *func = NULL;
+
+  switch(id)
+    {
+#ifdef WORDS_BIGENDIAN
+    case AV_CODEC_ID_PCM_S16LE:
+#else
+    case AV_CODEC_ID_PCM_S16BE:
+#endif
+      *func = encode_swap16;
+      // Fall through
+#ifdef WORDS_BIGENDIAN
+    case AV_CODEC_ID_PCM_S16BE:
+#else
+    case AV_CODEC_ID_PCM_S16LE:
+#endif
+      fmt->sample_format = GAVL_SAMPLE_S16;
+      ret = 2;
+      break;
+    case AV_CODEC_ID_PCM_S8:
+      fmt->sample_format = GAVL_SAMPLE_S8;
+      ret = 1;
+      break;
+    case AV_CODEC_ID_PCM_U8:
+      fmt->sample_format = GAVL_SAMPLE_U8;
+      ret = 1;
+      break;
+    case AV_CODEC_ID_PCM_ALAW:
+      pthread_once(&tables_once, build_tables);
+      fmt->sample_format = GAVL_SAMPLE_S16;
+      *func = encode_alaw;
+      ret = 1;
+      break;
+    case AV_CODEC_ID_PCM_MULAW:
+      pthread_once(&tables_once, build_tables);
+      fmt->sample_format = GAVL_SAMPLE_S16;
+      *func = encode_ulaw;
+      ret = 1;
+      break;
+    default:
+      return 0;
+    }
+
+  fmt->interleave_mode = GAVL_INTERLEAVE_ALL;
+  return ret;
+  }
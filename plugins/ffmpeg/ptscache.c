@@ -0,0 +1,159 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Timing of the frames inside the encoder, looked up by pts when the
+ *  packets come out. This is a hash table with open addressing (linear
+ *  probing), which grows when it gets half full. Removed entries are
+ *  filled by moving the following entries of the same cluster back, so
+ *  we need no tombstones.
+ */
+
+#include <config.h>
+
+#include "ffmpeg_common.h"
+
+#define MIN_SIZE 16
+
+typedef struct
+  {
+  bg_ffmpeg_frame_info_t info;
+  int used;
+  } entry_t;
+
+struct bg_ffmpeg_pts_cache_s
+  {
+  entry_t * entries;
+  int size; // Power of 2
+  int num;
+  };
+
+static inline int get_slot(const bg_ffmpeg_pts_cache_t * c, int64_t pts)
+  {
+  /* Fibonacci hashing: Consecutive timestamps get spread out */
+  return (int)(((uint64_t)pts * 0x9E3779B97F4A7C15ULL) >> 32) & (c->size - 1);
+  }
+
+static void insert(bg_ffmpeg_pts_cache_t * c, const bg_ffmpeg_frame_info_t * info)
+  {
+  int i = get_slot(c, info->pts);
+
+  while(c->entries[i].used)
+    {
+    if(c->entries[i].info.pts == info->pts) // Replace
+      {
+      c->entries[i].info = *info;
+      return;
+      }
+    i = (i + 1) & (c->size - 1);
+    }
+  c->entries[i].info = *info;
+  c->entries[i].used = 1;
+  c->num++;
+  }
+
+static void alloc_entries(bg_ffmpeg_pts_cache_t * c, int size)
+  {
+  c->size = MIN_SIZE;
+  while(c->size < size)
+    c->size <<= 1;
+  c->entries = calloc(c->size, sizeof(*c->entries));
+  c->num = 0;
+  }
+
+static void grow(bg_ffmpeg_pts_cache_t * c)
+  {
+  int i;
+  int old_size = c->size;
+  entry_t * old_entries = c->entries;
+
+  alloc_entries(c, old_size * 2);
+
+  for(i = 0; i < old_size; i++)
+    {
+    if(old_entries[i].used)
+      insert(c, &old_entries[i].info);
+    }
+  free(old_entries);
+  }
+
+bg_ffmpeg_pts_cache_t * bg_ffmpeg_pts_cache_create(int num_frames)
+  {
+  bg_ffmpeg_pts_cache_t * ret = calloc(1, sizeof(*ret));
+  alloc_entries(ret, num_frames * 2);
+  return ret;
+  }
+
+void bg_ffmpeg_pts_cache_destroy(bg_ffmpeg_pts_cache_t * c)
+  {
+  free(c->entries);
+  free(c);
+  }
+
+void bg_ffmpeg_pts_cache_push(bg_ffmpeg_pts_cache_t * c,
+                              const bg_ffmpeg_frame_info_t * info)
+  {
+  if(2 * (c->num + 1) > c->size)
+    grow(c);
+  insert(c, info);
+  }
+
+int bg_ffmpeg_pts_cache_pop(bg_ffmpeg_pts_cache_t * c, int64_t pts,
+                            bg_ffmpeg_frame_info_t * ret)
+  {
+  int i, j, k;
+  int mask = c->size - 1;
+
+  i = get_slot(c, pts);
+
+  while(1)
+    {
+    if(!c->entries[i].used)
+      return 0;
+    if(c->entries[i].info.pts == pts)
+      break;
+    i = (i + 1) & mask;
+    }
+
+  *ret = c->entries[i].info;
+  c->entries[i].used = 0;
+  c->num--;
+
+  /* Close the gap: Move back entries, whose home slot is
+     not between the gap and their current position */
+  j = i;
+  while(1)
+    {
+    j = (j + 1) & mask;
+    if(!c->entries[j].used)
+      break;
+
+    k = get_slot(c, c->entries[j].info.pts);
+
+    if((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+      continue;
+
+    c->entries[i] = c->entries[j];
+    c->entries[j].used = 0;
+    i = j;
+    }
+  return 1;
+  }
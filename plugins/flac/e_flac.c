@@ -41,6 +41,7 @@
 
 #include <bgflac.h>
 #include <vorbiscomment.h>
+#include <gmerlin_encoders.h>
 
 
 typedef struct
@@ -95,12 +96,22 @@ typedef struct
   gavf_io_t * io;
 
   int streaming;
+
+  bgen_stats_t perf;
+  bgen_trace_t * trace;
   } flac_t;
 
 static int write_data(flac_t * f, const uint8_t * data, int len)
   {
+  gavl_time_t t = bgen_stats_time();
+  
   if(gavf_io_write_data(f->io, data, len) < len)
     return 0;
+  bgen_stats_add_time(&f->perf, t, &f->perf.io_time);
+  bgen_stats_lock(&f->perf);
+  f->perf.write_calls++;
+  bgen_stats_unlock(&f->perf);
+  
   f->bytes_written += len;
   return 1;
   }
@@ -329,6 +340,8 @@ static int open_io_flac(void * data, gavf_io_t * io,
   flac_t * flac = data;
   flac->enc = bg_flac_create();
   flac->io = io;
+  bgen_stats_init(&flac->perf, 0);
+  bgen_stats_register(&flac->perf, LOG_DOMAIN, "Output");
 
   if(!gavf_io_can_seek(flac->io))
     flac->streaming = 1;
@@ -452,11 +465,22 @@ write_audio_packet_func_flac(void * priv, gavl_packet_t * packet)
     flac->data_start = flac->bytes_written;
   
   append_packet(flac, packet->duration);
+
+  bgen_stats_lock(&flac->perf);
+  flac->perf.packets++;
+  flac->perf.bytes += packet->buf.len;
+  flac->perf.duration += packet->duration;
+  bgen_stats_unlock(&flac->perf);
+
+  if(flac->trace)
+    bgen_trace_queue(flac->trace);
   
-  if(write_data(flac, packet->buf.buf, packet->buf.len))
-    return GAVL_SINK_OK;
-  else
+  if(!write_data(flac, packet->buf.buf, packet->buf.len))
     return GAVL_SINK_ERROR;
+
+  if(flac->trace)
+    bgen_trace_write(flac->trace, 1);
+  return GAVL_SINK_OK;
   }
 
 static int start_flac(void * data)
@@ -482,6 +506,8 @@ static int start_flac(void * data)
   bg_flac_set_sink(flac->enc, flac->psink_int);
 
   flac->data_start = -1;
+  flac->perf.timescale = flac->format.samplerate;
+  flac->trace = bgen_trace_create(LOG_DOMAIN, "Output");
   
   return 1;
   }
@@ -579,6 +605,13 @@ static int close_flac(void * data, int do_delete)
   /* Finalize output file */
   if(flac->io)
     {
+    bgen_stats_log(&flac->perf, LOG_DOMAIN, "Output");
+    if(flac->trace)
+      {
+      bgen_trace_destroy(flac->trace);
+      flac->trace = NULL;
+      }
+    
     if(do_delete && flac->filename)
       {
       gavf_io_destroy(flac->io);
@@ -636,6 +669,7 @@ static void destroy_flac(void * priv)
   flac_t * flac;
   flac = priv;
   close_flac(priv, 1);
+  bgen_stats_unregister(&flac->perf);
   free(flac);
   }
 
@@ -42,6 +42,7 @@ typedef struct
   gavl_audio_sink_t * asink;
   int compressed;
   gavl_compression_info_t ci;
+  bgen_trace_t * trace;
   } b_lame_t;
 
 static void * create_lame()
@@ -133,8 +134,17 @@ static void set_audio_parameter_lame(void * data, int stream, const char * name,
 static gavl_sink_status_t write_callback(void * data, gavl_packet_t * p)
   {
   b_lame_t * lame = data;
-  return (bg_shout_write(lame->shout, p->buf.buf, p->buf.len) == p->buf.len) ?
-    GAVL_SINK_OK : GAVL_SINK_ERROR;
+
+  if(lame->trace)
+    bgen_trace_queue(lame->trace);
+  
+  if(bg_shout_write(lame->shout, p->buf.buf, p->buf.len) < p->buf.len)
+    return GAVL_SINK_ERROR;
+
+  /* Includes the time shout waits for the server */
+  if(lame->trace)
+    bgen_trace_write(lame->trace, 1);
+  return GAVL_SINK_OK;
   }
 
 static int start_lame(void * data)
@@ -143,6 +153,8 @@ static int start_lame(void * data)
 
   if(!bg_shout_open(lame->shout))
     return 0;
+
+  lame->trace = bgen_trace_create(LOG_DOMAIN, "Output");
   
   /* Create sink */
   lame->psink = gavl_packet_sink_create(NULL, write_callback,
@@ -170,6 +182,12 @@ static int close_lame(void * data, int do_delete)
   
   bg_shout_destroy(lame->shout);
   lame->shout = NULL;
+
+  if(lame->trace)
+    {
+    bgen_trace_destroy(lame->trace);
+    lame->trace = NULL;
+    }
   
   return ret;
   }
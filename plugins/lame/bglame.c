@@ -35,6 +35,8 @@
 
 
 #include <bglame.h>
+#include <gmerlin_encoders.h>
+#include <bgen_probes.h>
 
 /* MPEG header detection: lame outputs incomplete frames,
    so we need to assemble them to packets */
@@ -295,7 +297,9 @@ struct bg_lame_s
   int64_t in_pts;
   int64_t out_pts;
   int64_t delay;
-  
+
+  bgen_stats_t perf;
+  bgen_trace_t * trace;
   };
 
 /* Supported samplerates for MPEG-1/2/2.5 */
@@ -393,6 +397,8 @@ bg_lame_t * bg_lame_create()
   ret->lame = lame_init();
   ret->in_pts = GAVL_TIME_UNDEFINED;
   ret->out_pts = GAVL_TIME_UNDEFINED;
+  bgen_stats_init(&ret->perf, 0);
+  bgen_stats_register(&ret->perf, LOG_DOMAIN, "Encoder");
 
   return ret;
   }
@@ -518,6 +524,18 @@ static int flush_packets(bg_lame_t * lame, int flush_all)
       
       lame->out_pts += lame->gp.duration;
 
+      bgen_stats_lock(&lame->perf);
+      lame->perf.packets++;
+      lame->perf.bytes += h.frame_bytes;
+      lame->perf.duration += lame->gp.duration;
+      bgen_stats_unlock(&lame->perf);
+
+      if(lame->trace)
+        bgen_trace_packet(lame->trace, lame->gp.pts, lame->gp.duration);
+
+      BGEN_PROBE_PACKET_OUT("lame", lame, lame->gp.pts, lame->gp.duration,
+                            h.frame_bytes);
+      
       /* Output packet */
       
       if(gavl_packet_sink_put_packet(lame->psink, &lame->gp) != GAVL_SINK_OK)
@@ -543,6 +561,7 @@ static gavl_sink_status_t
 write_audio_func(void * data, gavl_audio_frame_t * frame)
   {
   int bytes_encoded;
+  bgen_stats_clock_t clock;
   bg_lame_t * lame = data;
 
   if(lame->in_pts == GAVL_TIME_UNDEFINED)
@@ -550,7 +569,15 @@ write_audio_func(void * data, gavl_audio_frame_t * frame)
     lame->in_pts = frame->timestamp;
     lame->out_pts = lame->in_pts - lame->delay;
     }
+
+  /* Packets are shifted by the encoder delay */
+  if(lame->trace)
+    bgen_trace_frame(lame->trace, lame->in_pts - lame->delay,
+                     frame->valid_samples);
+
+  BGEN_PROBE_FRAME_IN("lame", lame, lame->in_pts, frame->valid_samples);
   
+  bgen_stats_codec_start(&lame->perf, &clock);
   bytes_encoded = lame_encode_buffer_float(lame->lame,
                                            frame->channels.f[0],
                                            (lame->format.num_channels > 1) ?
@@ -559,10 +586,14 @@ write_audio_func(void * data, gavl_audio_frame_t * frame)
                                            frame->valid_samples,
                                            lame->buffer + lame->buffer_size,
                                            lame->buffer_alloc - lame->buffer_size);
-
+  bgen_stats_codec_end(&lame->perf, &clock);
+  
   lame->buffer_size += bytes_encoded;
 
   lame->in_pts += frame->valid_samples;
+  bgen_stats_lock(&lame->perf);
+  lame->perf.frames += frame->valid_samples;
+  bgen_stats_unlock(&lame->perf);
   
   if((bytes_encoded > 0) && (flush_packets(lame, 0) < 0))
     return GAVL_SINK_ERROR;
@@ -658,6 +689,7 @@ gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
   fmt->samples_per_frame = lame_get_framesize(lame->lame);
   
   gavl_audio_format_copy(&lame->format, fmt);
+  lame->perf.timescale = fmt->samplerate;
   lame->sink = gavl_audio_sink_create(NULL, write_audio_func, lame, &lame->format);
 
   /* Allocate output buffer */
@@ -684,6 +716,8 @@ gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
   lame->delay = lame_get_encoder_delay(lame->lame) + 528 + 1; 
   if(ci)
     ci->pre_skip = lame->delay;
+
+  lame->trace = bgen_trace_create(LOG_DOMAIN, "Encoder");
   return lame->sink;
   
   
@@ -706,6 +740,13 @@ void bg_lame_destroy(bg_lame_t * lame)
     if(lame->buffer_size)
       flush_packets(lame, 1);
 
+    bgen_stats_log(&lame->perf, LOG_DOMAIN, "Encoder");
+    }
+
+  if(lame->trace)
+    {
+    bgen_trace_destroy(lame->trace);
+    lame->trace = NULL;
     }
   
   
@@ -730,5 +771,6 @@ void bg_lame_destroy(bg_lame_t * lame)
   
   gavl_packet_free(&lame->gp);
 
+  bgen_stats_unregister(&lame->perf);
   free(lame);
   }
@@ -63,6 +63,9 @@ typedef struct
 
   int compressed;
   gavl_audio_format_t fmt;
+
+  bgen_stats_t perf;
+  bgen_trace_t * trace;
   } lame_priv_t;
 
 static void * create_lame()
@@ -70,6 +73,8 @@ static void * create_lame()
   lame_priv_t * ret;
   ret = calloc(1, sizeof(*ret));
   ret->codec = bg_lame_create();
+  bgen_stats_init(&ret->perf, 0);
+  bgen_stats_register(&ret->perf, LOG_DOMAIN, "Output");
   
   return ret;
   }
@@ -80,6 +85,7 @@ static void destroy_lame(void * priv)
   lame = priv;
   if(lame->codec)
     bg_lame_destroy(lame->codec);
+  bgen_stats_unregister(&lame->perf);
   free(lame);
   }
 
@@ -249,6 +255,7 @@ writes_compressed_audio_lame(void * data, const gavl_audio_format_t * format,
 static gavl_sink_status_t
 write_audio_packet_func_lame(void * data, gavl_packet_t * p)
   {
+  gavl_time_t t;
   lame_priv_t * lame;
   
   lame = data;
@@ -266,8 +273,23 @@ write_audio_packet_func_lame(void * data, gavl_packet_t * p)
   if(lame->xing)
     bg_xing_update(lame->xing, p->buf.len);
   
+  t = bgen_stats_time();
   if(gavf_io_write_data(lame->output, p->buf.buf, p->buf.len) < p->buf.len)
     return GAVL_SINK_ERROR;
+  bgen_stats_add_time(&lame->perf, t, &lame->perf.io_time);
+
+  bgen_stats_lock(&lame->perf);
+  lame->perf.packets++;
+  lame->perf.write_calls++;
+  lame->perf.bytes += p->buf.len;
+  lame->perf.duration += p->duration;
+  bgen_stats_unlock(&lame->perf);
+
+  if(lame->trace)
+    {
+    bgen_trace_queue(lame->trace);
+    bgen_trace_write(lame->trace, 1);
+    }
   return GAVL_SINK_OK;
   }
 
@@ -315,6 +337,9 @@ static int start_lame(void * data)
   {
   lame_priv_t * lame = data;
 
+  lame->perf.timescale = lame->fmt.samplerate;
+  lame->trace = bgen_trace_create(LOG_DOMAIN, "Output");
+  
   /* Create sink */
   lame->psink = gavl_packet_sink_create(NULL, write_audio_packet_func_lame,
                                         lame);
@@ -374,6 +399,13 @@ static int close_lame(void * data, int do_delete)
         lame->id3v1 = NULL;
         }
       }
+    bgen_stats_log(&lame->perf, LOG_DOMAIN, "Output");
+    if(lame->trace)
+      {
+      bgen_trace_destroy(lame->trace);
+      lame->trace = NULL;
+      }
+    
     /* 4. Close output file */
     gavf_io_destroy(lame->output);
     lame->output = NULL;
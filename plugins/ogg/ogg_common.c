@@ -35,6 +35,7 @@
 #include <gavl/metatags.h>
 
 #include "ogg_common.h"
+#include <bgen_probes.h>
 
 #include <vorbiscomment.h>
 
@@ -55,6 +56,9 @@ static void free_stream(bg_ogg_stream_t * s)
   if(s->stats_file)
     free(s->stats_file);
   gavl_packet_free(&s->last_packet);
+  if(s->trace)
+    bgen_trace_destroy(s->trace);
+  bgen_stats_unregister(&s->perf);
   }
 
 void bg_ogg_encoder_destroy(void * data)
@@ -154,21 +158,41 @@ static int bg_ogg_stream_flush_page(bg_ogg_stream_t * s, int force)
   {
   int result;
   ogg_page og;
+  gavl_time_t t;
   memset(&og, 0, sizeof(og));
+
+  t = bgen_stats_time();
   if(force || (s->flags & STREAM_FORCE_FLUSH))
     result = ogg_stream_flush(&s->os,&og);
   else
     result = ogg_stream_pageout(&s->os,&og);
+  bgen_stats_add_time(&s->perf, t, &s->perf.mux_time);
   
   if(result)
     {
+    BGEN_PROBE_PAGE_OUT("ogg", s->index, ogg_page_granulepos(&og),
+                        og.header_len + og.body_len, ogg_page_packets(&og));
+    
+    BGEN_PROBE_IO_START("ogg", s->index, og.header_len + og.body_len);
+    t = bgen_stats_time();
     if((gavf_io_write_data(s->enc->io,
                            og.header,og.header_len) < og.header_len) ||
        (gavf_io_write_data(s->enc->io,
                            og.body,og.body_len) < og.body_len))
       return -1;
-    else
-      return 1;
+    bgen_stats_add_time(&s->perf, t, &s->perf.io_time);
+    BGEN_PROBE_IO_DONE("ogg", s->index, og.header_len + og.body_len);
+
+    bgen_stats_lock(&s->perf);
+    s->perf.packets++;
+    s->perf.write_calls += 2;
+    s->perf.bytes += og.header_len + og.body_len;
+    bgen_stats_unlock(&s->perf);
+
+    /* Packets finished on this page */
+    if(s->trace)
+      bgen_trace_write(s->trace, ogg_page_packets(&og));
+    return 1;
     }
   return 0;
   }
@@ -245,17 +269,29 @@ static gavl_sink_status_t write_gavl_packet(void * data, gavl_packet_t * p)
   /* Flush the last packet */
   if(s->last_packet.buf.len)
     {
+    gavl_time_t t;
     ogg_packet op;
     memset(&op, 0, sizeof(op));
+
+    t = bgen_stats_time();
     bg_ogg_packet_from_gavl(s, &s->last_packet, &op);
     op.packetno = s->packetno++;
     ogg_stream_packetin(&s->os, &op);
+    bgen_stats_add_time(&s->perf, t, &s->perf.mux_time);
+
+    bgen_stats_lock(&s->perf);
+    s->perf.frames++;
+    bgen_stats_unlock(&s->perf);
+    
     /* Flush pages if any */
     if(bg_ogg_stream_flush(s, 0) < 0)
       return GAVL_SINK_ERROR;
     }
   /* Save this packet */
   gavl_packet_copy(&s->last_packet, p);
+
+  if(s->trace)
+    bgen_trace_queue(s->trace);
   return GAVL_SINK_OK;
   }
 
@@ -293,6 +329,7 @@ static bg_ogg_stream_t * append_stream(bg_ogg_encoder_t * e,
   
   memset(ret, 0, sizeof(*ret));
   ogg_stream_init(&ret->os, e->serialno++);
+  bgen_stats_init(&ret->perf, 0);
   
   gavl_dictionary_copy(&ret->m_stream, m);
   
@@ -423,6 +460,8 @@ static int start_audio(bg_ogg_encoder_t * e, int stream)
         return 0;
       }
     }
+  s->trace = bgen_trace_create(LOG_DOMAIN, "Audio stream");
+  bgen_stats_register(&s->perf, LOG_DOMAIN, "Audio stream");
   s->psink_out = gavl_packet_sink_create(NULL, write_gavl_packet, s);
   s->codec->set_packet_sink(s->codec_priv, s->psink_out);
   return 1;
@@ -461,6 +500,8 @@ static int start_video(bg_ogg_encoder_t * e, int stream)
       return 0;
     }
 
+  s->trace = bgen_trace_create(LOG_DOMAIN, "Video stream");
+  bgen_stats_register(&s->perf, LOG_DOMAIN, "Video stream");
   s->psink_out = gavl_packet_sink_create(NULL, write_gavl_packet, s);
   s->codec->set_packet_sink(s->codec_priv, s->psink_out);
   return 1;
@@ -597,6 +638,14 @@ int bg_ogg_encoder_close(void * data, int do_delete)
 
     flush_stream(s);
     ogg_stream_clear(&s->os);
+    bgen_stats_log(&s->perf, LOG_DOMAIN, "Audio stream");
+    bgen_stats_unregister(&s->perf);
+
+    if(s->trace)
+      {
+      bgen_trace_destroy(s->trace);
+      s->trace = NULL;
+      }
     
     if(s->asink)
       {
@@ -619,6 +668,14 @@ int bg_ogg_encoder_close(void * data, int do_delete)
       }
     flush_stream(s);
     ogg_stream_clear(&s->os);
+    bgen_stats_log(&s->perf, LOG_DOMAIN, "Video stream");
+    bgen_stats_unregister(&s->perf);
+
+    if(s->trace)
+      {
+      bgen_trace_destroy(s->trace);
+      s->trace = NULL;
+      }
 
     if(s->vsink)
       {
@@ -20,6 +20,7 @@
  * *****************************************************************/
 
 #include <ogg/ogg.h>
+#include <gmerlin_encoders.h>
 
 /* Generic struct for a codec. Here, we'll implement
    encoders for vorbis, theora, speex and flac */
@@ -107,6 +108,9 @@ struct bg_ogg_stream_s
   const gavl_dictionary_t * m_global;
   gavl_dictionary_t m_stream;
 
+  /* Pages written */
+  bgen_stats_t perf;
+  bgen_trace_t * trace;
   };
 
 int bg_ogg_stream_write_header_packet(bg_ogg_stream_t * s,
@@ -97,13 +97,17 @@ typedef struct
   int to_skip;
 
   gavl_packet_sink_t * psink;
-  
+
+  bgen_stats_t perf;
+  bgen_trace_t * trace;
   } opus_t;
 
 static void * create_opus()
   {
   opus_t * ret;
   ret = calloc(1, sizeof(*ret));
+  bgen_stats_init(&ret->perf, 48000);
+  bgen_stats_register(&ret->perf, LOG_DOMAIN, "Encoder");
   return ret;
   }
 
@@ -300,6 +304,7 @@ static int flush_frame(opus_t * opus, int eof)
   {
   gavl_packet_t gp;
   int result;
+  bgen_stats_clock_t clock;
 
   //  fprintf(stderr, "Flush frame %d %d\n", opus->frame->valid_samples,
   //          opus->format->samples_per_frame);
@@ -318,6 +323,7 @@ static int flush_frame(opus_t * opus, int eof)
              block_align);
       }
 
+    bgen_stats_codec_start(&opus->perf, &clock);
     if(opus->format->sample_format == GAVL_SAMPLE_FLOAT)
       {
       result = opus_multistream_encode_float(opus->enc,
@@ -334,6 +340,7 @@ static int flush_frame(opus_t * opus, int eof)
                                        opus->enc_buffer,
                                        opus->enc_buffer_size);
       }
+    bgen_stats_codec_end(&opus->perf, &clock);
     
     if(result < 0)
       {
@@ -351,6 +358,16 @@ static int flush_frame(opus_t * opus, int eof)
     gp.duration = (opus->frame->valid_samples * 48000) / opus->format->samplerate;
     gp.pts = opus->pts;
     opus->pts += gp.duration;
+
+    bgen_stats_lock(&opus->perf);
+    opus->perf.packets++;
+    opus->perf.bytes += result;
+    opus->perf.duration += gp.duration;
+    bgen_stats_unlock(&opus->perf);
+
+    if(opus->trace)
+      bgen_trace_packet(opus->trace, gp.pts, gp.duration);
+    
     gavl_packet_sink_put_packet(opus->psink, &gp);
     opus->frame->valid_samples = 0;
     }
@@ -366,6 +383,12 @@ write_audio_frame_opus(void * data, gavl_audio_frame_t * frame)
   
   opus_t * opus = data;
 
+  /* The lookahead silence moves the samples back to 0 */
+  if(opus->trace)
+    bgen_trace_frame(opus->trace,
+                     (opus->samples_read * 48000) / opus->format->samplerate,
+                     (frame->valid_samples * 48000) / opus->format->samplerate);
+  
   /* Handle lookahead */
   while(opus->lookahead)
     {
@@ -410,6 +433,9 @@ write_audio_frame_opus(void * data, gavl_audio_frame_t * frame)
     }
   
   opus->samples_read += frame->valid_samples;
+  bgen_stats_lock(&opus->perf);
+  opus->perf.frames += frame->valid_samples;
+  bgen_stats_unlock(&opus->perf);
   return result ? GAVL_SINK_OK : GAVL_SINK_ERROR; 
   }
 
@@ -524,6 +550,7 @@ init_opus(void * data, gavl_compression_info_t * ci,
   ci->pre_skip = opus->h.pre_skip;
 
   opus->pts = -((int64_t)ci->pre_skip);
+  opus->trace = bgen_trace_create(LOG_DOMAIN, "Encoder");
   
   
   gavl_dictionary_set_string(stream_metadata, GAVL_META_SOFTWARE,
@@ -591,6 +618,11 @@ static int close_opus(void * data)
 
   /* Flush */
   result = flush_frame(opus, 1);
+
+  bgen_stats_log(&opus->perf, LOG_DOMAIN, "Encoder");
+  bgen_stats_unregister(&opus->perf);
+  if(opus->trace)
+    bgen_trace_destroy(opus->trace);
   
   if(opus->frame)
     gavl_audio_frame_destroy(opus->frame);
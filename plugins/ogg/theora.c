@@ -88,7 +88,9 @@ typedef struct
   int64_t pts;
 
   gavl_video_format_t * format;
-  
+
+  bgen_stats_t perf;
+  bgen_trace_t * trace;
   } theora_t;
 
 static void set_packet_sink(void * data, gavl_packet_sink_t * psink)
@@ -103,6 +105,8 @@ static void * create_theora()
   theora_t * ret;
   ret = calloc(1, sizeof(*ret));
   th_info_init(&ret->ti);
+  bgen_stats_init(&ret->perf, 0);
+  bgen_stats_register(&ret->perf, LOG_DOMAIN, "Encoder");
   
   return ret;
   }
@@ -344,11 +348,15 @@ write_video_frame_theora(void * data, gavl_video_frame_t * frame)
   int i;
   ogg_packet op;
   gavl_packet_t gp;
+  bgen_stats_clock_t clock;
   //  int64_t frame_index;
 
   //  fprintf(stderr, "Write frame theora\n");
   
   theora = data;
+
+  if(theora->trace)
+    bgen_trace_frame(theora->trace, theora->pts, theora->format->frame_duration);
   
   for(i = 0; i < 3; i++)
     {
@@ -386,7 +394,12 @@ write_video_frame_theora(void * data, gavl_video_frame_t * frame)
     }
 #endif
   
+  bgen_stats_codec_start(&theora->perf, &clock);
   th_encode_ycbcr_in(theora->ts, theora->buf);
+  bgen_stats_codec_end(&theora->perf, &clock);
+  bgen_stats_lock(&theora->perf);
+  theora->perf.frames++;
+  bgen_stats_unlock(&theora->perf);
 
 #ifdef THEORA_1_1
   /* Output pass data */
@@ -422,6 +435,15 @@ write_video_frame_theora(void * data, gavl_video_frame_t * frame)
   gp.duration = theora->format->frame_duration;
 
   theora->pts += theora->format->frame_duration;
+
+  bgen_stats_lock(&theora->perf);
+  theora->perf.packets++;
+  theora->perf.bytes += op.bytes;
+  theora->perf.duration += gp.duration;
+  bgen_stats_unlock(&theora->perf);
+
+  if(theora->trace)
+    bgen_trace_packet(theora->trace, gp.pts, gp.duration);
   
   if(op.bytes && !(op.packet[0] & 0x40)) // Keyframe
     gp.flags |= GAVL_PACKET_TYPE_I | GAVL_PACKET_KEYFRAME;
@@ -589,6 +611,9 @@ init_theora(void * data, gavl_compression_info_t * ci,
   theora->buf[1].height = theora->format->frame_height / sub_v;
   theora->buf[2].width  = theora->format->frame_width  / sub_h;
   theora->buf[2].height = theora->format->frame_height / sub_v;
+
+  theora->perf.timescale = theora->format->timescale;
+  theora->trace = bgen_trace_create(LOG_DOMAIN, "Encoder");
   
   return gavl_video_sink_create(NULL, write_video_frame_theora, theora,
                                 theora->format);
@@ -735,6 +760,11 @@ static int close_theora(void * data)
   int ret = 1;
   theora_t * theora;
   theora = data;
+
+  bgen_stats_log(&theora->perf, LOG_DOMAIN, "Encoder");
+  bgen_stats_unregister(&theora->perf);
+  if(theora->trace)
+    bgen_trace_destroy(theora->trace);
   
 #ifdef THEORA_1_1
   if(theora->stats_file)
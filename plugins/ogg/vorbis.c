@@ -76,13 +76,17 @@ typedef struct
   gavl_packet_sink_t * psink;
 
   int64_t pts;
-  
+
+  bgen_stats_t perf;
+  bgen_trace_t * trace;
   } vorbis_t;
 
 static void * create_vorbis()
   {
   vorbis_t * ret;
   ret = calloc(1, sizeof(*ret));
+  bgen_stats_init(&ret->perf, 0);
+  bgen_stats_register(&ret->perf, LOG_DOMAIN, "Encoder");
   return ret;
   }
 
@@ -210,20 +214,40 @@ static void set_packet_sink(void * data, gavl_packet_sink_t * psink)
   vorbis->psink = psink;
   }
 
-static int flush_packet(vorbis_t * vorbis, ogg_packet * op)
+/* The codec clock is stopped while the packet is written */
+
+static int flush_packet(vorbis_t * vorbis, ogg_packet * op,
+                        bgen_stats_clock_t * clock)
   {
+  int ret;
   gavl_packet_t gp;
   gavl_packet_init(&gp);
 
   bg_ogg_packet_to_gavl(op, &gp, &vorbis->pts);
-  
-  return gavl_packet_sink_put_packet(vorbis->psink, &gp) ? 1 : 0;
+
+  bgen_stats_lock(&vorbis->perf);
+  vorbis->perf.packets++;
+  vorbis->perf.bytes += gp.buf.len;
+  vorbis->perf.duration += gp.duration;
+  bgen_stats_unlock(&vorbis->perf);
+
+  if(vorbis->trace)
+    bgen_trace_packet(vorbis->trace, gp.pts, gp.duration);
+
+  bgen_stats_codec_end(&vorbis->perf, clock);
+  ret = gavl_packet_sink_put_packet(vorbis->psink, &gp) ? 1 : 0;
+  bgen_stats_codec_start(&vorbis->perf, clock);
+  return ret;
   }
 
 static int flush_data(vorbis_t * vorbis, int force)
   {
   ogg_packet op;
+  bgen_stats_clock_t clock;
   memset(&op, 0, sizeof(op));
+
+  bgen_stats_codec_start(&vorbis->perf, &clock);
+  
   /* While we can get enough data from the library to analyse, one
      block at a time... */
 
@@ -238,7 +262,7 @@ static int flush_data(vorbis_t * vorbis, int force)
       while(vorbis_bitrate_flushpacket(&vorbis->enc_vd, &op))
         {
         /* Add packet to bitstream */
-        if(!flush_packet(vorbis, &op))
+        if(!flush_packet(vorbis, &op, &clock))
           return 0;
         }
       }
@@ -246,10 +270,12 @@ static int flush_data(vorbis_t * vorbis, int force)
       {
       vorbis_analysis(&vorbis->enc_vb, &op);
       /* Add packet to bitstream */
-      if(!flush_packet(vorbis, &op))
+      if(!flush_packet(vorbis, &op, &clock))
         return 0;
       }
     }
+  bgen_stats_codec_end(&vorbis->perf, &clock);
+  
   /* Flush pages if any */
   //  if((result = bg_ogg_flush(&vorbis->enc_os, vorbis->output, force)) <= 0)
   //    return result;
@@ -265,6 +291,9 @@ write_audio_frame_vorbis(void * data, gavl_audio_frame_t * frame)
      
   vorbis = data;
 
+  if(vorbis->trace)
+    bgen_trace_frame(vorbis->trace, vorbis->samples_read, frame->valid_samples);
+  
   buffer = vorbis_analysis_buffer(&vorbis->enc_vd, frame->valid_samples);
 
   for(i = 0; i < vorbis->format->num_channels; i++)
@@ -280,6 +309,9 @@ write_audio_frame_vorbis(void * data, gavl_audio_frame_t * frame)
     return GAVL_SINK_ERROR;
 
   vorbis->samples_read += frame->valid_samples;
+  bgen_stats_lock(&vorbis->perf);
+  vorbis->perf.frames += frame->valid_samples;
+  bgen_stats_unlock(&vorbis->perf);
   return GAVL_SINK_OK;
   }
 
@@ -362,6 +394,8 @@ static gavl_audio_sink_t * init_vorbis(void * data,
                           header_codebooks.packet, header_codebooks.bytes);
   
   ci_ret->id = GAVL_CODEC_ID_VORBIS;
+  vorbis->perf.timescale = vorbis->format->samplerate;
+  vorbis->trace = bgen_trace_create(LOG_DOMAIN, "Encoder");
   return gavl_audio_sink_create(NULL, write_audio_frame_vorbis,
                                 vorbis, vorbis->format);
   }
@@ -422,7 +456,12 @@ static int close_vorbis(void * data)
     result = flush_data(vorbis, 1);
     if(result < 0)
       ret = 0;
+    bgen_stats_log(&vorbis->perf, LOG_DOMAIN, "Encoder");
     }
+  bgen_stats_unregister(&vorbis->perf);
+
+  if(vorbis->trace)
+    bgen_trace_destroy(vorbis->trace);
   
   vorbis_block_clear(&vorbis->enc_vb);
   vorbis_dsp_clear(&vorbis->enc_vd);